@@ -0,0 +1,385 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ContainerStats.h"
+
+/*
+ * Helpers shared by the benchmark binaries: command line options, running a
+ * body on several threads with a common start, and JSON output and input.
+ */
+
+class CCommandLine {
+public:
+    CCommandLine(int argc, char* argv[]) : m_arguments(argv + 1, argv + argc) {}
+
+    bool Has(const std::string& name) const {
+        return std::find(m_arguments.begin(), m_arguments.end(), name) != m_arguments.end();
+    }
+
+    std::string Get(const std::string& name, const std::string& fallback) const {
+        auto it = std::find(m_arguments.begin(), m_arguments.end(), name);
+        return (it != m_arguments.end() && it + 1 != m_arguments.end()) ? *(it + 1) : fallback;
+    }
+
+    long long GetInt(const std::string& name, long long fallback) const {
+        std::string value = Get(name, "");
+        return value.empty() ? fallback : std::atoll(value.c_str());
+    }
+
+    double GetDouble(const std::string& name, double fallback) const {
+        std::string value = Get(name, "");
+        return value.empty() ? fallback : std::atof(value.c_str());
+    }
+
+    // comma separated, e.g. --threads 1,2,4
+    std::vector<long long> GetList(const std::string& name, const std::vector<long long>& fallback) const {
+        std::string value = Get(name, "");
+        if (value.empty()) {
+            return fallback;
+        }
+        std::vector<long long> values;
+        std::stringstream stream(value);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            values.push_back(std::atoll(item.c_str()));
+        }
+        return values;
+    }
+
+private:
+    std::vector<std::string> m_arguments;
+};
+
+inline int HardwareThreads()
+{
+    return static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+}
+
+// 1, 2, 4, ... up to and including the number of hardware threads
+inline std::vector<long long> PowerOfTwoThreadCounts()
+{
+    std::vector<long long> counts;
+    for (long long threads = 1; threads < HardwareThreads(); threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(HardwareThreads());
+    return counts;
+}
+
+/*
+ * Runs body(threadIndex) on the given number of threads. All threads are
+ * created before any of them starts, the result is the wall time in seconds
+ * from the common start to the last thread finishing.
+ */
+inline double RunThreads(int threads, const std::function<void(int)>& body)
+{
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.push_back(std::thread([&ready, &go, &body, i]() {
+            ++ready;
+            while (!go.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            body(i);
+        }));
+    }
+    while (ready.load() != threads) {
+        std::this_thread::yield();
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline double Median(std::vector<double> values)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t middle = values.size() / 2;
+    return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+// Latency buckets of one thread per operation kind, merged into snapshots after the run
+class CLatencyHistograms {
+public:
+    explicit CLatencyHistograms(size_t operationKinds)
+        : m_buckets(operationKinds, std::vector<uint64_t>(LogLinearBuckets::Count, 0)) {}
+
+    void Record(size_t operation, uint64_t nanoseconds) {
+        ++m_buckets[operation][LogLinearBuckets::IndexOf(nanoseconds)];
+    }
+
+    static std::vector<HistogramSnapshot> Merge(const std::vector<CLatencyHistograms>& threads) {
+        std::vector<HistogramSnapshot> merged(threads.empty() ? 0 : threads.front().m_buckets.size());
+        for (auto thread = threads.begin(); thread != threads.end(); ++thread) {
+            for (size_t operation = 0; operation < merged.size(); ++operation) {
+                HistogramSnapshot& target = merged[operation];
+                for (size_t bucket = 0; bucket < LogLinearBuckets::Count; ++bucket) {
+                    uint64_t count = thread->m_buckets[operation][bucket];
+                    target.counts[bucket] += count;
+                    target.count += count;
+                    if (count != 0) {
+                        target.max = std::max(target.max, LogLinearBuckets::ValueOf(bucket));
+                    }
+                }
+            }
+        }
+        for (auto it = merged.begin(); it != merged.end(); ++it) {
+            it->UpdatePercentiles();
+        }
+        return merged;
+    }
+
+private:
+    std::vector<std::vector<uint64_t> > m_buckets;
+};
+
+// Streaming JSON writer, inserts the separators itself
+class CJsonWriter {
+public:
+    explicit CJsonWriter(std::ostream& out) : m_out(out), m_first(1, true), m_afterKey(false) {}
+
+    CJsonWriter& BeginObject() { Separate(); m_out << '{'; m_first.push_back(true); return *this; }
+    CJsonWriter& EndObject() { m_first.pop_back(); m_out << '}'; return *this; }
+    CJsonWriter& BeginArray() { Separate(); m_out << '['; m_first.push_back(true); return *this; }
+    CJsonWriter& EndArray() { m_first.pop_back(); m_out << ']'; return *this; }
+
+    CJsonWriter& Key(const std::string& name) {
+        Separate();
+        WriteString(name);
+        m_out << ':';
+        m_afterKey = true;
+        return *this;
+    }
+
+    CJsonWriter& String(const std::string& value) { Separate(); WriteString(value); return *this; }
+    CJsonWriter& Bool(bool value) { Separate(); m_out << (value ? "true" : "false"); return *this; }
+    CJsonWriter& Integer(long long value) { Separate(); m_out << value; return *this; }
+
+    CJsonWriter& Number(double value) {
+        Separate();
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.6g", value);
+        m_out << buffer;
+        return *this;
+    }
+
+private:
+    void Separate() {
+        if (m_afterKey) {
+            m_afterKey = false;
+            return;
+        }
+        if (!m_first.back()) {
+            m_out << ',';
+        }
+        m_first.back() = false;
+    }
+
+    void WriteString(const std::string& value) {
+        m_out << '"';
+        for (auto it = value.begin(); it != value.end(); ++it) {
+            switch (*it) {
+            case '"': m_out << "\\\""; break;
+            case '\\': m_out << "\\\\"; break;
+            case '\n': m_out << "\\n"; break;
+            case '\t': m_out << "\\t"; break;
+            default: m_out << *it; break;
+            }
+        }
+        m_out << '"';
+    }
+
+private:
+    std::ostream& m_out;
+    std::vector<bool> m_first;
+    bool m_afterKey;
+};
+
+/*
+ * Minimal JSON reader for the files the writer above produces (baselines).
+ * No unicode escapes; numbers are read as double. Throws std::runtime_error
+ * on malformed input.
+ */
+class CJsonValue {
+public:
+    enum Type { Null, Boolean, Number, String, Array, Object };
+
+    CJsonValue() : m_type(Null), m_number(0) {}
+
+    static CJsonValue Parse(std::istream& in) {
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t position = 0;
+        CJsonValue value = ParseValue(text, position);
+        SkipSpace(text, position);
+        if (position != text.size()) {
+            throw std::runtime_error("trailing characters after JSON value");
+        }
+        return value;
+    }
+
+    Type GetType() const { return m_type; }
+    double AsNumber() const { Expect(Number); return m_number; }
+    bool AsBool() const { Expect(Boolean); return m_number != 0; }
+    const std::string& AsString() const { Expect(String); return m_string; }
+    const std::vector<CJsonValue>& Items() const { Expect(Array); return m_items; }
+
+    bool Has(const std::string& key) const { return m_type == Object && m_members.count(key) != 0; }
+
+    const CJsonValue& operator[](const std::string& key) const {
+        Expect(Object);
+        auto it = m_members.find(key);
+        if (it == m_members.end()) {
+            throw std::runtime_error("missing JSON member " + key);
+        }
+        return it->second;
+    }
+
+private:
+    void Expect(Type type) const {
+        if (m_type != type) {
+            throw std::runtime_error("unexpected JSON value type");
+        }
+    }
+
+    static void SkipSpace(const std::string& text, size_t& position) {
+        while (position < text.size() && (text[position] == ' ' || text[position] == '\t'
+                                          || text[position] == '\r' || text[position] == '\n')) {
+            ++position;
+        }
+    }
+
+    static char Next(const std::string& text, size_t& position) {
+        SkipSpace(text, position);
+        if (position == text.size()) {
+            throw std::runtime_error("unexpected end of JSON");
+        }
+        return text[position];
+    }
+
+    static void Consume(const std::string& text, size_t& position, const char* literal) {
+        size_t length = std::strlen(literal);
+        if (text.compare(position, length, literal) != 0) {
+            throw std::runtime_error(std::string("expected ") + literal + " in JSON");
+        }
+        position += length;
+    }
+
+    static std::string ParseString(const std::string& text, size_t& position) {
+        Consume(text, position, "\"");
+        std::string value;
+        while (position < text.size() && text[position] != '"') {
+            char c = text[position++];
+            if (c == '\\' && position < text.size()) {
+                c = text[position++];
+                c = c == 'n' ? '\n' : c == 't' ? '\t' : c;
+            }
+            value += c;
+        }
+        Consume(text, position, "\"");
+        return value;
+    }
+
+    static CJsonValue ParseValue(const std::string& text, size_t& position) {
+        CJsonValue value;
+        char c = Next(text, position);
+        if (c == '{') {
+            value.m_type = Object;
+            ++position;
+            if (Next(text, position) == '}') {
+                ++position;
+                return value;
+            }
+            for (;;) {
+                Next(text, position);
+                std::string key = ParseString(text, position);
+                Next(text, position);
+                Consume(text, position, ":");
+                value.m_members[key] = ParseValue(text, position);
+                if (Next(text, position) == '}') {
+                    ++position;
+                    return value;
+                }
+                Consume(text, position, ",");
+            }
+        } else if (c == '[') {
+            value.m_type = Array;
+            ++position;
+            if (Next(text, position) == ']') {
+                ++position;
+                return value;
+            }
+            for (;;) {
+                value.m_items.push_back(ParseValue(text, position));
+                if (Next(text, position) == ']') {
+                    ++position;
+                    return value;
+                }
+                Consume(text, position, ",");
+            }
+        } else if (c == '"') {
+            value.m_type = String;
+            value.m_string = ParseString(text, position);
+        } else if (c == 't' || c == 'f') {
+            value.m_type = Boolean;
+            value.m_number = c == 't' ? 1 : 0;
+            Consume(text, position, c == 't' ? "true" : "false");
+        } else if (c == 'n') {
+            Consume(text, position, "null");
+        } else {
+            char* end = nullptr;
+            value.m_type = Number;
+            value.m_number = std::strtod(text.c_str() + position, &end);
+            if (end == text.c_str() + position) {
+                throw std::runtime_error("malformed JSON number");
+            }
+            position = end - text.c_str();
+        }
+        return value;
+    }
+
+private:
+    Type m_type;
+    double m_number;
+    std::string m_string;
+    std::vector<CJsonValue> m_items;
+    std::map<std::string, CJsonValue> m_members;
+};
+
+inline void WriteBuildInfo(CJsonWriter& json)
+{
+    json.Key("build").BeginObject();
+#if defined(__VERSION__)
+    json.Key("compiler").String(__VERSION__);
+#endif
+#if defined(__OPTIMIZE__) || (defined(_MSC_VER) && !defined(_DEBUG))
+    json.Key("optimized").Bool(true);
+#else
+    json.Key("optimized").Bool(false);
+#endif
+    json.Key("timestamp").Integer(static_cast<long long>(std::time(nullptr)));
+    json.Key("hardware_threads").Integer(HardwareThreads());
+    json.EndObject();
+}
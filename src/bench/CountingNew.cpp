@@ -0,0 +1,111 @@
+#include <cstdlib>
+#include <new>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include "AllocationTracker.h"
+
+/*
+ * Replaces the global allocation functions of the benchmark binary so every
+ * allocation made inside a container operation is reported to
+ * ProcessAllocationTracker(), including the ones of the stored objects.
+ * With glibc both sides count the allocator's usable size, so an allocation
+ * and its free cancel out whether or not the free is sized; elsewhere an
+ * unsized free counts 0.
+ */
+
+namespace {
+
+void* countedAllocate(size_t size)
+{
+    void* memory = std::malloc(size == 0 ? 1 : size);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    CAllocationTracker* tracker = ProcessAllocationTracker().load(std::memory_order_relaxed);
+    if (tracker != nullptr) {
+#if defined(__GLIBC__)
+        tracker->Allocated(malloc_usable_size(memory));
+#else
+        tracker->Allocated(size);
+#endif
+    }
+    return memory;
+}
+
+void countedFree(void* memory, size_t size)
+{
+    if (memory == nullptr) {
+        return;
+    }
+    CAllocationTracker* tracker = ProcessAllocationTracker().load(std::memory_order_relaxed);
+    if (tracker != nullptr) {
+#if defined(__GLIBC__)
+        (void)size;
+        tracker->Freed(malloc_usable_size(memory));
+#else
+        tracker->Freed(size);
+#endif
+    }
+    std::free(memory);
+}
+
+}
+
+void* operator new(size_t size)
+{
+    return countedAllocate(size);
+}
+
+void* operator new[](size_t size)
+{
+    return countedAllocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return countedAllocate(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return countedAllocate(size);
+    } catch (const std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void operator delete(void* memory) noexcept
+{
+    countedFree(memory, 0);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    countedFree(memory, 0);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+    countedFree(memory, 0);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+    countedFree(memory, 0);
+}
+
+void operator delete(void* memory, size_t size) noexcept
+{
+    countedFree(memory, size);
+}
+
+void operator delete[](void* memory, size_t size) noexcept
+{
+    countedFree(memory, size);
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum class PerfEvent {
+    Cycles,
+    Instructions,
+    L1DataMisses,
+    LastLevelCacheMisses,
+    DataTlbMisses,
+    BranchMisses,
+    ContextSwitches
+};
+const size_t PerfEventCount = 7;
+
+inline const char* ToString(PerfEvent event)
+{
+    switch (event) {
+    case PerfEvent::Cycles: return "cycles";
+    case PerfEvent::Instructions: return "instructions";
+    case PerfEvent::L1DataMisses: return "l1d_misses";
+    case PerfEvent::LastLevelCacheMisses: return "llc_misses";
+    case PerfEvent::DataTlbMisses: return "dtlb_misses";
+    case PerfEvent::BranchMisses: return "branch_misses";
+    case PerfEvent::ContextSwitches: return "context_switches";
+    }
+    return "unknown";
+}
+
+// Counter totals of one measured region, scaled up when the kernel multiplexed the counters
+struct PerfSample {
+    PerfSample() {
+        for (size_t i = 0; i < PerfEventCount; ++i) {
+            available[i] = false;
+            values[i] = 0;
+        }
+    }
+
+    PerfSample& operator+=(const PerfSample& other) {
+        for (size_t i = 0; i < PerfEventCount; ++i) {
+            available[i] = available[i] || other.available[i];
+            values[i] += other.values[i];
+        }
+        return *this;
+    }
+
+    bool available[PerfEventCount];
+    double values[PerfEventCount];
+};
+
+/*
+ * Hardware and software counters through perf_event_open, counting the
+ * calling thread and every thread it creates while the counters run (so
+ * construct it on the thread that starts the benchmark threads).
+ * Each event is opened on its own; events the kernel, the CPU or the
+ * sandbox refuse are left out of the samples and listed in Reason(); when
+ * none can be opened Start/Stop do nothing.
+ */
+class CPerfCounters {
+public:
+    CPerfCounters();
+    ~CPerfCounters();
+    bool Available() const;
+    const std::string& Reason() const { return m_reason; }
+    void Start();
+    PerfSample Stop();
+private:
+    CPerfCounters(const CPerfCounters&);
+    CPerfCounters& operator=(const CPerfCounters&);
+    int Open(PerfEvent event);
+private:
+    int m_fds[PerfEventCount];
+    std::string m_reason;
+};
+
+inline CPerfCounters::CPerfCounters()
+{
+    for (size_t i = 0; i < PerfEventCount; ++i) {
+        m_fds[i] = Open(static_cast<PerfEvent>(i));
+    }
+}
+
+inline CPerfCounters::~CPerfCounters()
+{
+#if defined(__linux__)
+    for (size_t i = 0; i < PerfEventCount; ++i) {
+        if (m_fds[i] >= 0) {
+            close(m_fds[i]);
+        }
+    }
+#endif
+}
+
+inline bool CPerfCounters::Available() const
+{
+    for (size_t i = 0; i < PerfEventCount; ++i) {
+        if (m_fds[i] >= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void CPerfCounters::Start()
+{
+#if defined(__linux__)
+    for (size_t i = 0; i < PerfEventCount; ++i) {
+        if (m_fds[i] >= 0) {
+            ioctl(m_fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+inline PerfSample CPerfCounters::Stop()
+{
+    PerfSample sample;
+#if defined(__linux__)
+    for (size_t i = 0; i < PerfEventCount; ++i) {
+        if (m_fds[i] >= 0) {
+            ioctl(m_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (size_t i = 0; i < PerfEventCount; ++i) {
+        uint64_t read[3] = { 0, 0, 0 }; // value, time enabled, time running
+        if (m_fds[i] < 0 || ::read(m_fds[i], read, sizeof(read)) != static_cast<ssize_t>(sizeof(read))) {
+            continue;
+        }
+        sample.available[i] = true;
+        sample.values[i] = read[2] == 0 ? 0 : static_cast<double>(read[0]) * read[1] / read[2];
+    }
+#endif
+    return sample;
+}
+
+inline int CPerfCounters::Open(PerfEvent event)
+{
+#if defined(__linux__)
+    perf_event_attr attributes;
+    std::memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.disabled = 1;
+    attributes.inherit = 1;
+    attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    const uint64_t readMiss = PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    switch (event) {
+    case PerfEvent::Cycles:
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PerfEvent::Instructions:
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PerfEvent::L1DataMisses:
+        attributes.type = PERF_TYPE_HW_CACHE;
+        attributes.config = PERF_COUNT_HW_CACHE_L1D | readMiss;
+        break;
+    case PerfEvent::LastLevelCacheMisses:
+        attributes.type = PERF_TYPE_HW_CACHE;
+        attributes.config = PERF_COUNT_HW_CACHE_LL | readMiss;
+        break;
+    case PerfEvent::DataTlbMisses:
+        attributes.type = PERF_TYPE_HW_CACHE;
+        attributes.config = PERF_COUNT_HW_CACHE_DTLB | readMiss;
+        break;
+    case PerfEvent::BranchMisses:
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    case PerfEvent::ContextSwitches:
+        attributes.type = PERF_TYPE_SOFTWARE;
+        attributes.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+        break;
+    }
+    // count kernel time where allowed, user space only under a stricter perf_event_paranoid
+    for (int excludeKernel = 0; excludeKernel < 2; ++excludeKernel) {
+        attributes.exclude_kernel = excludeKernel;
+        attributes.exclude_hv = excludeKernel;
+        int fd = static_cast<int>(syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0));
+        if (fd >= 0) {
+            return fd;
+        }
+        if (excludeKernel == 1) {
+            m_reason += (m_reason.empty() ? "" : "; ") + std::string(ToString(event)) + ": " + std::strerror(errno);
+        }
+    }
+    return -1;
+#else
+    (void)event;
+    m_reason = "perf_event_open is only available on Linux";
+    return -1;
+#endif
+}
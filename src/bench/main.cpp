@@ -0,0 +1,487 @@
+#include <fstream>
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include "SomeContainer.h"
+#include "BenchHarness.h"
+#include "PerfCounters.h"
+
+/*
+ * Microbenchmarks for CSomeContainer. Every case runs on a fresh container,
+ * prefilled outside the timed region, with fixed per-thread seeds so runs are
+ * repeatable. Results go to stdout (or --output) as JSON, a summary to stderr.
+ *
+ *   --suite micro|locks|memory
+ *                           micro: every operation over --threads and --sizes (default)
+ *                           locks: std::mutex against CAdaptiveMutex at 1, 8, 32, 128 threads
+ *                           memory: MemoryUsage() and resident memory from 1K to 100M entries (--sizes),
+ *                           sizes that would not fit in physical memory are skipped
+ *   --threads 1,2,4         thread counts, default powers of two up to the hardware threads
+ *   --sizes 1000,100000     container sizes
+ *   --operations N          operations per case for the random access cases
+ *   --repetitions N         runs per case, the JSON keeps all of them
+ *   --perf                  collect hardware counters per case, reported per operation (Linux)
+ *   --allocations           count allocations per operation type and the container's bytes per entry
+ *   --tracing               run with span tracing enabled, to measure its overhead
+ *   --wal path              log the timed writes to a write-ahead log at path (files removed afterwards)
+ *   --output file.json
+ */
+
+struct BenchmarkCase {
+    std::string name;
+    std::string config;
+    int threads;
+    long long size;
+    int readPercent;
+    long long operations;
+    std::vector<double> seconds;
+    PerfSample perf; // summed over the repetitions
+    bool trackAllocations;
+    bool tracing;
+    std::string walPath;
+    AllocationStats allocations;        // container's own allocations in the timed region of the last repetition
+    AllocationStats processAllocations; // every allocation inside a container operation, same region
+    double bytesPerEntry;               // container's live bytes per entry after the last repetition
+};
+
+AllocationStats processAllocations() {
+    CAllocationTracker* tracker = ProcessAllocationTracker().load();
+    return tracker != nullptr ? tracker->Snapshot() : AllocationStats();
+}
+
+// a run without checkpoints writes the first segment only
+void removeLog(const std::string& path) {
+    std::remove(CWriteAheadLog::BasePath(path).c_str());
+    std::remove(CWriteAheadLog::SegmentPath(path, 1).c_str());
+}
+
+template<typename LockPolicy>
+void fill(CSomeContainer<int, LockPolicy>& container, long long size) {
+    for (long long i = 0; i < size; ++i) {
+        container.Register(static_cast<int>(i), std::auto_ptr<int>(new int(static_cast<int>(i))));
+    }
+}
+
+template<typename LockPolicy>
+double runCase(BenchmarkCase& benchmark, WriteMode writeMode, CPerfCounters* counters) {
+    CSomeContainer<int, LockPolicy> container;
+    container.SetWriteMode(writeMode);
+    if (benchmark.trackAllocations) {
+        container.EnableAllocationTracking();
+    }
+    if (benchmark.tracing) {
+        container.EnableTracing();
+    }
+    const std::string& name = benchmark.name;
+    const int threads = benchmark.threads;
+    const long long size = benchmark.size;
+    if (name != "Register") {
+        fill(container, size);
+    }
+    if (!benchmark.walPath.empty()) {
+        removeLog(benchmark.walPath);
+        container.EnableWriteAheadLog(benchmark.walPath);
+    }
+
+    if (name == "Register" || name == "Unregister") {
+        benchmark.operations = size;
+    } else if (name == "Iterate") {
+        benchmark.operations = size * threads;
+    }
+    const long long perThread = benchmark.operations / threads;
+    const int readPercent = benchmark.readPercent;
+
+    AllocationStats allocationsBefore = container.Allocations();
+    AllocationStats processBefore = processAllocations();
+    // the counters also see the thread start-up in RunThreads, a fixed cost next to the operations
+    if (counters != nullptr) {
+        counters->Start();
+    }
+    double seconds = RunThreads(threads, [&](int thread) {
+        std::minstd_rand random(thread + 1);
+        long long first = perThread * thread;
+        // the last thread takes the remainder, every counted operation runs and every id is touched
+        long long count = thread == threads - 1 ? benchmark.operations - first : perThread;
+        if (name == "Register") {
+            for (long long i = first; i < first + count; ++i) {
+                container.Register(static_cast<int>(i), std::auto_ptr<int>(new int(0)));
+            }
+        } else if (name == "Unregister") {
+            for (long long i = first; i < first + count; ++i) {
+                container.Unregister(static_cast<int>(i));
+            }
+        } else if (name == "QueryHit") {
+            for (long long i = 0; i < count; ++i) {
+                container.Query(static_cast<int>(random() % size));
+            }
+        } else if (name == "QueryMiss") {
+            for (long long i = 0; i < count; ++i) {
+                try {
+                    container.Query(static_cast<int>(size + random() % size));
+                } catch (const std::out_of_range&) {
+                }
+            }
+        } else if (name == "Replace") {
+            for (long long i = 0; i < count; ++i) {
+                int id = static_cast<int>(random() % size);
+                container.Register(id, std::auto_ptr<int>(new int(id)));
+            }
+        } else if (name == "Iterate") {
+            for (auto it = container.Start(); !(it == container.End()); ++it) {
+                *it;
+            }
+        } else if (name == "Mixed") {
+            for (long long i = 0; i < count; ++i) {
+                int id = static_cast<int>(random() % size);
+                if (static_cast<int>(random() % 100) < readPercent) {
+                    container.Query(id);
+                } else {
+                    container.Register(id, std::auto_ptr<int>(new int(id)));
+                }
+            }
+        }
+    });
+    if (counters != nullptr) {
+        benchmark.perf += counters->Stop();
+    }
+    if (benchmark.trackAllocations) {
+        AllocationStats allocations = container.Allocations();
+        benchmark.allocations = allocations.Since(allocationsBefore);
+        benchmark.processAllocations = processAllocations().Since(processBefore);
+        benchmark.bytesPerEntry = allocations.BytesPerEntry();
+    }
+    return seconds;
+}
+
+double runConfigured(BenchmarkCase& benchmark, CPerfCounters* counters) {
+    if (benchmark.config == "adaptive") {
+        return runCase<CAdaptiveMutex>(benchmark, WriteMode::Locking, counters);
+    } else if (benchmark.config == "combining") {
+        return runCase<std::mutex>(benchmark, WriteMode::FlatCombining, counters);
+    }
+    return runCase<std::mutex>(benchmark, WriteMode::Locking, counters);
+}
+
+std::vector<BenchmarkCase> microSuite(const CCommandLine& options) {
+    std::vector<long long> threadCounts = options.GetList("--threads", PowerOfTwoThreadCounts());
+    std::vector<long long> sizes = options.GetList("--sizes", std::vector<long long>({ 1000, 100000 }));
+    long long operations = options.GetInt("--operations", 200000);
+    const char* configs[] = { "mutex", "adaptive", "combining" };
+    const char* names[] = { "Register", "QueryHit", "QueryMiss", "Unregister", "Replace", "Iterate" };
+    const int readPercents[] = { 50, 90, 99 };
+
+    std::vector<BenchmarkCase> cases;
+    for (const char* config : configs) {
+        for (long long threads : threadCounts) {
+            for (long long size : sizes) {
+                BenchmarkCase benchmark;
+                benchmark.config = config;
+                benchmark.threads = static_cast<int>(threads);
+                benchmark.size = size;
+                benchmark.readPercent = -1;
+                benchmark.operations = operations;
+                for (const char* name : names) {
+                    benchmark.name = name;
+                    cases.push_back(benchmark);
+                }
+                benchmark.name = "Mixed";
+                for (int readPercent : readPercents) {
+                    benchmark.readPercent = readPercent;
+                    cases.push_back(benchmark);
+                }
+            }
+        }
+    }
+    return cases;
+}
+
+std::vector<BenchmarkCase> lockSuite(const CCommandLine& options) {
+    std::vector<long long> threadCounts = options.GetList("--threads", std::vector<long long>({ 1, 8, 32, 128 }));
+    if (!options.Has("--threads") && 2 * HardwareThreads() > 128) {
+        threadCounts.push_back(2 * HardwareThreads()); // keep an oversubscribed run on large machines
+    }
+    long long operations = options.GetInt("--operations", 1000000);
+    const char* configs[] = { "mutex", "adaptive" };
+    const int readPercents[] = { 100, 90 };
+
+    std::vector<BenchmarkCase> cases;
+    for (long long threads : threadCounts) {
+        for (int readPercent : readPercents) {
+            for (const char* config : configs) {
+                BenchmarkCase benchmark;
+                benchmark.name = "Mixed";
+                benchmark.config = config;
+                benchmark.threads = static_cast<int>(threads);
+                benchmark.size = 1024;
+                benchmark.readPercent = readPercent;
+                benchmark.operations = operations;
+                cases.push_back(benchmark);
+            }
+        }
+    }
+    return cases;
+}
+
+void writeAllocations(CJsonWriter& json, const AllocationStats& stats) {
+    for (size_t operation = 0; operation < ContainerOperationCount; ++operation) {
+        const AllocationCounts& counts = stats.operations[operation];
+        if (counts.calls == 0) {
+            continue;
+        }
+        json.Key(ToString(static_cast<ContainerOperation>(operation))).BeginObject();
+        json.Key("calls").Integer(static_cast<long long>(counts.calls));
+        json.Key("allocations_per_call").Number(counts.AllocationsPerCall());
+        json.Key("bytes_per_call").Number(counts.BytesPerCall());
+        json.Key("frees").Integer(static_cast<long long>(counts.frees));
+        json.Key("freed_bytes").Integer(static_cast<long long>(counts.freedBytes));
+        json.EndObject();
+    }
+}
+
+void writeResults(std::ostream& out, const std::string& suite, const std::vector<BenchmarkCase>& cases,
+                  const CPerfCounters* counters) {
+    CJsonWriter json(out);
+    json.BeginObject();
+    json.Key("schema").Integer(1);
+    json.Key("suite").String(suite);
+    WriteBuildInfo(json);
+    if (counters != nullptr) {
+        json.Key("perf_counters").BeginObject();
+        json.Key("available").Bool(counters->Available());
+        if (!counters->Reason().empty()) {
+            json.Key("unavailable").String(counters->Reason());
+        }
+        json.EndObject();
+    }
+    json.Key("results").BeginArray();
+    for (auto it = cases.begin(); it != cases.end(); ++it) {
+        double seconds = Median(it->seconds);
+        json.BeginObject();
+        json.Key("name").String(it->name);
+        json.Key("config").String(it->config);
+        json.Key("threads").Integer(it->threads);
+        json.Key("size").Integer(it->size);
+        if (it->readPercent >= 0) {
+            json.Key("read_percent").Integer(it->readPercent);
+        }
+        json.Key("operations").Integer(it->operations);
+        json.Key("oversubscribed").Bool(it->threads > HardwareThreads());
+        json.Key("tracing").Bool(it->tracing);
+        json.Key("write_ahead_log").Bool(!it->walPath.empty());
+        json.Key("median_seconds").Number(seconds);
+        json.Key("ops_per_second").Number(it->operations / seconds);
+        json.Key("ns_per_op").Number(seconds * 1e9 / it->operations);
+        json.Key("repetitions").BeginArray();
+        for (auto run = it->seconds.begin(); run != it->seconds.end(); ++run) {
+            json.Number(*run);
+        }
+        json.EndArray();
+        if (it->trackAllocations) {
+            json.Key("allocations").BeginObject();
+            json.Key("entries").Integer(static_cast<long long>(it->allocations.entries));
+            json.Key("container_bytes_per_entry").Number(it->bytesPerEntry);
+            json.Key("container").BeginObject();
+            writeAllocations(json, it->allocations);
+            json.EndObject();
+            json.Key("process").BeginObject();
+            writeAllocations(json, it->processAllocations);
+            json.EndObject();
+            json.EndObject();
+        }
+        if (counters != nullptr && counters->Available()) {
+            double operations = static_cast<double>(it->operations) * it->seconds.size();
+            json.Key("per_op").BeginObject();
+            for (size_t event = 0; event < PerfEventCount; ++event) {
+                if (it->perf.available[event]) {
+                    json.Key(ToString(static_cast<PerfEvent>(event))).Number(it->perf.values[event] / operations);
+                }
+            }
+            json.EndObject();
+        }
+        json.EndObject();
+    }
+    json.EndArray();
+    json.EndObject();
+    out << "\n";
+}
+
+struct MemoryCase {
+    long long size;
+    double fillSeconds;
+    ContainerMemoryUsage usage;
+    long long residentBytes; // growth of the resident set while filling, -1 when unknown
+};
+
+long long residentBytes() {
+#if defined(__linux__)
+    std::ifstream statm("/proc/self/statm");
+    long long pages = 0;
+    long long resident = 0;
+    if (statm >> pages >> resident) {
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+#endif
+    return -1;
+}
+
+long long physicalMemory() {
+#if defined(__linux__)
+    return static_cast<long long>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+#else
+    return -1;
+#endif
+}
+
+std::vector<MemoryCase> memorySuite(const CCommandLine& options) {
+    std::vector<long long> sizes = options.GetList("--sizes", std::vector<long long>({
+        1000, 10000, 100000, 1000000, 10000000, 100000000 }));
+    std::vector<MemoryCase> cases;
+    double bytesPerEntry = 256; // until the first size is measured
+    for (auto size = sizes.begin(); size != sizes.end(); ++size) {
+        if (physicalMemory() > 0 && *size * bytesPerEntry > physicalMemory() * 0.8) {
+            std::fprintf(stderr, "memory     skipping %lld entries, about %.1f GiB would not fit\n", *size,
+                         *size * bytesPerEntry / (1 << 30));
+            continue;
+        }
+        MemoryCase memory;
+        memory.size = *size;
+        long long residentBefore = residentBytes();
+        {
+            CSomeContainer<int> container;
+            auto start = std::chrono::steady_clock::now();
+            fill(container, *size);
+            memory.fillSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            memory.usage = container.MemoryUsage();
+            long long residentAfter = residentBytes();
+            memory.residentBytes = residentBefore < 0 ? -1 : residentAfter - residentBefore;
+        }
+        if (memory.residentBytes > 0) {
+            bytesPerEntry = std::max(bytesPerEntry / 2, static_cast<double>(memory.residentBytes) / *size);
+        }
+        std::fprintf(stderr, "memory     entries=%-10lld node=%zu B  %.1f B/entry  payload %zu B  overhead x%.2f"
+                             "  resident %.1f B/entry  heap free %.1f%%\n",
+                     *size, memory.usage.nodeBytes, memory.usage.BytesPerEntry(), memory.usage.payloadBytes,
+                     memory.usage.OverheadRatio(), static_cast<double>(memory.residentBytes) / *size,
+                     memory.usage.heapFragmentation * 100);
+        cases.push_back(memory);
+    }
+    return cases;
+}
+
+void writeMemoryResults(std::ostream& out, const std::vector<MemoryCase>& cases) {
+    CJsonWriter json(out);
+    json.BeginObject();
+    json.Key("schema").Integer(1);
+    json.Key("suite").String("memory");
+    WriteBuildInfo(json);
+    json.Key("results").BeginArray();
+    for (auto it = cases.begin(); it != cases.end(); ++it) {
+        const ContainerMemoryUsage& usage = it->usage;
+        json.BeginObject();
+        json.Key("entries").Integer(static_cast<long long>(usage.entries));
+        json.Key("node_bytes").Integer(static_cast<long long>(usage.nodeBytes));
+        json.Key("storage_bytes").Integer(static_cast<long long>(usage.storageBytes));
+        json.Key("allocated_bytes").Integer(static_cast<long long>(usage.allocatedBytes));
+        json.Key("bytes_per_entry").Number(usage.BytesPerEntry());
+        if (usage.payloadKnown) {
+            json.Key("payload_bytes").Integer(static_cast<long long>(usage.payloadBytes));
+            json.Key("overhead_ratio").Number(usage.OverheadRatio());
+        }
+        if (usage.heapFragmentation >= 0) {
+            json.Key("heap_fragmentation").Number(usage.heapFragmentation);
+        }
+        if (it->residentBytes >= 0) {
+            json.Key("resident_bytes_per_entry").Number(static_cast<double>(it->residentBytes) / it->size);
+        }
+        json.Key("fill_seconds").Number(it->fillSeconds);
+        json.EndObject();
+    }
+    json.EndArray();
+    json.EndObject();
+    out << "\n";
+}
+
+int main(int argc, char* argv[]) {
+    CCommandLine options(argc, argv);
+    std::string suite = options.Get("--suite", "micro");
+    int repetitions = static_cast<int>(std::max(1LL, options.GetInt("--repetitions", 3)));
+    std::string output = options.Get("--output", "");
+
+    if (suite == "memory") {
+        std::vector<MemoryCase> cases = memorySuite(options);
+        if (output.empty()) {
+            writeMemoryResults(std::cout, cases);
+        } else {
+            std::ofstream file(output.c_str());
+            writeMemoryResults(file, cases);
+        }
+        return 0;
+    }
+
+    std::unique_ptr<CPerfCounters> counters;
+    if (options.Has("--perf")) {
+        counters.reset(new CPerfCounters);
+        if (!counters->Available()) {
+            std::fprintf(stderr, "perf counters unavailable (%s), running without them\n", counters->Reason().c_str());
+        }
+    }
+    CPerfCounters* activeCounters = counters && counters->Available() ? counters.get() : nullptr;
+
+    // the interposed operator new (CountingNew.cpp) reports here while it is installed
+    CAllocationTracker processTracker;
+    if (options.Has("--allocations")) {
+        ProcessAllocationTracker().store(&processTracker);
+    }
+
+    std::vector<BenchmarkCase> cases = suite == "locks" ? lockSuite(options) : microSuite(options);
+    for (auto it = cases.begin(); it != cases.end(); ++it) {
+        it->trackAllocations = options.Has("--allocations");
+        it->tracing = options.Has("--tracing");
+        it->walPath = options.Get("--wal", "");
+        for (int i = 0; i < repetitions; ++i) {
+            it->seconds.push_back(runConfigured(*it, activeCounters));
+            if (!it->walPath.empty()) {
+                removeLog(it->walPath);
+            }
+        }
+        double seconds = Median(it->seconds);
+        std::fprintf(stderr, "%-10s %-9s threads=%-4d size=%-8lld read=%-4d %12.0f ops/s %9.1f ns/op%s\n",
+                     it->name.c_str(), it->config.c_str(), it->threads, it->size, it->readPercent,
+                     it->operations / seconds, seconds * 1e9 / it->operations,
+                     it->threads > HardwareThreads() ? " (oversubscribed)" : "");
+        if (activeCounters != nullptr) {
+            std::fprintf(stderr, "          ");
+            double operations = static_cast<double>(it->operations) * it->seconds.size();
+            for (size_t event = 0; event < PerfEventCount; ++event) {
+                if (it->perf.available[event]) {
+                    std::fprintf(stderr, " %s/op=%.3g", ToString(static_cast<PerfEvent>(event)), it->perf.values[event] / operations);
+                }
+            }
+            std::fprintf(stderr, "\n");
+        }
+        if (it->trackAllocations) {
+            std::fprintf(stderr, "           container %.1f bytes/entry", it->bytesPerEntry);
+            for (size_t operation = 0; operation < ContainerOperationCount; ++operation) {
+                const AllocationCounts& counts = it->processAllocations.operations[operation];
+                if (counts.calls != 0) {
+                    std::fprintf(stderr, "  %s %.2f allocs %.0f B/call", ToString(static_cast<ContainerOperation>(operation)),
+                                 counts.AllocationsPerCall(), counts.BytesPerCall());
+                }
+            }
+            std::fprintf(stderr, "\n");
+        }
+    }
+
+    ProcessAllocationTracker().store(nullptr);
+
+    if (output.empty()) {
+        writeResults(std::cout, suite, cases, counters.get());
+    } else {
+        std::ofstream file(output.c_str());
+        writeResults(file, suite, cases, counters.get());
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <thread>
 #include <iostream>
+#include <vector>
 #include "SomeContainer.h"
 
 class DummyObject {
@@ -26,9 +27,17 @@ private:
     int i;
 };
 
+std::auto_ptr<DummyObject> makeObject(int i) {
+    return std::auto_ptr<DummyObject>(new DummyObject(i));
+}
+
 void insertItems(CSomeContainer<DummyObject>& container, int start, int count) {
+    std::vector<std::future<void>> constructed;
     for (int i = start; i < start+count; ++i) {
-        container.Register(i, std::auto_ptr<DummyObject>(new DummyObject(i)));
+        constructed.push_back(container.RegisterAsync(i, std::bind(makeObject, i)));
+    }
+    for (auto it = constructed.begin(); it != constructed.end(); ++it) {
+        it->get();
     }
 }
 
@@ -50,6 +59,7 @@ void iterate(CSomeContainer<DummyObject>& container) {
 
 int main() {
     CSomeContainer<DummyObject> container;
+    container.SetTeardown(TeardownMode::Parallel, 8);
     std::cout << "populating container...\n";
     insertItems(container, 0, 10);
     std::cout << "Done.\nStarting threads...\n";
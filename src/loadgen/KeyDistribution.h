@@ -0,0 +1,157 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+/*
+ * Key distributions for the load generator. Next() is called by a single
+ * thread: every worker gets its own copy through ForThread, so expensive
+ * setup (the Zipf constants) is done once.
+ */
+class CKeyDistribution {
+public:
+    virtual ~CKeyDistribution() {}
+    virtual int Next(std::mt19937_64& random) = 0;
+    virtual std::unique_ptr<CKeyDistribution> ForThread(int thread, int threads) const = 0;
+};
+
+class CUniformKeys : public CKeyDistribution {
+public:
+    explicit CUniformKeys(int keySpace) : m_keys(0, keySpace - 1) {}
+    int Next(std::mt19937_64& random) override { return m_keys(random); }
+    std::unique_ptr<CKeyDistribution> ForThread(int, int) const override {
+        return std::unique_ptr<CKeyDistribution>(new CUniformKeys(*this));
+    }
+private:
+    std::uniform_int_distribution<int> m_keys;
+};
+
+// Thread t visits t, t + stride, t + 2 * stride, ... wrapping around the key space
+class CSequentialKeys : public CKeyDistribution {
+public:
+    CSequentialKeys(int keySpace, int first, int stride) : m_keySpace(keySpace), m_next(first), m_stride(stride) {}
+    int Next(std::mt19937_64&) override {
+        int key = static_cast<int>(m_next % m_keySpace);
+        m_next += m_stride;
+        return key;
+    }
+    std::unique_ptr<CKeyDistribution> ForThread(int thread, int threads) const override {
+        return std::unique_ptr<CKeyDistribution>(new CSequentialKeys(m_keySpace, thread, threads));
+    }
+private:
+    int m_keySpace;
+    long long m_next;
+    int m_stride;
+};
+
+// hotOperations of the accesses go to the first hotFraction of the key space
+class CHotspotKeys : public CKeyDistribution {
+public:
+    CHotspotKeys(int keySpace, double hotFraction, double hotOperations)
+        : m_hotKeys(std::max(1, static_cast<int>(keySpace * hotFraction)))
+        , m_hot(0, m_hotKeys - 1)
+        , m_cold(std::min(m_hotKeys, keySpace - 1), keySpace - 1)
+        , m_pickHot(hotOperations) {}
+    int Next(std::mt19937_64& random) override { return m_pickHot(random) ? m_hot(random) : m_cold(random); }
+    std::unique_ptr<CKeyDistribution> ForThread(int, int) const override {
+        return std::unique_ptr<CKeyDistribution>(new CHotspotKeys(*this));
+    }
+private:
+    int m_hotKeys;
+    std::uniform_int_distribution<int> m_hot;
+    std::uniform_int_distribution<int> m_cold;
+    std::bernoulli_distribution m_pickHot;
+};
+
+/*
+ * Zipf over ranks 0..keySpace-1 using the rejection-free method from Gray et
+ * al., "Quickly Generating Billion-Record Synthetic Databases" (as in YCSB).
+ * Construction is O(keySpace) for the zeta constant, Next is O(1).
+ * With scramble the ranks are hashed over the key space, otherwise the
+ * hottest keys are the lowest ids.
+ */
+class CZipfKeys : public CKeyDistribution {
+public:
+    CZipfKeys(int keySpace, double theta, bool scramble)
+        : m_keySpace(keySpace)
+        , m_theta(theta)
+        , m_scramble(scramble)
+        , m_uniform(0.0, 1.0)
+    {
+        if (theta <= 0 || theta == 1.0) {
+            throw std::invalid_argument("zipf theta must be positive and not 1");
+        }
+        double zeta2 = 0;
+        m_zetaN = 0;
+        for (int i = 1; i <= keySpace; ++i) {
+            m_zetaN += 1.0 / std::pow(static_cast<double>(i), theta);
+            if (i == 2) {
+                zeta2 = m_zetaN;
+            }
+        }
+        m_secondRankBound = 1.0 + std::pow(0.5, theta);
+        m_alpha = 1.0 / (1.0 - theta);
+        m_eta = (1.0 - std::pow(2.0 / keySpace, 1.0 - theta)) / (1.0 - zeta2 / m_zetaN);
+    }
+
+    int Next(std::mt19937_64& random) override {
+        double u = m_uniform(random);
+        double uz = u * m_zetaN;
+        long long rank = 0;
+        if (uz < 1.0) {
+            rank = 0;
+        } else if (uz < m_secondRankBound) {
+            rank = 1;
+        } else {
+            rank = static_cast<long long>(m_keySpace * std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+        }
+        if (rank >= m_keySpace) {
+            rank = m_keySpace - 1;
+        }
+        if (m_scramble) {
+            rank = static_cast<long long>((static_cast<uint64_t>(rank) * 11400714819323198485ull) % static_cast<uint64_t>(m_keySpace));
+        }
+        return static_cast<int>(rank);
+    }
+
+    std::unique_ptr<CKeyDistribution> ForThread(int, int) const override {
+        return std::unique_ptr<CKeyDistribution>(new CZipfKeys(*this));
+    }
+
+private:
+    int m_keySpace;
+    double m_theta;
+    bool m_scramble;
+    double m_zetaN;
+    double m_secondRankBound;
+    double m_alpha;
+    double m_eta;
+    std::uniform_real_distribution<double> m_uniform;
+};
+
+struct KeyDistributionOptions {
+    std::string name;      // uniform, zipf, hotspot or sequential
+    int keySpace;
+    double zipfTheta;
+    bool zipfScramble;
+    double hotFraction;
+    double hotOperations;
+};
+
+inline std::unique_ptr<CKeyDistribution> MakeKeyDistribution(const KeyDistributionOptions& options)
+{
+    if (options.name == "uniform") {
+        return std::unique_ptr<CKeyDistribution>(new CUniformKeys(options.keySpace));
+    } else if (options.name == "zipf") {
+        return std::unique_ptr<CKeyDistribution>(new CZipfKeys(options.keySpace, options.zipfTheta, options.zipfScramble));
+    } else if (options.name == "hotspot") {
+        return std::unique_ptr<CKeyDistribution>(new CHotspotKeys(options.keySpace, options.hotFraction, options.hotOperations));
+    } else if (options.name == "sequential") {
+        return std::unique_ptr<CKeyDistribution>(new CSequentialKeys(options.keySpace, 0, 1));
+    }
+    throw std::invalid_argument("unknown key distribution: " + options.name);
+}
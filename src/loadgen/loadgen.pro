@@ -0,0 +1,16 @@
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+CONFIG -= qt
+
+SOURCES += \
+    main.cpp
+
+HEADERS += \
+    KeyDistribution.h
+
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../mylib/release/ -lmylib
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../mylib/debug/ -lmylib
+
+INCLUDEPATH += $$PWD/../mylib $$PWD/../bench
+DEPENDPATH += $$PWD/../mylib $$PWD/../bench
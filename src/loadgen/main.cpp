@@ -0,0 +1,232 @@
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include "SomeContainer.h"
+#include "BenchHarness.h"
+#include "KeyDistribution.h"
+
+/*
+ * Drives CSomeContainer with a configurable production-like load and reports
+ * throughput and latency percentiles per operation type.
+ *
+ *   --threads N                 worker threads (default: hardware threads)
+ *   --mix query=80,register=15,unregister=5,iterate=0
+ *                               iterate advances CSomeContainerIterator without the lock,
+ *                               mixing it with unregister reproduces that iterator's race
+ *   --keys N                    key space size, prefilled with --prefill of it (default 1.0)
+ *   --distribution uniform|zipf|hotspot|sequential
+ *   --zipf-theta 0.99 --zipf-scramble
+ *   --hot-fraction 0.1 --hot-operations 0.9
+ *   --construct-ns N --destruct-ns N    payload cost, busy-waiting unless --sleep-cost
+ *   --duration-s N
+ *   --config mutex|adaptive|combining
+ *   --record file.trace         record the measured operations for the replay tool
+ *   --output file.json          JSON report, stdout by default
+ */
+
+enum Operation { OpQuery, OpRegister, OpUnregister, OpIterate, OperationCount };
+const char* const OperationNames[OperationCount] = { "query", "register", "unregister", "iterate" };
+
+struct PayloadCost {
+    long long constructNanoseconds;
+    long long destructNanoseconds;
+    bool sleep;
+};
+PayloadCost g_payloadCost = { 0, 0, false };
+
+void spend(long long nanoseconds) {
+    if (nanoseconds <= 0) {
+        return;
+    }
+    if (g_payloadCost.sleep) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(nanoseconds));
+        return;
+    }
+    auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(nanoseconds);
+    while (std::chrono::steady_clock::now() < until) {
+    }
+}
+
+class Payload {
+public:
+    explicit Payload(int id) : m_id(id) { spend(g_payloadCost.constructNanoseconds); }
+    ~Payload() { spend(g_payloadCost.destructNanoseconds); }
+private:
+    int m_id;
+};
+
+struct ThreadResult {
+    ThreadResult() : latencies(OperationCount), misses(0) {}
+    CLatencyHistograms latencies;
+    uint64_t misses;
+};
+
+std::vector<double> parseMix(const std::string& mix) {
+    std::vector<double> weights(OperationCount, 0);
+    std::stringstream stream(mix);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        size_t separator = item.find('=');
+        std::string name = item.substr(0, separator);
+        double weight = separator == std::string::npos ? 0 : std::atof(item.c_str() + separator + 1);
+        int operation = 0;
+        while (operation < OperationCount && name != OperationNames[operation]) {
+            ++operation;
+        }
+        if (operation == OperationCount) {
+            throw std::invalid_argument("unknown operation in mix: " + name);
+        }
+        weights[operation] = weight;
+    }
+    return weights;
+}
+
+template<typename LockPolicy>
+double runLoad(const CCommandLine& options, WriteMode writeMode, int threads, const CKeyDistribution& keys,
+               const std::vector<double>& mix, std::vector<ThreadResult>& results) {
+    CSomeContainer<Payload, LockPolicy> container;
+    container.SetWriteMode(writeMode);
+    int keySpace = static_cast<int>(options.GetInt("--keys", 100000));
+    int prefilled = static_cast<int>(keySpace * options.GetDouble("--prefill", 1.0));
+    for (int i = 0; i < prefilled; ++i) {
+        container.Register(i, std::auto_ptr<Payload>(new Payload(i)));
+    }
+
+    std::string record = options.Get("--record", "");
+    if (!record.empty()) {
+        container.StartRecording(record);
+    }
+
+    std::chrono::nanoseconds duration(static_cast<long long>(options.GetDouble("--duration-s", 5) * 1e9));
+    results.assign(threads, ThreadResult());
+    double seconds = RunThreads(threads, [&](int thread) {
+        std::mt19937_64 random(thread + 1);
+        std::discrete_distribution<int> pickOperation(mix.begin(), mix.end());
+        std::unique_ptr<CKeyDistribution> threadKeys = keys.ForThread(thread, threads);
+        ThreadResult& result = results[thread];
+        auto deadline = std::chrono::steady_clock::now() + duration;
+        for (auto now = std::chrono::steady_clock::now(); now < deadline; ) {
+            int operation = pickOperation(random);
+            int id = threadKeys->Next(random);
+            switch (operation) {
+            case OpQuery:
+                try {
+                    container.Query(id);
+                } catch (const std::out_of_range&) {
+                    ++result.misses;
+                }
+                break;
+            case OpRegister:
+                container.Register(id, std::auto_ptr<Payload>(new Payload(id)));
+                break;
+            case OpUnregister:
+                container.Unregister(id);
+                break;
+            case OpIterate:
+                for (auto it = container.Start(); !(it == container.End()); ++it) {
+                    try {
+                        *it;
+                    } catch (const std::out_of_range&) {
+                    }
+                }
+                break;
+            }
+            auto finished = std::chrono::steady_clock::now();
+            uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(finished - now).count();
+            result.latencies.Record(operation, latency);
+            now = finished;
+        }
+    });
+    if (!record.empty() && container.StopRecording() != 0) {
+        std::fprintf(stderr, "trace is incomplete, some operations were dropped\n");
+    }
+    return seconds;
+}
+
+int main(int argc, char* argv[]) {
+    CCommandLine options(argc, argv);
+    int threads = static_cast<int>(options.GetInt("--threads", HardwareThreads()));
+    std::string config = options.Get("--config", "mutex");
+    std::vector<double> mix = parseMix(options.Get("--mix", "query=80,register=15,unregister=5,iterate=0"));
+    g_payloadCost.constructNanoseconds = options.GetInt("--construct-ns", 0);
+    g_payloadCost.destructNanoseconds = options.GetInt("--destruct-ns", 0);
+    g_payloadCost.sleep = options.Has("--sleep-cost");
+
+    KeyDistributionOptions keyOptions;
+    keyOptions.name = options.Get("--distribution", "uniform");
+    keyOptions.keySpace = static_cast<int>(options.GetInt("--keys", 100000));
+    keyOptions.zipfTheta = options.GetDouble("--zipf-theta", 0.99);
+    keyOptions.zipfScramble = options.Has("--zipf-scramble");
+    keyOptions.hotFraction = options.GetDouble("--hot-fraction", 0.1);
+    keyOptions.hotOperations = options.GetDouble("--hot-operations", 0.9);
+    std::unique_ptr<CKeyDistribution> keys = MakeKeyDistribution(keyOptions);
+
+    std::vector<ThreadResult> results;
+    double seconds = 0;
+    if (config == "adaptive") {
+        seconds = runLoad<CAdaptiveMutex>(options, WriteMode::Locking, threads, *keys, mix, results);
+    } else if (config == "combining") {
+        seconds = runLoad<std::mutex>(options, WriteMode::FlatCombining, threads, *keys, mix, results);
+    } else {
+        seconds = runLoad<std::mutex>(options, WriteMode::Locking, threads, *keys, mix, results);
+    }
+
+    std::vector<CLatencyHistograms> threadLatencies;
+    uint64_t misses = 0;
+    uint64_t total = 0;
+    for (auto it = results.begin(); it != results.end(); ++it) {
+        misses += it->misses;
+        threadLatencies.push_back(it->latencies);
+    }
+    std::vector<HistogramSnapshot> latencies = CLatencyHistograms::Merge(threadLatencies);
+
+    std::string output = options.Get("--output", "");
+    std::ofstream file;
+    if (!output.empty()) {
+        file.open(output.c_str());
+    }
+    CJsonWriter json(output.empty() ? std::cout : file);
+    json.BeginObject();
+    json.Key("schema").Integer(1);
+    WriteBuildInfo(json);
+    json.Key("config").BeginObject();
+    json.Key("container").String(config);
+    json.Key("threads").Integer(threads);
+    json.Key("keys").Integer(keyOptions.keySpace);
+    json.Key("distribution").String(keyOptions.name);
+    json.Key("mix").String(options.Get("--mix", "query=80,register=15,unregister=5,iterate=0"));
+    json.Key("construct_ns").Integer(g_payloadCost.constructNanoseconds);
+    json.Key("destruct_ns").Integer(g_payloadCost.destructNanoseconds);
+    json.EndObject();
+    json.Key("seconds").Number(seconds);
+    json.Key("query_misses").Integer(static_cast<long long>(misses));
+    json.Key("operations").BeginObject();
+    for (int operation = 0; operation < OperationCount; ++operation) {
+        const HistogramSnapshot& latency = latencies[operation];
+        total += latency.count;
+        json.Key(OperationNames[operation]).BeginObject();
+        json.Key("count").Integer(static_cast<long long>(latency.count));
+        json.Key("ops_per_second").Number(latency.count / seconds);
+        json.Key("p50_ns").Integer(static_cast<long long>(latency.p50));
+        json.Key("p90_ns").Integer(static_cast<long long>(latency.Percentile(0.9)));
+        json.Key("p99_ns").Integer(static_cast<long long>(latency.p99));
+        json.Key("p999_ns").Integer(static_cast<long long>(latency.p999));
+        json.Key("max_ns").Integer(static_cast<long long>(latency.max));
+        json.EndObject();
+        if (latency.count != 0) {
+            std::fprintf(stderr, "%-10s %10llu ops %12.0f ops/s  p50 %8llu ns  p99 %10llu ns  p99.9 %10llu ns\n",
+                         OperationNames[operation], static_cast<unsigned long long>(latency.count), latency.count / seconds,
+                         static_cast<unsigned long long>(latency.p50), static_cast<unsigned long long>(latency.p99),
+                         static_cast<unsigned long long>(latency.p999));
+        }
+    }
+    json.EndObject();
+    json.Key("ops_per_second").Number(total / seconds);
+    json.EndObject();
+    (output.empty() ? std::cout : file) << "\n";
+    std::fprintf(stderr, "total      %10llu ops %12.0f ops/s over %.2f s\n",
+                 static_cast<unsigned long long>(total), total / seconds, seconds);
+    return 0;
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+ * Lock policy for short critical sections: spins with exponential backoff,
+ * then parks the thread on a futex (Linux) or yields (elsewhere).
+ *
+ * The spin budget follows how long acquirers had to spin before the lock was
+ * released, which is a cheap proxy for the hold times seen by this mutex:
+ * short holds raise it towards 2x the recent average, parking shrinks it.
+ * Satisfies Lockable, so it works with std::unique_lock and
+ * std::condition_variable_any.
+ */
+class CAdaptiveMutex {
+public:
+    CAdaptiveMutex();
+    void lock();
+    bool try_lock();
+    void unlock();
+    int SpinBudget() const;
+private:
+    CAdaptiveMutex(const CAdaptiveMutex&);
+    CAdaptiveMutex& operator=(const CAdaptiveMutex&);
+    static void Pause();
+    void Park();
+    void WakeOne();
+private:
+    enum { MinSpins = 16, MaxSpins = 4096, MaxBackoff = 64 };
+    enum { Unlocked = 0, Locked = 1, LockedWithWaiters = 2 };
+    std::atomic<int> m_state;
+    std::atomic<int> m_spinBudget;
+};
+
+inline CAdaptiveMutex::CAdaptiveMutex()
+    : m_state(Unlocked)
+    , m_spinBudget(MaxSpins / 8)
+{
+}
+
+inline void CAdaptiveMutex::lock()
+{
+    if (try_lock()) {
+        return;
+    }
+
+    int budget = m_spinBudget.load(std::memory_order_relaxed);
+    int spins = 0;
+    int backoff = 1;
+    while (spins < budget) {
+        for (int i = 0; i < backoff; ++i) {
+            Pause();
+        }
+        spins += backoff;
+        backoff = std::min<int>(backoff * 2, MaxBackoff);
+        if (m_state.load(std::memory_order_relaxed) == Unlocked && try_lock()) {
+            // move the budget an eighth of the way towards twice what this acquisition needed
+            int target = std::min<int>(std::max<int>(spins * 2, MinSpins), MaxSpins);
+            m_spinBudget.store(budget + (target - budget) / 8, std::memory_order_relaxed);
+            return;
+        }
+    }
+    m_spinBudget.store(std::max<int>(budget - budget / 8, MinSpins), std::memory_order_relaxed);
+
+    // the lock is handed over through the futex from here on, mark it as contended
+    while (m_state.exchange(LockedWithWaiters, std::memory_order_acquire) != Unlocked) {
+        Park();
+    }
+}
+
+inline bool CAdaptiveMutex::try_lock()
+{
+    int expected = Unlocked;
+    return m_state.compare_exchange_strong(expected, Locked, std::memory_order_acquire, std::memory_order_relaxed);
+}
+
+inline void CAdaptiveMutex::unlock()
+{
+    if (m_state.exchange(Unlocked, std::memory_order_release) == LockedWithWaiters) {
+        WakeOne();
+    }
+}
+
+inline int CAdaptiveMutex::SpinBudget() const
+{
+    return m_spinBudget.load(std::memory_order_relaxed);
+}
+
+inline void CAdaptiveMutex::Pause()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+inline void CAdaptiveMutex::Park()
+{
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<int*>(&m_state), FUTEX_WAIT_PRIVATE, LockedWithWaiters, nullptr, nullptr, 0);
+#else
+    std::this_thread::yield();
+#endif
+}
+
+inline void CAdaptiveMutex::WakeOne()
+{
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<int*>(&m_state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+}
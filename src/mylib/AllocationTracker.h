@@ -0,0 +1,236 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "ContainerStats.h"
+
+struct AllocationCounts {
+    AllocationCounts() : calls(0), allocations(0), bytes(0), frees(0), freedBytes(0) {}
+
+    double AllocationsPerCall() const { return calls != 0 ? static_cast<double>(allocations) / calls : 0; }
+    double BytesPerCall() const { return calls != 0 ? static_cast<double>(bytes) / calls : 0; }
+
+    AllocationCounts operator-(const AllocationCounts& earlier) const {
+        AllocationCounts difference;
+        difference.calls = calls - earlier.calls;
+        difference.allocations = allocations - earlier.allocations;
+        difference.bytes = bytes - earlier.bytes;
+        difference.frees = frees - earlier.frees;
+        difference.freedBytes = freedBytes - earlier.freedBytes;
+        return difference;
+    }
+
+    uint64_t calls;       // operations of this type while tracking, 0 for the "other" bucket
+    uint64_t allocations;
+    uint64_t bytes;
+    uint64_t frees;
+    uint64_t freedBytes;
+};
+
+struct AllocationStats {
+    AllocationStats() : entries(0) {}
+
+    const AllocationCounts& operator[](ContainerOperation operation) const {
+        return operations[static_cast<size_t>(operation)];
+    }
+
+    // allocated minus freed since tracking was enabled, over every bucket
+    int64_t LiveBytes() const {
+        int64_t live = static_cast<int64_t>(other.bytes) - static_cast<int64_t>(other.freedBytes);
+        for (size_t i = 0; i < ContainerOperationCount; ++i) {
+            live += static_cast<int64_t>(operations[i].bytes) - static_cast<int64_t>(operations[i].freedBytes);
+        }
+        return live;
+    }
+
+    double BytesPerEntry() const { return entries != 0 ? static_cast<double>(LiveBytes()) / entries : 0; }
+
+    // counts accumulated between an earlier snapshot and this one
+    AllocationStats Since(const AllocationStats& earlier) const;
+
+    AllocationCounts operations[ContainerOperationCount];
+    AllocationCounts other; // outside any operation: Clear, teardown, allocations of other threads
+    size_t entries;
+};
+
+/*
+ * Counts allocations per container operation. Whatever allocates asks which
+ * operation the current thread is in (set by CAllocationScope); allocations
+ * outside of one land in the "other" bucket.
+ */
+class CAllocationTracker {
+public:
+    CAllocationTracker() {}
+    void Called(ContainerOperation operation);
+    void Allocated(size_t bytes);
+    void Freed(size_t bytes);
+    AllocationStats Snapshot() const;
+
+    // Operation the calling thread is in, ContainerOperationCount outside of one
+    static size_t& CurrentOperation() {
+        static thread_local size_t operation = ContainerOperationCount;
+        return operation;
+    }
+
+private:
+    CAllocationTracker(const CAllocationTracker&);
+    CAllocationTracker& operator=(const CAllocationTracker&);
+    struct Counters {
+        Counters() : calls(0), allocations(0), bytes(0), frees(0), freedBytes(0) {}
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> allocations;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> frees;
+        std::atomic<uint64_t> freedBytes;
+    };
+    static void Load(const Counters& source, AllocationCounts& target);
+private:
+    Counters m_counters[ContainerOperationCount + 1];
+};
+
+/*
+ * Process-wide tracker for the interposed global operator new of the
+ * benchmark builds (bench/CountingNew.cpp). Null unless a benchmark installs one.
+ */
+inline std::atomic<CAllocationTracker*>& ProcessAllocationTracker()
+{
+    static std::atomic<CAllocationTracker*> tracker(nullptr);
+    return tracker;
+}
+
+// Marks the calling thread as inside a container operation for its lifetime
+class CAllocationScope {
+public:
+    CAllocationScope(CAllocationTracker* tracker, ContainerOperation operation)
+        : m_previous(CAllocationTracker::CurrentOperation())
+    {
+        CAllocationTracker::CurrentOperation() = static_cast<size_t>(operation);
+        if (tracker != nullptr) {
+            tracker->Called(operation);
+        }
+        CAllocationTracker* process = ProcessAllocationTracker().load(std::memory_order_relaxed);
+        if (process != nullptr) {
+            process->Called(operation);
+        }
+    }
+
+    ~CAllocationScope() {
+        CAllocationTracker::CurrentOperation() = m_previous;
+    }
+
+private:
+    CAllocationScope(const CAllocationScope&);
+    CAllocationScope& operator=(const CAllocationScope&);
+private:
+    size_t m_previous;
+};
+
+// Shared by a container and every map that held its nodes, so a teardown on the pool still reports
+struct AllocationHook {
+    AllocationHook() : tracker(nullptr), nodeBytes(0) {}
+    ~AllocationHook() { delete tracker.load(); }
+    std::atomic<CAllocationTracker*> tracker;
+    std::atomic<size_t> nodeBytes; // size of a single-element allocation, the map node
+};
+
+/*
+ * std::allocator that reports to the tracker of its hook once tracking is
+ * enabled. A default constructed one reports nowhere; swapping and moving
+ * containers carries the hook along.
+ */
+template<typename T>
+class CTrackingAllocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    template<typename U> struct rebind { typedef CTrackingAllocator<U> other; };
+
+    CTrackingAllocator() {}
+    explicit CTrackingAllocator(std::shared_ptr<AllocationHook> hook) : m_hook(hook) {}
+    template<typename U>
+    CTrackingAllocator(const CTrackingAllocator<U>& other) : m_hook(other.Hook()) {}
+
+    T* allocate(size_t count) {
+        T* memory = std::allocator<T>().allocate(count);
+        if (count == 1 && m_hook && m_hook->nodeBytes.load(std::memory_order_relaxed) != sizeof(T)) {
+            m_hook->nodeBytes.store(sizeof(T), std::memory_order_relaxed);
+        }
+        if (CAllocationTracker* tracker = Tracker()) {
+            tracker->Allocated(count * sizeof(T));
+        }
+        return memory;
+    }
+
+    void deallocate(T* memory, size_t count) {
+        if (CAllocationTracker* tracker = Tracker()) {
+            tracker->Freed(count * sizeof(T));
+        }
+        std::allocator<T>().deallocate(memory, count);
+    }
+
+    const std::shared_ptr<AllocationHook>& Hook() const { return m_hook; }
+
+    template<typename U>
+    bool operator==(const CTrackingAllocator<U>& other) const { return m_hook == other.Hook(); }
+    template<typename U>
+    bool operator!=(const CTrackingAllocator<U>& other) const { return m_hook != other.Hook(); }
+
+private:
+    CAllocationTracker* Tracker() const {
+        return m_hook ? m_hook->tracker.load(std::memory_order_acquire) : nullptr;
+    }
+private:
+    std::shared_ptr<AllocationHook> m_hook;
+};
+
+inline AllocationStats AllocationStats::Since(const AllocationStats& earlier) const
+{
+    AllocationStats difference;
+    for (size_t i = 0; i < ContainerOperationCount; ++i) {
+        difference.operations[i] = operations[i] - earlier.operations[i];
+    }
+    difference.other = other - earlier.other;
+    difference.entries = entries;
+    return difference;
+}
+
+inline void CAllocationTracker::Called(ContainerOperation operation)
+{
+    m_counters[static_cast<size_t>(operation)].calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void CAllocationTracker::Allocated(size_t bytes)
+{
+    Counters& counters = m_counters[CurrentOperation()];
+    counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+inline void CAllocationTracker::Freed(size_t bytes)
+{
+    Counters& counters = m_counters[CurrentOperation()];
+    counters.frees.fetch_add(1, std::memory_order_relaxed);
+    counters.freedBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+inline AllocationStats CAllocationTracker::Snapshot() const
+{
+    AllocationStats stats;
+    for (size_t i = 0; i < ContainerOperationCount; ++i) {
+        Load(m_counters[i], stats.operations[i]);
+    }
+    Load(m_counters[ContainerOperationCount], stats.other);
+    return stats;
+}
+
+inline void CAllocationTracker::Load(const Counters& source, AllocationCounts& target)
+{
+    target.calls = source.calls.load(std::memory_order_relaxed);
+    target.allocations = source.allocations.load(std::memory_order_relaxed);
+    target.bytes = source.bytes.load(std::memory_order_relaxed);
+    target.frees = source.frees.load(std::memory_order_relaxed);
+    target.freedBytes = source.freedBytes.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+enum class ChangeOp {
+    Insert,  // a new id
+    Replace, // an id already present got another object
+    Remove,
+    Clear,   // every entry removed at once
+    Reload   // many entries replaced at once (LoadSnapshot), rescan the container
+};
+
+struct ChangeEvent {
+    int objectId; // 0 for Clear and Reload
+    ChangeOp op;
+    uint64_t version; // container-wide, increases by one per change
+};
+
+/*
+ * Broadcast ring of change events. Publish is called by one thread at a time
+ * (the container publishes under its lock) and never waits: the oldest event
+ * is overwritten once the ring is full. Every subscription reads with its own
+ * cursor and no lock; each slot carries a stamp that tells a reader whether
+ * the event it copied was overwritten meanwhile.
+ */
+class CChangeFeed {
+public:
+    // capacity is rounded up to a power of two
+    explicit CChangeFeed(size_t capacity);
+    void Publish(ChangeOp op, int objectId, uint64_t version);
+    size_t Capacity() const { return m_mask + 1; }
+    uint64_t Published() const { return m_tail.load(std::memory_order_acquire); }
+private:
+    friend class CChangeSubscription;
+    struct Slot {
+        std::atomic<uint64_t> stamp; // 2 * position + 2 once written, odd while being written
+        std::atomic<int> objectId;
+        std::atomic<int> op;
+        std::atomic<uint64_t> version;
+    };
+private:
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    std::atomic<uint64_t> m_tail; // position of the next event
+};
+
+/*
+ * One consumer's cursor into a CChangeFeed, starting at the events published
+ * after it was created. Not thread-safe itself, give every consumer its own.
+ */
+class CChangeSubscription {
+public:
+    explicit CChangeSubscription(std::shared_ptr<CChangeFeed> feed);
+    /*
+     * Replaces batch with up to maxCount next events. Returns false when the
+     * consumer fell further behind than the ring holds: the batch is empty, the
+     * cursor jumps to the newest event and the consumer should rescan the
+     * container; events published from the jump on are delivered again, so a
+     * change may show up both in the rescan and in a later batch.
+     */
+    bool Poll(std::vector<ChangeEvent>& batch, size_t maxCount);
+    // events published but not polled yet, more than the capacity means a resync is coming
+    uint64_t Lag() const { return m_feed->Published() - m_cursor; }
+    uint64_t Resyncs() const { return m_resyncs; }
+private:
+    std::shared_ptr<CChangeFeed> m_feed;
+    uint64_t m_cursor;
+    uint64_t m_resyncs;
+};
+
+inline CChangeFeed::CChangeFeed(size_t capacity)
+    : m_mask(0)
+    , m_tail(0)
+{
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_slots.reset(new Slot[size]);
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+        m_slots[i].stamp.store(0, std::memory_order_relaxed);
+        m_slots[i].objectId.store(0, std::memory_order_relaxed);
+        m_slots[i].op.store(0, std::memory_order_relaxed);
+        m_slots[i].version.store(0, std::memory_order_relaxed);
+    }
+}
+
+inline void CChangeFeed::Publish(ChangeOp op, int objectId, uint64_t version)
+{
+    uint64_t position = m_tail.load(std::memory_order_relaxed);
+    Slot& slot = m_slots[position & m_mask];
+    slot.stamp.store(2 * position + 1, std::memory_order_relaxed);
+    // a reader that sees any of the new fields sees the odd stamp on its second look
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.objectId.store(objectId, std::memory_order_relaxed);
+    slot.op.store(static_cast<int>(op), std::memory_order_relaxed);
+    slot.version.store(version, std::memory_order_relaxed);
+    slot.stamp.store(2 * position + 2, std::memory_order_release);
+    m_tail.store(position + 1, std::memory_order_release);
+}
+
+inline CChangeSubscription::CChangeSubscription(std::shared_ptr<CChangeFeed> feed)
+    : m_feed(feed)
+    , m_cursor(feed->Published())
+    , m_resyncs(0)
+{
+}
+
+inline bool CChangeSubscription::Poll(std::vector<ChangeEvent>& batch, size_t maxCount)
+{
+    batch.clear();
+    uint64_t tail = m_feed->Published();
+    bool lapped = tail - m_cursor > m_feed->Capacity();
+    for (uint64_t position = m_cursor; !lapped && position < tail && batch.size() < maxCount; ++position) {
+        const CChangeFeed::Slot& slot = m_feed->m_slots[position & m_feed->m_mask];
+        uint64_t stamp = slot.stamp.load(std::memory_order_acquire);
+        ChangeEvent event;
+        event.objectId = slot.objectId.load(std::memory_order_relaxed);
+        event.op = static_cast<ChangeOp>(slot.op.load(std::memory_order_relaxed));
+        event.version = slot.version.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        lapped = stamp != 2 * position + 2 || slot.stamp.load(std::memory_order_relaxed) != stamp;
+        batch.push_back(event);
+    }
+    if (lapped) {
+        batch.clear();
+        m_cursor = m_feed->Published();
+        ++m_resyncs;
+        return false;
+    }
+    m_cursor += batch.size();
+    return true;
+}
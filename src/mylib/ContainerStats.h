@@ -0,0 +1,214 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Container operations that take the lock, used to label instrumentation
+enum class ContainerOperation {
+    Register,
+    Query,
+    Unregister,
+    IteratorDereference
+};
+const size_t ContainerOperationCount = 4;
+
+inline const char* ToString(ContainerOperation operation)
+{
+    switch (operation) {
+    case ContainerOperation::Register: return "Register";
+    case ContainerOperation::Query: return "Query";
+    case ContainerOperation::Unregister: return "Unregister";
+    case ContainerOperation::IteratorDereference: return "IteratorDereference";
+    }
+    return "Unknown";
+}
+
+inline uint64_t MonotonicNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline int HighestBit(uint64_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index = 0;
+    _BitScanReverse64(&index, value);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+/*
+ * Log-linear bucketing: values below 16 get a bucket each, above that every
+ * power of two is split into 16 linear sub-buckets (at most 6% relative error).
+ * Values are clamped to 2^36 ns, about 68 seconds.
+ */
+struct LogLinearBuckets {
+    enum { SubBucketBits = 4, SubBucketCount = 1 << SubBucketBits, MaxExponent = 36 };
+    enum { Count = (MaxExponent - SubBucketBits + 2) * SubBucketCount };
+
+    static size_t IndexOf(uint64_t value) {
+        if (value < SubBucketCount) {
+            return static_cast<size_t>(value);
+        }
+        int exponent = HighestBit(value);
+        if (exponent > MaxExponent) {
+            return Count - 1;
+        }
+        uint64_t mantissa = value >> (exponent - SubBucketBits);
+        return static_cast<size_t>((exponent - SubBucketBits + 1) * SubBucketCount + (mantissa - SubBucketCount));
+    }
+
+    // midpoint of the values that fall into the bucket
+    static uint64_t ValueOf(size_t index) {
+        if (index < SubBucketCount) {
+            return index;
+        }
+        int exponent = static_cast<int>(index / SubBucketCount) + SubBucketBits - 1;
+        uint64_t mantissa = SubBucketCount + index % SubBucketCount;
+        uint64_t width = 1ull << (exponent - SubBucketBits);
+        return mantissa * width + width / 2;
+    }
+};
+
+// Merged histogram with the percentiles precomputed, values in nanoseconds
+struct HistogramSnapshot {
+    HistogramSnapshot() : count(0), p50(0), p99(0), p999(0), max(0), counts(LogLinearBuckets::Count, 0) {}
+
+    uint64_t Percentile(double fraction) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * count + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return LogLinearBuckets::ValueOf(i);
+            }
+        }
+        return max;
+    }
+
+    void UpdatePercentiles() {
+        p50 = Percentile(0.5);
+        p99 = Percentile(0.99);
+        p999 = Percentile(0.999);
+    }
+
+    uint64_t count;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+    std::vector<uint64_t> counts;
+};
+
+struct OperationStats {
+    HistogramSnapshot wait; // from asking for the lock to owning it
+    HistogramSnapshot hold; // from owning the lock to releasing it
+};
+
+struct ContainerStats {
+    OperationStats operations[ContainerOperationCount];
+
+    const OperationStats& operator[](ContainerOperation operation) const {
+        return operations[static_cast<size_t>(operation)];
+    }
+};
+
+/*
+ * Lock wait and hold histograms per operation. Every thread records into its
+ * own stripe (threads are assigned round-robin, so stripes are only shared
+ * when there are more threads than stripes); Snapshot merges the stripes.
+ */
+class CContainerStatsRecorder {
+public:
+    CContainerStatsRecorder();
+    void RecordWait(ContainerOperation operation, uint64_t nanoseconds);
+    void RecordHold(ContainerOperation operation, uint64_t nanoseconds);
+    ContainerStats Snapshot() const;
+private:
+    struct Histogram {
+        Histogram() : max(0) {
+            for (size_t i = 0; i < LogLinearBuckets::Count; ++i) {
+                counts[i].store(0, std::memory_order_relaxed);
+            }
+        }
+        void Record(uint64_t value) {
+            counts[LogLinearBuckets::IndexOf(value)].fetch_add(1, std::memory_order_relaxed);
+            uint64_t seen = max.load(std::memory_order_relaxed);
+            while (value > seen && !max.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+            }
+        }
+        std::atomic<uint64_t> counts[LogLinearBuckets::Count];
+        std::atomic<uint64_t> max;
+    };
+    struct Stripe {
+        Histogram wait[ContainerOperationCount];
+        Histogram hold[ContainerOperationCount];
+    };
+    Stripe& LocalStripe();
+    static void Merge(const Histogram& source, HistogramSnapshot& target);
+private:
+    std::vector<std::unique_ptr<Stripe> > m_stripes;
+};
+
+inline CContainerStatsRecorder::CContainerStatsRecorder()
+{
+    size_t stripeCount = std::min(std::max(1u, std::thread::hardware_concurrency()), 64u);
+    for (size_t i = 0; i < stripeCount; ++i) {
+        m_stripes.push_back(std::unique_ptr<Stripe>(new Stripe));
+    }
+}
+
+inline void CContainerStatsRecorder::RecordWait(ContainerOperation operation, uint64_t nanoseconds)
+{
+    LocalStripe().wait[static_cast<size_t>(operation)].Record(nanoseconds);
+}
+
+inline void CContainerStatsRecorder::RecordHold(ContainerOperation operation, uint64_t nanoseconds)
+{
+    LocalStripe().hold[static_cast<size_t>(operation)].Record(nanoseconds);
+}
+
+inline ContainerStats CContainerStatsRecorder::Snapshot() const
+{
+    ContainerStats stats;
+    for (size_t operation = 0; operation < ContainerOperationCount; ++operation) {
+        OperationStats& target = stats.operations[operation];
+        for (auto it = m_stripes.begin(); it != m_stripes.end(); ++it) {
+            Merge((*it)->wait[operation], target.wait);
+            Merge((*it)->hold[operation], target.hold);
+        }
+        target.wait.UpdatePercentiles();
+        target.hold.UpdatePercentiles();
+    }
+    return stats;
+}
+
+inline CContainerStatsRecorder::Stripe& CContainerStatsRecorder::LocalStripe()
+{
+    static std::atomic<size_t> nextThread(0);
+    static thread_local size_t threadIndex = nextThread++;
+    return *m_stripes[threadIndex % m_stripes.size()];
+}
+
+inline void CContainerStatsRecorder::Merge(const Histogram& source, HistogramSnapshot& target)
+{
+    for (size_t i = 0; i < LogLinearBuckets::Count; ++i) {
+        uint64_t count = source.counts[i].load(std::memory_order_relaxed);
+        target.counts[i] += count;
+        target.count += count;
+    }
+    target.max = std::max(target.max, source.max.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#if defined(__linux__)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include "ContainerStats.h"
+
+struct ForkSnapshotStats {
+    ForkSnapshotStats()
+        : quiesceNanoseconds(0), pauseNanoseconds(0), copiedPages(0), pageSize(0), entries(0), succeeded(false) {}
+
+    uint64_t quiesceNanoseconds; // waiting for the lock, the running critical sections finishing
+    uint64_t pauseNanoseconds;   // lock held around fork(), writers were blocked this long
+    uint64_t copiedPages;        // pages that stopped being shared while the child ran, copied for either process
+    size_t pageSize;
+    size_t entries;              // written by the child
+    bool succeeded;
+    std::string error;
+};
+
+// Private_Clean plus Private_Dirty of the calling process in bytes, 0 when the kernel does not report them
+inline uint64_t ForkSnapshotPrivateBytes()
+{
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen("/proc/self/smaps_rollup", "r"), std::fclose);
+    uint64_t bytes = 0;
+    char line[256];
+    while (file && std::fgets(line, sizeof(line), file.get()) != nullptr) {
+        unsigned long long kilobytes = 0;
+        if (std::sscanf(line, "Private_Clean: %llu kB", &kilobytes) == 1
+                || std::sscanf(line, "Private_Dirty: %llu kB", &kilobytes) == 1) {
+            bytes += kilobytes * 1024;
+        }
+    }
+    return bytes;
+}
+
+/*
+ * Forks while the caller holds the lock that quiesces the writers; release
+ * unlocks it in both processes right after the fork. The child runs save on
+ * its copy-on-write view of the process and exits, the parent returns at
+ * once with a future that a waiting thread completes when the child is done.
+ *
+ * The copied pages are what became private to the child while it ran: pages
+ * either process wrote to since the fork, the child's own small buffers
+ * included. Linux only; elsewhere the future holds a failure.
+ */
+inline std::future<ForkSnapshotStats> ForkSnapshot(uint64_t quiesceNanoseconds, uint64_t lockedAt,
+                                                   const std::function<void()>& release,
+                                                   const std::function<size_t()>& save)
+{
+    ForkSnapshotStats stats;
+    stats.quiesceNanoseconds = quiesceNanoseconds;
+#if defined(__linux__)
+    // what the child reports through the pipe
+    struct ChildReport {
+        uint64_t entries;
+        uint64_t privateBytes;
+        int32_t succeeded;
+        char error[244];
+    };
+    int channel[2];
+    if (pipe(channel) != 0) {
+        release();
+        throw std::runtime_error("cannot create a pipe for the snapshot child");
+    }
+    pid_t child = fork();
+    if (child == 0) {
+        release();
+        close(channel[0]);
+        ChildReport report;
+        std::memset(&report, 0, sizeof(report));
+        uint64_t privateAtFork = ForkSnapshotPrivateBytes();
+        try {
+            report.entries = save();
+            report.succeeded = 1;
+        } catch (const std::exception& error) {
+            std::strncpy(report.error, error.what(), sizeof(report.error) - 1);
+        } catch (...) {
+            std::strncpy(report.error, "unknown exception", sizeof(report.error) - 1);
+        }
+        uint64_t privateAtEnd = ForkSnapshotPrivateBytes();
+        report.privateBytes = privateAtEnd > privateAtFork ? privateAtEnd - privateAtFork : 0;
+        ssize_t written = write(channel[1], &report, sizeof(report));
+        _exit(written == static_cast<ssize_t>(sizeof(report)) && report.succeeded ? 0 : 1);
+    }
+    release();
+    stats.pauseNanoseconds = MonotonicNanoseconds() - lockedAt;
+    close(channel[1]);
+    if (child < 0) {
+        close(channel[0]);
+        throw std::runtime_error("fork failed for the snapshot");
+    }
+    stats.pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+    int readEnd = channel[0];
+    return std::async(std::launch::async, [stats, child, readEnd]() mutable {
+        ChildReport report;
+        std::memset(&report, 0, sizeof(report));
+        size_t received = 0;
+        while (received < sizeof(report)) {
+            ssize_t count = read(readEnd, reinterpret_cast<char*>(&report) + received, sizeof(report) - received);
+            if (count <= 0) {
+                break;
+            }
+            received += static_cast<size_t>(count);
+        }
+        close(readEnd);
+        int status = 0;
+        waitpid(child, &status, 0);
+        stats.entries = static_cast<size_t>(report.entries);
+        stats.copiedPages = report.privateBytes / stats.pageSize;
+        stats.succeeded = received == sizeof(report) && report.succeeded != 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        stats.error = received == sizeof(report) ? report.error : "snapshot child exited without a report";
+        return stats;
+    });
+#else
+    (void)lockedAt;
+    (void)save;
+    release();
+    stats.error = "fork snapshots need Linux";
+    std::promise<ForkSnapshotStats> failed;
+    failed.set_value(stats);
+    return failed.get_future();
+#endif
+}
@@ -0,0 +1,294 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "Snapshot.h"
+
+/*
+ * Frozen image, written by CSomeContainer::SaveFrozenImage, host byte order:
+ *   FrozenImageHeader
+ *   payload: per entry id (i32), length (u32, ~0u for a null object), bytes - the snapshot entry encoding
+ *   padding to 8 bytes
+ *   FrozenIndexEntry for every entry, sorted by id
+ * The index is used in place from the mapping, so opening an image reads
+ * nothing but the header.
+ */
+struct FrozenImageHeader {
+    char magic[8]; // "SCFROZN1"
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t entryCount;
+    uint64_t payloadOffset;
+    uint64_t payloadSize;
+    uint64_t indexOffset;
+};
+
+struct FrozenIndexEntry {
+    int32_t id;
+    uint32_t reserved;
+    uint64_t offset; // of the entry within the payload
+};
+
+// Read-only mapping of a whole file; throws std::runtime_error when the file cannot be mapped
+class CMappedFile {
+public:
+    explicit CMappedFile(const std::string& path);
+    ~CMappedFile();
+    const char* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+private:
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+private:
+    const char* m_data;
+    size_t m_size;
+#if defined(_WIN32)
+    void Close();
+private:
+    HANDLE m_file;
+    HANDLE m_mapping;
+#endif
+};
+
+#if defined(_WIN32)
+inline CMappedFile::CMappedFile(const std::string& path)
+    : m_data(nullptr), m_size(0), m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr)
+{
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    LARGE_INTEGER size;
+    if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size)) {
+        Close();
+        throw std::runtime_error("cannot open frozen image " + path);
+    }
+    m_size = static_cast<size_t>(size.QuadPart);
+    if (m_size != 0) {
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        m_data = m_mapping != nullptr ? static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+        if (m_data == nullptr) {
+            Close();
+            throw std::runtime_error("cannot map frozen image " + path);
+        }
+    }
+}
+
+inline CMappedFile::~CMappedFile()
+{
+    Close();
+}
+
+inline void CMappedFile::Close()
+{
+    if (m_data != nullptr) {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping != nullptr) {
+        CloseHandle(m_mapping);
+    }
+    if (m_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_file);
+    }
+}
+#else
+inline CMappedFile::CMappedFile(const std::string& path)
+    : m_data(nullptr), m_size(0)
+{
+    int descriptor = open(path.c_str(), O_RDONLY);
+    struct stat status;
+    if (descriptor < 0 || fstat(descriptor, &status) != 0) {
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+        throw std::runtime_error("cannot open frozen image " + path);
+    }
+    m_size = static_cast<size_t>(status.st_size);
+    if (m_size != 0) {
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, descriptor, 0);
+        if (data == MAP_FAILED) {
+            close(descriptor);
+            throw std::runtime_error("cannot map frozen image " + path);
+        }
+        // lookups touch a few scattered pages, read-ahead would only load what nobody asked for
+        madvise(data, m_size, MADV_RANDOM);
+        m_data = static_cast<const char*>(data);
+    }
+    close(descriptor);
+}
+
+inline CMappedFile::~CMappedFile()
+{
+    if (m_data != nullptr) {
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+}
+#endif
+
+/*
+ * Read-only container over a frozen image. Opening maps the file and checks
+ * the header; Query binary searches the mapped index and decodes an object
+ * the first time it is asked for, so the pages and objects a process ends up
+ * holding follow its working set rather than the image size. Lookups take no
+ * lock: threads racing to materialize the same object install it with a
+ * compare-and-swap and the loser drops its copy.
+ */
+template<typename IObject>
+class CFrozenContainer {
+public:
+    explicit CFrozenContainer(const std::string& path);
+    ~CFrozenContainer();
+    size_t Size() const { return m_count; }
+    bool Contains(int objectId) const { return Find(objectId) != m_index + m_count; }
+    // Throws std::out_of_range for a missing id and std::runtime_error for a damaged entry;
+    // the object lives as long as the container
+    const IObject* Query(int objectId) const;
+    // objects decoded so far
+    size_t Materialized() const { return m_materialized.load(std::memory_order_relaxed); }
+private:
+    CFrozenContainer(const CFrozenContainer&);
+    CFrozenContainer& operator=(const CFrozenContainer&);
+    enum { ChunkBits = 12, ChunkSize = 1 << ChunkBits };
+    struct Chunk {
+        std::atomic<IObject*> objects[ChunkSize];
+    };
+    const FrozenIndexEntry* Find(int objectId) const;
+    IObject* Decode(const FrozenIndexEntry& entry) const;
+private:
+    CMappedFile m_file;
+    const FrozenIndexEntry* m_index;
+    size_t m_count;
+    const char* m_payload;
+    size_t m_payloadSize;
+    // materialized objects by index position, chunks allocated on first use
+    std::unique_ptr<std::atomic<Chunk*>[]> m_chunks;
+    mutable std::atomic<size_t> m_materialized;
+};
+
+template<typename IObject>
+CFrozenContainer<IObject>::CFrozenContainer(const std::string& path)
+    : m_file(path)
+    , m_index(nullptr)
+    , m_count(0)
+    , m_payload(nullptr)
+    , m_payloadSize(0)
+    , m_materialized(0)
+{
+    FrozenImageHeader header;
+    if (m_file.Size() < sizeof(header)) {
+        throw std::runtime_error("frozen image is truncated");
+    }
+    std::memcpy(&header, m_file.Data(), sizeof(header));
+    if (std::memcmp(header.magic, "SCFROZN1", sizeof(header.magic)) != 0 || header.version != 1) {
+        throw std::runtime_error("not a frozen image");
+    }
+    if (header.payloadOffset < sizeof(header) || header.payloadOffset > m_file.Size()
+            || header.payloadSize > m_file.Size() - header.payloadOffset
+            || header.indexOffset % sizeof(uint64_t) != 0 || header.indexOffset > m_file.Size()
+            || header.entryCount > (m_file.Size() - header.indexOffset) / sizeof(FrozenIndexEntry)) {
+        throw std::runtime_error("frozen image is truncated");
+    }
+    m_index = reinterpret_cast<const FrozenIndexEntry*>(m_file.Data() + header.indexOffset);
+    m_count = static_cast<size_t>(header.entryCount);
+    m_payload = m_file.Data() + header.payloadOffset;
+    m_payloadSize = static_cast<size_t>(header.payloadSize);
+
+    size_t chunks = (m_count + ChunkSize - 1) >> ChunkBits;
+    m_chunks.reset(new std::atomic<Chunk*>[chunks]);
+    for (size_t i = 0; i < chunks; ++i) {
+        m_chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+template<typename IObject>
+CFrozenContainer<IObject>::~CFrozenContainer()
+{
+    for (size_t i = 0; i < (m_count + ChunkSize - 1) >> ChunkBits; ++i) {
+        std::unique_ptr<Chunk> chunk(m_chunks[i].load(std::memory_order_acquire));
+        for (size_t slot = 0; chunk && slot < ChunkSize; ++slot) {
+            try {
+                delete chunk->objects[slot].load(std::memory_order_relaxed);
+            } catch (const std::exception &) {
+                //
+            }
+        }
+    }
+}
+
+template<typename IObject>
+const IObject* CFrozenContainer<IObject>::Query(int objectId) const
+{
+    const FrozenIndexEntry* entry = Find(objectId);
+    if (entry == m_index + m_count) {
+        throw std::out_of_range("no object with this id");
+    }
+    size_t position = entry - m_index;
+    std::atomic<Chunk*>& chunkSlot = m_chunks[position >> ChunkBits];
+    Chunk* chunk = chunkSlot.load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+        std::unique_ptr<Chunk> created(new Chunk());
+        for (size_t slot = 0; slot < ChunkSize; ++slot) {
+            created->objects[slot].store(nullptr, std::memory_order_relaxed);
+        }
+        if (chunkSlot.compare_exchange_strong(chunk, created.get(), std::memory_order_acq_rel)) {
+            chunk = created.release();
+        }
+    }
+
+    std::atomic<IObject*>& objectSlot = chunk->objects[position & (ChunkSize - 1)];
+    IObject* object = objectSlot.load(std::memory_order_acquire);
+    if (object != nullptr) {
+        return object;
+    }
+    std::unique_ptr<IObject> decoded(Decode(*entry));
+    if (!decoded) {
+        return nullptr; // a null object, nothing to keep
+    }
+    if (!objectSlot.compare_exchange_strong(object, decoded.get(), std::memory_order_acq_rel)) {
+        return object;
+    }
+    m_materialized.fetch_add(1, std::memory_order_relaxed);
+    return decoded.release();
+}
+
+template<typename IObject>
+const FrozenIndexEntry* CFrozenContainer<IObject>::Find(int objectId) const
+{
+    const FrozenIndexEntry* end = m_index + m_count;
+    const FrozenIndexEntry* entry = std::lower_bound(m_index, end, objectId,
+            [](const FrozenIndexEntry& candidate, int id) { return candidate.id < id; });
+    return entry != end && entry->id == objectId ? entry : end;
+}
+
+template<typename IObject>
+IObject* CFrozenContainer<IObject>::Decode(const FrozenIndexEntry& entry) const
+{
+    int32_t id = 0;
+    uint32_t length = 0;
+    if (entry.offset > m_payloadSize || m_payloadSize - entry.offset < sizeof(id) + sizeof(length)) {
+        throw std::runtime_error("frozen image entry is out of bounds");
+    }
+    const char* record = m_payload + entry.offset;
+    std::memcpy(&id, record, sizeof(id));
+    std::memcpy(&length, record + sizeof(id), sizeof(length));
+    if (id != entry.id) {
+        throw std::runtime_error("frozen image index does not match its payload");
+    }
+    if (length == SnapshotNullObject) {
+        return nullptr;
+    }
+    if (m_payloadSize - entry.offset - sizeof(id) - sizeof(length) < length) {
+        throw std::runtime_error("frozen image entry is out of bounds");
+    }
+    return ObjectSerializer<IObject>::Load(record + sizeof(id) + sizeof(length), length).release();
+}
@@ -0,0 +1,202 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#endif
+#include "ContainerStats.h"
+
+struct WatchdogEvent {
+    ContainerOperation operation;
+    int objectId;
+    uint64_t heldNanoseconds;
+    bool inProgress;                // seen by the monitor thread while the lock was still held, no stack
+    std::vector<std::string> stack; // captured by the holder when it released the lock
+};
+
+/*
+ * Flags critical sections that hold the container lock longer than a threshold.
+ * The holder stamps Enter/Exit; a slow Exit hands back the event, which the
+ * holder reports with its own stack through ReportSlow once it unlocked. A monitor thread additionally reports holds that are still
+ * running, so a stalled destructor shows up before it finishes.
+ * Events go into a bounded ring that overwrites the oldest entries and can be
+ * read at any time with Events().
+ */
+class CLockWatchdog {
+public:
+    explicit CLockWatchdog(std::chrono::nanoseconds threshold, size_t capacity = 256);
+    ~CLockWatchdog();
+    void Enter(ContainerOperation operation, int objectId);
+    // Ends the section; true when it was slow, event then describes it for ReportSlow
+    bool Exit(WatchdogEvent& event);
+    // Adds the caller's stack to a slow section's event and records it, call after unlocking
+    void ReportSlow(WatchdogEvent& event);
+    // Exit and ReportSlow in one, for holders with nothing to release in between
+    void Exit();
+    std::vector<WatchdogEvent> Events() const;
+    uint64_t TotalEvents() const;
+private:
+    CLockWatchdog(const CLockWatchdog&);
+    CLockWatchdog& operator=(const CLockWatchdog&);
+    void MonitorLoop();
+    void Report(WatchdogEvent& event);
+    static std::vector<std::string> CaptureStack();
+private:
+    const uint64_t m_thresholdNanoseconds;
+    // only the lock holder writes these, at most one critical section runs at a time
+    std::atomic<uint64_t> m_enteredAt;
+    std::atomic<int> m_operation;
+    std::atomic<int> m_objectId;
+    uint64_t m_reportedEntry; // monitor thread only
+
+    mutable std::mutex m_eventsMutex;
+    std::vector<WatchdogEvent> m_events;
+    size_t m_capacity;
+    uint64_t m_totalEvents;
+
+    std::mutex m_monitorMutex;
+    std::condition_variable m_monitorWakeUp;
+    bool m_stopping;
+    std::thread m_monitor;
+};
+
+inline CLockWatchdog::CLockWatchdog(std::chrono::nanoseconds threshold, size_t capacity)
+    : m_thresholdNanoseconds(threshold.count())
+    , m_enteredAt(0)
+    , m_operation(0)
+    , m_objectId(0)
+    , m_reportedEntry(0)
+    , m_capacity(std::max<size_t>(capacity, 1))
+    , m_totalEvents(0)
+    , m_stopping(false)
+{
+    m_monitor = std::thread(&CLockWatchdog::MonitorLoop, this);
+}
+
+inline CLockWatchdog::~CLockWatchdog()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_monitorMutex);
+        m_stopping = true;
+    }
+    m_monitorWakeUp.notify_all();
+    m_monitor.join();
+}
+
+inline void CLockWatchdog::Enter(ContainerOperation operation, int objectId)
+{
+    m_operation.store(static_cast<int>(operation), std::memory_order_relaxed);
+    m_objectId.store(objectId, std::memory_order_relaxed);
+    m_enteredAt.store(MonotonicNanoseconds(), std::memory_order_release);
+}
+
+inline bool CLockWatchdog::Exit(WatchdogEvent& event)
+{
+    uint64_t enteredAt = m_enteredAt.load(std::memory_order_relaxed);
+    if (enteredAt == 0) {
+        return false; // another section's Exit ran while this one waited without the lock
+    }
+    m_enteredAt.store(0, std::memory_order_release);
+    uint64_t held = MonotonicNanoseconds() - enteredAt;
+    if (held <= m_thresholdNanoseconds) {
+        return false;
+    }
+    event.operation = static_cast<ContainerOperation>(m_operation.load(std::memory_order_relaxed));
+    event.objectId = m_objectId.load(std::memory_order_relaxed);
+    event.heldNanoseconds = held;
+    event.inProgress = false;
+    return true;
+}
+
+inline void CLockWatchdog::ReportSlow(WatchdogEvent& event)
+{
+    event.stack = CaptureStack();
+    Report(event);
+}
+
+inline void CLockWatchdog::Exit()
+{
+    WatchdogEvent event;
+    if (Exit(event)) {
+        ReportSlow(event);
+    }
+}
+
+inline std::vector<WatchdogEvent> CLockWatchdog::Events() const
+{
+    std::unique_lock<std::mutex> lock(m_eventsMutex);
+    // oldest first; once the ring wrapped the oldest entry sits at the next write position
+    std::vector<WatchdogEvent> events;
+    size_t next = static_cast<size_t>(m_totalEvents % m_capacity);
+    if (m_events.size() == m_capacity) {
+        events.insert(events.end(), m_events.begin() + next, m_events.end());
+        events.insert(events.end(), m_events.begin(), m_events.begin() + next);
+    } else {
+        events = m_events;
+    }
+    return events;
+}
+
+inline uint64_t CLockWatchdog::TotalEvents() const
+{
+    std::unique_lock<std::mutex> lock(m_eventsMutex);
+    return m_totalEvents;
+}
+
+inline void CLockWatchdog::MonitorLoop()
+{
+    std::chrono::nanoseconds period(std::max<uint64_t>(m_thresholdNanoseconds / 2, 1000000));
+    std::unique_lock<std::mutex> lock(m_monitorMutex);
+    while (!m_monitorWakeUp.wait_for(lock, period, [this]() { return m_stopping; })) {
+        uint64_t enteredAt = m_enteredAt.load(std::memory_order_acquire);
+        if (enteredAt == 0 || enteredAt == m_reportedEntry) {
+            continue;
+        }
+        uint64_t held = MonotonicNanoseconds() - enteredAt;
+        if (held > m_thresholdNanoseconds) {
+            WatchdogEvent event;
+            event.operation = static_cast<ContainerOperation>(m_operation.load(std::memory_order_relaxed));
+            event.objectId = m_objectId.load(std::memory_order_relaxed);
+            event.heldNanoseconds = held;
+            event.inProgress = true;
+            Report(event);
+            m_reportedEntry = enteredAt;
+        }
+    }
+}
+
+inline void CLockWatchdog::Report(WatchdogEvent& event)
+{
+    std::unique_lock<std::mutex> lock(m_eventsMutex);
+    if (m_events.size() < m_capacity) {
+        m_events.push_back(std::move(event));
+    } else {
+        m_events[static_cast<size_t>(m_totalEvents % m_capacity)] = std::move(event);
+    }
+    ++m_totalEvents;
+}
+
+inline std::vector<std::string> CLockWatchdog::CaptureStack()
+{
+    std::vector<std::string> stack;
+#if defined(__GLIBC__)
+    void* frames[32];
+    int count = backtrace(frames, 32);
+    char** symbols = backtrace_symbols(frames, count);
+    if (symbols != nullptr) {
+        for (int i = 0; i < count; ++i) {
+            stack.push_back(symbols[i]);
+        }
+        free(symbols);
+    }
+#endif
+    return stack;
+}
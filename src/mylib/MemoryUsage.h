@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <type_traits>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/*
+ * Bytes an object owns, for CSomeContainer::MemoryUsage. Arithmetic types
+ * report their size, types with a `size_t MemorySize() const` member report
+ * that; everything else is unknown unless the trait is specialized.
+ */
+template<typename IObject, typename Enable = void>
+struct ObjectMemorySize {
+    static const bool Known = false;
+    static size_t Of(const IObject&) { return 0; }
+};
+
+template<typename IObject>
+struct ObjectMemorySize<IObject, typename std::enable_if<std::is_arithmetic<IObject>::value>::type> {
+    static const bool Known = true;
+    static size_t Of(const IObject&) { return sizeof(IObject); }
+};
+
+template<typename IObject>
+struct ObjectMemorySize<IObject, typename std::enable_if<
+        std::is_same<decltype(std::declval<const IObject&>().MemorySize()), size_t>::value>::type> {
+    static const bool Known = true;
+    static size_t Of(const IObject& object) { return object.MemorySize(); }
+};
+
+struct ContainerMemoryUsage {
+    ContainerMemoryUsage()
+        : entries(0), nodeBytes(0), storageBytes(0), allocatedBytes(0), payloadKnown(false), payloadBytes(0)
+        , heapFragmentation(-1) {}
+
+    // what the container costs per entry beyond the object itself
+    double BytesPerEntry() const { return entries != 0 ? static_cast<double>(allocatedBytes) / entries : 0; }
+    // container bytes per payload byte, 0 when the payload size is unknown
+    double OverheadRatio() const { return payloadBytes != 0 ? static_cast<double>(allocatedBytes) / payloadBytes : 0; }
+
+    size_t entries;
+    size_t nodeBytes;       // one map node: tree links, key, object pointer and padding
+    size_t storageBytes;    // the container object plus its nodes
+    size_t allocatedBytes;  // storageBytes with the allocator's headers and rounding (estimated for glibc)
+    bool payloadKnown;
+    size_t payloadBytes;    // sum of ObjectMemorySize over the stored objects
+    double heapFragmentation; // process-wide share of the heap malloc holds but has not handed out, -1 if unknown
+};
+
+// Bytes malloc uses for a request: 8 bytes of header, 16 byte granularity, 32 bytes minimum (glibc, 64 bit)
+inline size_t AllocatorChunkBytes(size_t requested)
+{
+#if defined(__GLIBC__)
+    size_t chunk = (requested + sizeof(size_t) + 15) & ~static_cast<size_t>(15);
+    return chunk < 4 * sizeof(size_t) ? 4 * sizeof(size_t) : chunk;
+#else
+    return requested;
+#endif
+}
+
+inline double HeapFragmentation()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    size_t held = info.arena + info.hblkhd;
+    return held != 0 ? static_cast<double>(info.fordblks) / held : 0;
+#else
+    return -1;
+#endif
+}
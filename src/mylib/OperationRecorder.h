@@ -0,0 +1,248 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ContainerStats.h"
+#include "SpscRing.h"
+
+// One recorded operation, 16 bytes on disk (host byte order)
+struct TraceRecord {
+    uint64_t timestamp; // nanoseconds since recording started
+    int32_t objectId;
+    uint16_t thread;    // recording thread, numbered in order of first use
+    uint8_t operation;  // ContainerOperation
+    uint8_t reserved;
+};
+static_assert(sizeof(TraceRecord) == 16, "trace records are written as is");
+
+struct TraceFileHeader {
+    char magic[8];      // "SCTRACE1"
+    uint32_t recordSize;
+    uint32_t reserved;
+};
+
+/*
+ * Records container operations into per-thread SPSC rings, a background
+ * thread drains them into a binary trace file. Recording never blocks: when
+ * a thread's ring is full the record is dropped and counted. Once stopped it
+ * can be restarted into another file, reusing the rings it already has.
+ */
+class COperationRecorder {
+public:
+    explicit COperationRecorder(const std::string& path);
+    ~COperationRecorder();
+    void Record(ContainerOperation operation, int objectId);
+    void Stop();
+    // Records into a new file after Stop; throws std::logic_error while still recording
+    void Restart(const std::string& path);
+    uint64_t Dropped() const;
+private:
+    COperationRecorder(const COperationRecorder&);
+    COperationRecorder& operator=(const COperationRecorder&);
+    enum { RingCapacity = 8192, MaxThreads = 65536 };
+    typedef CSpscRing<TraceRecord, RingCapacity> Ring;
+    static unsigned long long NextInstanceId();
+    Ring* LocalRing(uint16_t& thread);
+    void Open(const std::string& path);
+    void FlushLoop();
+    void Drain();
+private:
+    const unsigned long long m_instanceId;
+    std::atomic<uint64_t> m_start; // of the current recording
+    std::FILE* m_file;
+    std::mutex m_ringsMutex;
+    std::vector<std::shared_ptr<Ring> > m_rings; // threads hold weak references to theirs
+    std::atomic<bool> m_recording;
+    std::atomic<uint64_t> m_dropped;
+
+    std::mutex m_flushMutex;
+    std::condition_variable m_flushWakeUp;
+    bool m_stopping;
+    std::thread m_flusher;
+};
+
+inline COperationRecorder::COperationRecorder(const std::string& path)
+    : m_instanceId(NextInstanceId())
+    , m_start(0)
+    , m_file(nullptr)
+    , m_recording(true)
+    , m_dropped(0)
+    , m_stopping(false)
+{
+    Open(path);
+    m_flusher = std::thread(&COperationRecorder::FlushLoop, this);
+}
+
+inline COperationRecorder::~COperationRecorder()
+{
+    Stop();
+}
+
+inline void COperationRecorder::Record(ContainerOperation operation, int objectId)
+{
+    if (!m_recording.load(std::memory_order_relaxed)) {
+        return;
+    }
+    uint16_t thread = 0;
+    Ring* ring = LocalRing(thread);
+    TraceRecord record;
+    record.timestamp = MonotonicNanoseconds() - m_start.load(std::memory_order_relaxed);
+    record.objectId = objectId;
+    record.thread = thread;
+    record.operation = static_cast<uint8_t>(operation);
+    record.reserved = 0;
+    if (ring == nullptr || !ring->TryPush(record)) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Stops recording, writes everything buffered so far and closes the file
+inline void COperationRecorder::Stop()
+{
+    m_recording.store(false);
+    {
+        std::unique_lock<std::mutex> lock(m_flushMutex);
+        if (m_stopping) {
+            return;
+        }
+        m_stopping = true;
+    }
+    m_flushWakeUp.notify_all();
+    m_flusher.join();
+    Drain();
+    std::fclose(m_file);
+}
+
+inline void COperationRecorder::Restart(const std::string& path)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_flushMutex);
+        if (!m_stopping) {
+            throw std::logic_error("the recorder is still recording");
+        }
+    }
+    {
+        // pushed by threads that were inside Record when it stopped, they belong to neither file
+        TraceRecord batch[256];
+        std::unique_lock<std::mutex> lock(m_ringsMutex);
+        for (auto it = m_rings.begin(); it != m_rings.end(); ++it) {
+            while ((*it)->PopBatch(batch, 256) != 0) {
+            }
+        }
+    }
+    Open(path);
+    m_dropped.store(0, std::memory_order_relaxed);
+    m_stopping = false;
+    m_flusher = std::thread(&COperationRecorder::FlushLoop, this);
+    m_recording.store(true);
+}
+
+inline uint64_t COperationRecorder::Dropped() const
+{
+    return m_dropped.load(std::memory_order_relaxed);
+}
+
+inline unsigned long long COperationRecorder::NextInstanceId()
+{
+    static std::atomic<unsigned long long> counter(0);
+    return ++counter;
+}
+
+inline COperationRecorder::Ring* COperationRecorder::LocalRing(uint16_t& thread)
+{
+    // keyed by instance id rather than address, a new recorder may reuse a destroyed one's memory
+    struct LocalEntry {
+        unsigned long long instanceId;
+        Ring* ring;
+        uint16_t thread;
+        std::weak_ptr<Ring> owner; // expires with the recorder
+    };
+    static thread_local std::vector<LocalEntry> rings;
+    for (auto it = rings.begin(); it != rings.end(); ++it) {
+        if (it->instanceId == m_instanceId) {
+            thread = it->thread;
+            return it->ring;
+        }
+    }
+
+    // entries of destroyed recorders go here, so the list holds only live ones and this new one
+    rings.erase(std::remove_if(rings.begin(), rings.end(), [](const LocalEntry& entry) { return entry.owner.expired(); }),
+                rings.end());
+    std::unique_lock<std::mutex> lock(m_ringsMutex);
+    if (m_rings.size() == MaxThreads) {
+        return nullptr;
+    }
+    m_rings.push_back(std::shared_ptr<Ring>(new Ring));
+    LocalEntry entry = { m_instanceId, m_rings.back().get(), static_cast<uint16_t>(m_rings.size() - 1), m_rings.back() };
+    rings.push_back(entry);
+    thread = entry.thread;
+    return entry.ring;
+}
+
+inline void COperationRecorder::Open(const std::string& path)
+{
+    m_file = std::fopen(path.c_str(), "wb");
+    if (m_file == nullptr) {
+        throw std::runtime_error("cannot open trace file " + path);
+    }
+    TraceFileHeader header;
+    std::memcpy(header.magic, "SCTRACE1", sizeof(header.magic));
+    header.recordSize = sizeof(TraceRecord);
+    header.reserved = 0;
+    std::fwrite(&header, sizeof(header), 1, m_file);
+    m_start.store(MonotonicNanoseconds(), std::memory_order_relaxed);
+}
+
+inline void COperationRecorder::FlushLoop()
+{
+    std::unique_lock<std::mutex> lock(m_flushMutex);
+    while (!m_flushWakeUp.wait_for(lock, std::chrono::milliseconds(10), [this]() { return m_stopping; })) {
+        lock.unlock();
+        Drain();
+        lock.lock();
+    }
+}
+
+inline void COperationRecorder::Drain()
+{
+    TraceRecord batch[256];
+    std::unique_lock<std::mutex> lock(m_ringsMutex);
+    for (auto it = m_rings.begin(); it != m_rings.end(); ++it) {
+        size_t count = 0;
+        while ((count = (*it)->PopBatch(batch, 256)) != 0) {
+            std::fwrite(batch, sizeof(TraceRecord), count, m_file);
+        }
+    }
+    std::fflush(m_file);
+}
+
+// Reads a whole trace written by COperationRecorder, in file order
+inline std::vector<TraceRecord> ReadTrace(const std::string& path)
+{
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "rb"), std::fclose);
+    if (!file) {
+        throw std::runtime_error("cannot open trace file " + path);
+    }
+    TraceFileHeader header;
+    if (std::fread(&header, sizeof(header), 1, file.get()) != 1 || std::memcmp(header.magic, "SCTRACE1", 8) != 0
+            || header.recordSize != sizeof(TraceRecord)) {
+        throw std::runtime_error("not a container trace: " + path);
+    }
+    std::vector<TraceRecord> records;
+    TraceRecord batch[256];
+    size_t count = 0;
+    while ((count = std::fread(batch, sizeof(TraceRecord), 256, file.get())) != 0) {
+        records.insert(records.end(), batch, batch + count);
+    }
+    return records;
+}
@@ -0,0 +1,532 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <pthread.h>
+#endif
+#include "SpscRing.h"
+#include "Transaction.h"
+
+template<typename IObject>
+class CShardedContainer;
+
+/*
+ * Walks the ids present when Start() was called; dereferencing queries the
+ * owning shard, so an id removed in the meantime throws std::out_of_range.
+ */
+template<typename IObject>
+class CShardedContainerIterator {
+public:
+    CShardedContainerIterator(CShardedContainer<IObject>* baseContainer, std::shared_ptr<const std::vector<int> > ids)
+        : m_baseContainer(baseContainer)
+        , m_ids(ids)
+        , m_position(0) {}
+
+    bool operator==(const CShardedContainerIterator<IObject>& right) const {
+        return AtEnd() == right.AtEnd() && (AtEnd() || m_position == right.m_position);
+    }
+
+    IObject* operator*() const {
+        return m_baseContainer->Query((*m_ids)[m_position]);
+    }
+
+    CShardedContainerIterator<IObject>& operator++() {
+        ++m_position;
+        return *this;
+    }
+
+private:
+    bool AtEnd() const {
+        return !m_ids || m_position >= m_ids->size();
+    }
+
+private:
+    CShardedContainer<IObject>* m_baseContainer;
+    std::shared_ptr<const std::vector<int> > m_ids;
+    size_t m_position;
+};
+
+/*
+ * Shared-nothing variant of CSomeContainer: the key space is split across
+ * worker threads pinned to cores, each owning its shard's storage. Other
+ * threads never touch the storage; every call becomes a message on a
+ * single-producer/single-consumer ring from the calling thread to the shard,
+ * and the worker answers a whole drained batch at once.
+ *
+ * Register, Query, Unregister, Start and End keep the CSomeContainer
+ * semantics and block until the shard replied. QueryBatch keeps up to a
+ * ring's worth of messages in flight per shard.
+ * Each calling thread gets its own set of rings on first use; they pass to the
+ * next new thread once it exits, so up to MaxClients threads can be calling at
+ * the same time and the workers poll only the rings of live ones. A worker
+ * that found nothing to do for a while parks until a sender rings its shard.
+ *
+ * Commit locks the shards a transaction touches in ascending order: a locked
+ * shard serves only the committing thread's ring until it is unlocked, so
+ * concurrent commits cannot deadlock and other shards carry on meanwhile.
+ */
+template<typename IObject>
+class CShardedContainer {
+public:
+    explicit CShardedContainer(size_t shardCount = std::thread::hardware_concurrency(), bool pinToCores = true);
+    ~CShardedContainer();
+    void Register(int objectId, std::auto_ptr<IObject> object);
+    IObject* Query(int objectId);
+    void Unregister(int objectId);
+    void QueryBatch(const int* objectIds, size_t count, IObject** results);
+    void Commit(CTransaction<IObject>& transaction);
+    CShardedContainerIterator<IObject> Start();
+    CShardedContainerIterator<IObject> End();
+    size_t ShardCount() const;
+private:
+    // OpSwap and OpDetach hand the displaced object back in the reply instead of destroying it
+    enum Operation { OpRegister, OpQuery, OpUnregister, OpCollectIds, OpLock, OpUnlock, OpSwap, OpDetach };
+    enum { RingCapacity = 64, BatchSize = 32, MaxClients = 1024 };
+
+    struct Reply {
+        Reply() : done(false), result(nullptr), found(false), ids(nullptr) {}
+        std::atomic<bool> done;
+        IObject* result;
+        bool found;
+        std::vector<int>* ids;
+    };
+    struct Message {
+        Operation operation;
+        int objectId;
+        IObject* object;
+        Reply* reply;
+    };
+    typedef CSpscRing<Message, RingCapacity> Ring;
+    struct ClientPort {
+        explicit ClientPort(size_t shardCount) : rings(new Ring[shardCount]), leased(true) {}
+        std::unique_ptr<Ring[]> rings;
+        std::atomic<bool> leased; // false once the thread using the rings exited, they are empty then
+    };
+    // A calling thread's ports, handed back when it exits if their container still exists
+    struct PortLease {
+        unsigned long long instanceId;
+        ClientPort* port;                // what lookups use, the calling container keeps it alive
+        std::weak_ptr<ClientPort> owner; // the same port, for the thread's exit
+    };
+    struct PortLeases {
+        ~PortLeases() {
+            for (auto it = leases.begin(); it != leases.end(); ++it) {
+                std::shared_ptr<ClientPort> port = it->owner.lock();
+                if (port) {
+                    port->leased.store(false, std::memory_order_release);
+                }
+            }
+        }
+        std::vector<PortLease> leases;
+    };
+    struct Shard {
+        Shard() : locked(false), parked(false) {}
+        std::thread worker;
+        std::map<int, IObject*> storage;
+        bool locked; // by the port whose batch is being handled, only the worker touches it
+        std::mutex parkMutex;
+        std::condition_variable doorbell;
+        std::atomic<bool> parked; // the worker sleeps on the doorbell, senders ring it
+    };
+private:
+    CShardedContainer(const CShardedContainer&);
+    CShardedContainer& operator=(const CShardedContainer&);
+    static unsigned long long ImplNextInstanceId();
+    size_t ImplShardOf(int objectId) const;
+    ClientPort& ImplPort();
+    void ImplSend(size_t shard, Operation operation, int objectId, IObject* object, Reply* reply);
+    static void ImplWait(const Reply& reply);
+    void ImplWorkerLoop(size_t shard);
+    void ImplPark(size_t shard);
+    void ImplApply(Shard& shard, const Message& message);
+private:
+    const unsigned long long m_instanceId;
+    std::vector<std::unique_ptr<Shard> > m_shards;
+    std::atomic<ClientPort*> m_ports[MaxClients];
+    std::atomic<size_t> m_portCount;
+    std::vector<std::shared_ptr<ClientPort> > m_portOwners; // the same ports, a calling thread holds weak references
+    std::mutex m_portsMutex; // taken once per calling thread, when it leases its rings
+    std::atomic<bool> m_running;
+};
+
+template<typename IObject>
+CShardedContainer<IObject>::CShardedContainer(size_t shardCount, bool pinToCores)
+    : m_instanceId(ImplNextInstanceId())
+    , m_portCount(0)
+    , m_running(true)
+{
+    shardCount = std::max<size_t>(shardCount, 1);
+    for (size_t i = 0; i < shardCount; ++i) {
+        m_shards.push_back(std::unique_ptr<Shard>(new Shard));
+    }
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < shardCount; ++i) {
+        m_shards[i]->worker = std::thread(&CShardedContainer<IObject>::ImplWorkerLoop, this, i);
+#if defined(__linux__)
+        if (pinToCores) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cores, &cpus);
+            pthread_setaffinity_np(m_shards[i]->worker.native_handle(), sizeof(cpus), &cpus);
+        }
+#else
+        (void)pinToCores;
+        (void)cores;
+#endif
+    }
+}
+
+template<typename IObject>
+CShardedContainer<IObject>::~CShardedContainer()
+{
+    m_running.store(false);
+    for (auto it = m_shards.begin(); it != m_shards.end(); ++it) {
+        {
+            std::unique_lock<std::mutex> lock((*it)->parkMutex);
+            (*it)->doorbell.notify_one();
+        }
+        (*it)->worker.join();
+        for (auto object = (*it)->storage.begin(); object != (*it)->storage.end(); ++object) {
+            try {
+                delete object->second;
+            } catch (const std::exception &) {
+                //
+            }
+        }
+    }
+}
+
+template<typename IObject>
+void CShardedContainer<IObject>::Register(int objectId, std::auto_ptr<IObject> object)
+{
+    Reply reply;
+    ImplSend(ImplShardOf(objectId), OpRegister, objectId, object.release(), &reply);
+    ImplWait(reply);
+}
+
+template<typename IObject>
+IObject* CShardedContainer<IObject>::Query(int objectId)
+{
+    Reply reply;
+    ImplSend(ImplShardOf(objectId), OpQuery, objectId, nullptr, &reply);
+    ImplWait(reply);
+    if (!reply.found) {
+        throw std::out_of_range("object is not registered");
+    }
+    return reply.result;
+}
+
+template<typename IObject>
+void CShardedContainer<IObject>::Unregister(int objectId)
+{
+    Reply reply;
+    ImplSend(ImplShardOf(objectId), OpUnregister, objectId, nullptr, &reply);
+    ImplWait(reply);
+}
+
+template<typename IObject>
+void CShardedContainer<IObject>::QueryBatch(const int* objectIds, size_t count, IObject** results)
+{
+    std::unique_ptr<Reply[]> replies(new Reply[count]);
+    for (size_t i = 0; i < count; ++i) {
+        ImplSend(ImplShardOf(objectIds[i]), OpQuery, objectIds[i], nullptr, &replies[i]);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        ImplWait(replies[i]);
+        results[i] = replies[i].found ? replies[i].result : nullptr;
+    }
+}
+
+/*
+ * Locks every shard the transaction touches, lowest index first and each one
+ * before asking for the next, applies the operations and unlocks; the
+ * displaced objects are destroyed on the calling thread afterwards.
+ */
+template<typename IObject>
+void CShardedContainer<IObject>::Commit(CTransaction<IObject>& transaction)
+{
+    std::vector<typename CTransaction<IObject>::Operation> operations;
+    transaction.Release(operations);
+    std::vector<size_t> shards;
+    for (auto it = operations.begin(); it != operations.end(); ++it) {
+        shards.push_back(ImplShardOf(it->objectId));
+    }
+    std::sort(shards.begin(), shards.end());
+    shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+
+    std::unique_ptr<Reply[]> locks(new Reply[shards.size()]);
+    for (size_t i = 0; i < shards.size(); ++i) {
+        ImplSend(shards[i], OpLock, 0, nullptr, &locks[i]);
+        ImplWait(locks[i]);
+    }
+    std::unique_ptr<Reply[]> replies(new Reply[operations.size()]);
+    for (size_t i = 0; i < operations.size(); ++i) {
+        const typename CTransaction<IObject>::Operation& operation = operations[i];
+        ImplSend(ImplShardOf(operation.objectId), operation.unregister ? OpDetach : OpSwap,
+                 operation.objectId, operation.object, &replies[i]);
+    }
+    std::unique_ptr<Reply[]> unlocks(new Reply[shards.size()]);
+    for (size_t i = 0; i < shards.size(); ++i) {
+        ImplSend(shards[i], OpUnlock, 0, nullptr, &unlocks[i]);
+    }
+    for (size_t i = 0; i < shards.size(); ++i) {
+        ImplWait(unlocks[i]);
+    }
+    for (size_t i = 0; i < operations.size(); ++i) {
+        // the ring delivers in order, the unlock being done means every operation is
+        try {
+            delete replies[i].result;
+        } catch (const std::exception &) {
+            //
+        }
+    }
+}
+
+template<typename IObject>
+CShardedContainerIterator<IObject> CShardedContainer<IObject>::Start()
+{
+    std::vector<std::vector<int> > shardIds(m_shards.size());
+    std::unique_ptr<Reply[]> replies(new Reply[m_shards.size()]);
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        replies[i].ids = &shardIds[i];
+        ImplSend(i, OpCollectIds, 0, nullptr, &replies[i]);
+    }
+    std::shared_ptr<std::vector<int> > ids = std::make_shared<std::vector<int> >();
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        ImplWait(replies[i]);
+        ids->insert(ids->end(), shardIds[i].begin(), shardIds[i].end());
+    }
+    std::sort(ids->begin(), ids->end());
+    return CShardedContainerIterator<IObject>(this, ids);
+}
+
+template<typename IObject>
+CShardedContainerIterator<IObject> CShardedContainer<IObject>::End()
+{
+    return CShardedContainerIterator<IObject>(this, std::shared_ptr<const std::vector<int> >());
+}
+
+template<typename IObject>
+size_t CShardedContainer<IObject>::ShardCount() const
+{
+    return m_shards.size();
+}
+
+template<typename IObject>
+unsigned long long CShardedContainer<IObject>::ImplNextInstanceId()
+{
+    static std::atomic<unsigned long long> counter(0);
+    return ++counter;
+}
+
+template<typename IObject>
+size_t CShardedContainer<IObject>::ImplShardOf(int objectId) const
+{
+    // Fibonacci hashing spreads sequential ids over all shards
+    unsigned long long hash = static_cast<unsigned int>(objectId) * 11400714819323198485ull;
+    return static_cast<size_t>((hash >> 32) % m_shards.size());
+}
+
+template<typename IObject>
+typename CShardedContainer<IObject>::ClientPort& CShardedContainer<IObject>::ImplPort()
+{
+    // keyed by instance id rather than address, a new container may reuse a destroyed one's memory
+    static thread_local PortLeases ports;
+    for (auto it = ports.leases.begin(); it != ports.leases.end(); ++it) {
+        if (it->instanceId == m_instanceId) {
+            return *it->port;
+        }
+    }
+
+    // the leases of destroyed containers are dropped here, no lookup passes over them again
+    ports.leases.erase(std::remove_if(ports.leases.begin(), ports.leases.end(),
+                                      [](const PortLease& lease) { return lease.owner.expired(); }),
+                       ports.leases.end());
+    std::unique_lock<std::mutex> lock(m_portsMutex);
+    std::shared_ptr<ClientPort> port;
+    for (auto it = m_portOwners.begin(); it != m_portOwners.end() && !port; ++it) {
+        if (!(*it)->leased.load(std::memory_order_acquire)) {
+            (*it)->leased.store(true, std::memory_order_relaxed);
+            port = *it;
+        }
+    }
+    if (!port) {
+        size_t index = m_portCount.load(std::memory_order_relaxed);
+        if (index == MaxClients) {
+            throw std::runtime_error("too many threads access the sharded container");
+        }
+        port = std::make_shared<ClientPort>(m_shards.size());
+        m_portOwners.push_back(port);
+        m_ports[index].store(port.get(), std::memory_order_release);
+        m_portCount.store(index + 1, std::memory_order_release);
+    }
+    PortLease lease = { m_instanceId, port.get(), port };
+    ports.leases.push_back(lease);
+    return *port;
+}
+
+template<typename IObject>
+void CShardedContainer<IObject>::ImplSend(size_t shard, Operation operation, int objectId, IObject* object, Reply* reply)
+{
+    Message message;
+    message.operation = operation;
+    message.objectId = objectId;
+    message.object = object;
+    message.reply = reply;
+    Ring& ring = ImplPort().rings[shard];
+    while (!ring.TryPush(message)) {
+        std::this_thread::yield();
+    }
+    // pairs with the fence in ImplPark: either the worker's last look finds the message or this sees it parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    Shard& target = *m_shards[shard];
+    if (target.parked.load(std::memory_order_relaxed)) {
+        std::unique_lock<std::mutex> lock(target.parkMutex);
+        target.doorbell.notify_one();
+    }
+}
+
+template<typename IObject>
+void CShardedContainer<IObject>::ImplWait(const Reply& reply)
+{
+    while (!reply.done.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+}
+
+template<typename IObject>
+void CShardedContainer<IObject>::ImplWorkerLoop(size_t shardIndex)
+{
+    Shard& shard = *m_shards[shardIndex];
+    Message batch[BatchSize];
+    unsigned idleRounds = 0;
+    while (m_running.load(std::memory_order_relaxed)) {
+        size_t handled = 0;
+        size_t portCount = m_portCount.load(std::memory_order_acquire);
+        for (size_t i = 0; i < portCount; ++i) {
+            ClientPort* port = m_ports[i].load(std::memory_order_acquire);
+            if (!port->leased.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            Ring& ring = port->rings[shardIndex];
+            size_t count = ring.PopBatch(batch, BatchSize);
+            for (size_t j = 0; j < count; ++j) {
+                ImplApply(shard, batch[j]);
+            }
+            for (size_t j = 0; j < count; ++j) {
+                batch[j].reply->done.store(true, std::memory_order_release);
+            }
+            handled += count;
+            while (shard.locked && m_running.load(std::memory_order_relaxed)) {
+                // a transaction holds the shard, the other ports wait until its unlock
+                count = ring.PopBatch(batch, BatchSize);
+                for (size_t j = 0; j < count; ++j) {
+                    ImplApply(shard, batch[j]);
+                }
+                for (size_t j = 0; j < count; ++j) {
+                    batch[j].reply->done.store(true, std::memory_order_release);
+                }
+                if (count == 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        if (handled != 0) {
+            idleRounds = 0;
+        } else if (++idleRounds < 1024) {
+            std::this_thread::yield();
+        } else {
+            ImplPark(shardIndex);
+            idleRounds = 0;
+        }
+    }
+}
+
+// Sleeps until a sender rings the doorbell; the rings get one more look after the flag is raised, so none is left waiting
+template<typename IObject>
+void CShardedContainer<IObject>::ImplPark(size_t shardIndex)
+{
+    Shard& shard = *m_shards[shardIndex];
+    std::unique_lock<std::mutex> lock(shard.parkMutex);
+    shard.parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool empty = true;
+    size_t portCount = m_portCount.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < portCount && empty; ++i) {
+        ClientPort* port = m_ports[i].load(std::memory_order_acquire);
+        empty = !port->leased.load(std::memory_order_relaxed) || port->rings[shardIndex].Empty();
+    }
+    if (empty && m_running.load(std::memory_order_relaxed)) {
+        shard.doorbell.wait(lock);
+    }
+    shard.parked.store(false, std::memory_order_relaxed);
+}
+
+template<typename IObject>
+void CShardedContainer<IObject>::ImplApply(Shard& shard, const Message& message)
+{
+    auto it = shard.storage.find(message.objectId);
+    switch (message.operation) {
+    case OpRegister:
+        if (it == shard.storage.end()) {
+            shard.storage.insert(std::make_pair(message.objectId, message.object));
+            break;
+        }
+        try {
+            delete it->second;
+        } catch (const std::exception &) {
+            //
+        }
+        it->second = message.object;
+        break;
+    case OpQuery:
+        if (it != shard.storage.end()) {
+            message.reply->result = it->second;
+            message.reply->found = true;
+        }
+        break;
+    case OpUnregister:
+        if (it != shard.storage.end()) {
+            try {
+                delete it->second;
+            } catch (const std::exception &) {
+                //
+            }
+            shard.storage.erase(it);
+        }
+        break;
+    case OpCollectIds:
+        for (auto object = shard.storage.begin(); object != shard.storage.end(); ++object) {
+            message.reply->ids->push_back(object->first);
+        }
+        break;
+    case OpLock:
+        shard.locked = true;
+        break;
+    case OpUnlock:
+        shard.locked = false;
+        break;
+    case OpSwap:
+        if (it == shard.storage.end()) {
+            shard.storage.insert(std::make_pair(message.objectId, message.object));
+        } else {
+            message.reply->result = it->second;
+            it->second = message.object;
+        }
+        break;
+    case OpDetach:
+        if (it != shard.storage.end()) {
+            message.reply->result = it->second;
+            shard.storage.erase(it);
+        }
+        break;
+    }
+}
@@ -0,0 +1,398 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "shared segments need address-free atomics");
+
+/*
+ * Id to value registry in a named shared-memory segment, one copy for every
+ * process on the host that opens the same name. Values are copied in and
+ * out, so T must be trivially copyable. The segment holds a fixed number of
+ * entries set by whoever creates it.
+ *
+ * Nothing in the segment is an address: buckets and chains refer to nodes by
+ * their offset in the node array, so each process may map it anywhere.
+ * Writers serialize on a process-shared mutex (robust on Linux: a writer
+ * that dies while holding it does not block the others). Readers take no
+ * lock and make no system call; they copy optimistically and check the
+ * bucket's sequence, which writers keep odd while they change the bucket.
+ * POSIX only.
+ */
+template<typename T>
+class CSharedContainer {
+    static_assert(std::is_trivially_copyable<T>::value, "shared container values are copied bytewise");
+public:
+    /*
+     * Attaches to the segment called name, creating it with room for capacity
+     * entries if it does not exist. Attaching waits up to AttachTimeout for the
+     * creator to set the segment up and throws std::runtime_error after that,
+     * for example when the creator died halfway; Remove clears such a segment.
+     */
+    CSharedContainer(const std::string& name, size_t capacity);
+    // Detaches; the segment stays until Remove
+    ~CSharedContainer();
+    static void Remove(const std::string& name);
+
+    // Throws std::runtime_error when the segment is full
+    void Register(int objectId, const T& value);
+    // Throws std::out_of_range for a missing id
+    T Query(int objectId) const;
+    bool TryQuery(int objectId, T& value) const;
+    void Unregister(int objectId);
+    size_t Size() const;
+    size_t Capacity() const;
+
+private:
+    CSharedContainer(const CSharedContainer&);
+    CSharedContainer& operator=(const CSharedContainer&);
+    struct Header {
+        char magic[8]; // "SCSHARE1"
+        uint32_t valueSize;
+        uint32_t reserved;
+        uint64_t capacity;
+        uint64_t bucketCount; // power of two
+        std::atomic<uint32_t> ready;
+        std::atomic<uint32_t> size;
+        uint32_t freeNode;    // offset + 1 of the first free node, 0 when none
+        uint32_t unusedNodes; // nodes from here on were never handed out
+#if !defined(_WIN32)
+        pthread_mutex_t writers;
+#endif
+    };
+    struct Bucket {
+        std::atomic<uint32_t> sequence;
+        std::atomic<uint32_t> head; // node offset + 1, 0 when empty
+    };
+    struct Node {
+        std::atomic<uint32_t> next; // node offset + 1, 0 at the end of the chain
+        std::atomic<int32_t> id;
+        T value;
+    };
+    // Holds the writer mutex, repairing the buckets a dead writer left half changed
+    class CWriterLock {
+    public:
+        explicit CWriterLock(Header& header, Bucket* buckets);
+        ~CWriterLock();
+    private:
+        Header& m_header;
+    };
+    enum { SectionAlignment = 64, AttachTimeoutMilliseconds = 5000 };
+    static size_t Align(size_t offset) { return (offset + SectionAlignment - 1) / SectionAlignment * SectionAlignment; }
+    static size_t BucketsOffset() { return Align(sizeof(Header)); }
+    static size_t NodesOffset(uint64_t bucketCount) { return BucketsOffset() + Align(static_cast<size_t>(bucketCount) * sizeof(Bucket)); }
+    static uint64_t BucketCountFor(size_t capacity);
+    // Maps the header and the given number of buckets and nodes
+    void Map(int descriptor, uint64_t capacity, uint64_t bucketCount);
+    Bucket& BucketOf(int objectId) const;
+    Node& NodeAt(uint32_t link) const { return m_nodes[link - 1]; }
+private:
+    char* m_segment;
+    size_t m_size;
+    Header* m_header;
+    Bucket* m_buckets;
+    Node* m_nodes;
+};
+
+template<typename T>
+CSharedContainer<T>::CSharedContainer(const std::string& name, size_t capacity)
+    : m_segment(nullptr), m_size(0), m_header(nullptr), m_buckets(nullptr), m_nodes(nullptr)
+{
+#if defined(_WIN32)
+    (void)name;
+    (void)capacity;
+    throw std::runtime_error("shared containers need POSIX shared memory");
+#else
+    if (capacity == 0 || capacity >= 0xffffffffu) {
+        throw std::invalid_argument("shared container capacity out of range");
+    }
+    int descriptor = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool creator = descriptor >= 0;
+    if (!creator && errno == EEXIST) {
+        descriptor = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (descriptor < 0) {
+        throw std::runtime_error("cannot open shared segment " + name);
+    }
+
+    try {
+        if (creator) {
+            uint64_t bucketCount = BucketCountFor(capacity);
+            if (ftruncate(descriptor, static_cast<off_t>(NodesOffset(bucketCount) + capacity * sizeof(Node))) != 0) {
+                throw std::runtime_error("cannot size shared segment " + name);
+            }
+            Map(descriptor, capacity, bucketCount); // a fresh segment reads as zeros: empty buckets, no nodes handed out
+            std::memcpy(m_header->magic, "SCSHARE1", sizeof(m_header->magic));
+            m_header->valueSize = sizeof(T);
+            m_header->capacity = capacity;
+            m_header->bucketCount = bucketCount;
+            pthread_mutexattr_t attributes;
+            pthread_mutexattr_init(&attributes);
+            pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#if defined(__linux__)
+            pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif
+            int initialized = pthread_mutex_init(&m_header->writers, &attributes);
+            pthread_mutexattr_destroy(&attributes);
+            if (initialized != 0) {
+                throw std::runtime_error("cannot set up shared segment " + name);
+            }
+            m_header->ready.store(1, std::memory_order_release);
+        } else {
+            // the creator may not have sized the segment yet
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(AttachTimeoutMilliseconds);
+            auto waitForCreator = [&name, deadline]() {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    throw std::runtime_error("shared segment " + name + " was never set up, its creator may have died");
+                }
+                std::this_thread::yield();
+            };
+            struct stat status;
+            while (fstat(descriptor, &status) == 0 && static_cast<size_t>(status.st_size) < sizeof(Header)) {
+                waitForCreator();
+            }
+            Map(descriptor, 0, 0);
+            while (m_header->ready.load(std::memory_order_acquire) == 0) {
+                waitForCreator();
+            }
+            uint64_t existingCapacity = m_header->capacity;
+            uint64_t bucketCount = m_header->bucketCount;
+            bool matches = std::memcmp(m_header->magic, "SCSHARE1", sizeof(m_header->magic)) == 0 && m_header->valueSize == sizeof(T);
+            munmap(m_segment, m_size);
+            m_segment = nullptr;
+            if (!matches) {
+                throw std::runtime_error("shared segment " + name + " holds another value type");
+            }
+            Map(descriptor, existingCapacity, bucketCount);
+        }
+    } catch (...) {
+        if (m_segment != nullptr) {
+            munmap(m_segment, m_size);
+            m_segment = nullptr;
+        }
+        close(descriptor);
+        if (creator) {
+            // a segment that never gets ready would hold up every later opener
+            shm_unlink(name.c_str());
+        }
+        throw;
+    }
+    close(descriptor);
+#endif
+}
+
+template<typename T>
+CSharedContainer<T>::~CSharedContainer()
+{
+#if !defined(_WIN32)
+    if (m_segment != nullptr) {
+        munmap(m_segment, m_size);
+    }
+#endif
+}
+
+template<typename T>
+void CSharedContainer<T>::Remove(const std::string& name)
+{
+#if !defined(_WIN32)
+    shm_unlink(name.c_str());
+#else
+    (void)name;
+#endif
+}
+
+template<typename T>
+void CSharedContainer<T>::Register(int objectId, const T& value)
+{
+    Bucket& bucket = BucketOf(objectId);
+    CWriterLock lock(*m_header, m_buckets);
+    for (uint32_t link = bucket.head.load(std::memory_order_relaxed); link != 0; link = NodeAt(link).next.load(std::memory_order_relaxed)) {
+        Node& node = NodeAt(link);
+        if (node.id.load(std::memory_order_relaxed) == objectId) {
+            uint32_t sequence = bucket.sequence.load(std::memory_order_relaxed);
+            bucket.sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            std::memcpy(&node.value, &value, sizeof(T));
+            bucket.sequence.store(sequence + 2, std::memory_order_release);
+            return;
+        }
+    }
+
+    uint32_t link = m_header->freeNode;
+    if (link != 0) {
+        m_header->freeNode = NodeAt(link).next.load(std::memory_order_relaxed);
+    } else if (m_header->unusedNodes < m_header->capacity) {
+        link = ++m_header->unusedNodes;
+    } else {
+        throw std::runtime_error("shared container is full");
+    }
+    // a reader still walking this node's old chain sees that bucket's sequence change and retries
+    Node& node = NodeAt(link);
+    node.id.store(objectId, std::memory_order_relaxed);
+    std::memcpy(&node.value, &value, sizeof(T));
+    node.next.store(bucket.head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    bucket.head.store(link, std::memory_order_release);
+    m_header->size.fetch_add(1, std::memory_order_relaxed);
+}
+
+template<typename T>
+T CSharedContainer<T>::Query(int objectId) const
+{
+    T value;
+    if (!TryQuery(objectId, value)) {
+        throw std::out_of_range("no object with this id");
+    }
+    return value;
+}
+
+template<typename T>
+bool CSharedContainer<T>::TryQuery(int objectId, T& value) const
+{
+    const Bucket& bucket = BucketOf(objectId);
+    for (;;) {
+        uint32_t sequence = bucket.sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        bool found = false;
+        uint32_t link = bucket.head.load(std::memory_order_acquire);
+        // the chain may be rewired under us, a bounded walk with checked offsets stays inside the segment
+        for (uint64_t steps = 0; link != 0 && link <= m_header->capacity && steps < m_header->capacity; ++steps) {
+            const Node& node = NodeAt(link);
+            if (node.id.load(std::memory_order_relaxed) == objectId) {
+                std::memcpy(&value, &node.value, sizeof(T));
+                found = true;
+                break;
+            }
+            link = node.next.load(std::memory_order_acquire);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (bucket.sequence.load(std::memory_order_relaxed) == sequence) {
+            return found;
+        }
+    }
+}
+
+template<typename T>
+void CSharedContainer<T>::Unregister(int objectId)
+{
+    Bucket& bucket = BucketOf(objectId);
+    CWriterLock lock(*m_header, m_buckets);
+    std::atomic<uint32_t>* previous = &bucket.head;
+    for (uint32_t link = previous->load(std::memory_order_relaxed); link != 0; link = previous->load(std::memory_order_relaxed)) {
+        Node& node = NodeAt(link);
+        if (node.id.load(std::memory_order_relaxed) == objectId) {
+            uint32_t sequence = bucket.sequence.load(std::memory_order_relaxed);
+            bucket.sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            previous->store(node.next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            bucket.sequence.store(sequence + 2, std::memory_order_release);
+            node.next.store(m_header->freeNode, std::memory_order_relaxed);
+            m_header->freeNode = link;
+            m_header->size.fetch_sub(1, std::memory_order_relaxed);
+            return;
+        }
+        previous = &node.next;
+    }
+}
+
+template<typename T>
+size_t CSharedContainer<T>::Size() const
+{
+    return m_header->size.load(std::memory_order_relaxed);
+}
+
+template<typename T>
+size_t CSharedContainer<T>::Capacity() const
+{
+    return static_cast<size_t>(m_header->capacity);
+}
+
+// About two buckets per entry keeps the chains short
+template<typename T>
+uint64_t CSharedContainer<T>::BucketCountFor(size_t capacity)
+{
+    uint64_t count = 1;
+    while (count < capacity * 2) {
+        count <<= 1;
+    }
+    return count;
+}
+
+template<typename T>
+void CSharedContainer<T>::Map(int descriptor, uint64_t capacity, uint64_t bucketCount)
+{
+#if !defined(_WIN32)
+    size_t size = NodesOffset(bucketCount) + static_cast<size_t>(capacity) * sizeof(Node);
+    void* segment = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    if (segment == MAP_FAILED) {
+        throw std::runtime_error("cannot map shared segment");
+    }
+    m_segment = static_cast<char*>(segment);
+    m_size = size;
+    m_header = reinterpret_cast<Header*>(m_segment);
+    m_buckets = reinterpret_cast<Bucket*>(m_segment + BucketsOffset());
+    m_nodes = reinterpret_cast<Node*>(m_segment + NodesOffset(bucketCount));
+#else
+    (void)descriptor;
+    (void)capacity;
+    (void)bucketCount;
+#endif
+}
+
+template<typename T>
+typename CSharedContainer<T>::Bucket& CSharedContainer<T>::BucketOf(int objectId) const
+{
+    uint32_t hash = static_cast<uint32_t>(objectId) * 2654435761u; // Fibonacci hashing spreads sequential ids
+    return m_buckets[hash & (m_header->bucketCount - 1)];
+}
+
+template<typename T>
+CSharedContainer<T>::CWriterLock::CWriterLock(Header& header, Bucket* buckets)
+    : m_header(header)
+{
+#if !defined(_WIN32)
+    int result = pthread_mutex_lock(&header.writers);
+#if defined(__linux__)
+    if (result == EOWNERDEAD) {
+        // the dead writer may have left a bucket odd, readers would wait on it forever
+        for (uint64_t i = 0; i < header.bucketCount; ++i) {
+            uint32_t sequence = buckets[i].sequence.load(std::memory_order_relaxed);
+            if (sequence & 1) {
+                buckets[i].sequence.store(sequence + 1, std::memory_order_release);
+            }
+        }
+        pthread_mutex_consistent(&header.writers);
+        result = 0;
+    }
+#endif
+    if (result != 0) {
+        throw std::runtime_error("cannot lock the shared container");
+    }
+#else
+    (void)buckets;
+#endif
+}
+
+template<typename T>
+CSharedContainer<T>::CWriterLock::~CWriterLock()
+{
+#if !defined(_WIN32)
+    pthread_mutex_unlock(&m_header.writers);
+#endif
+}
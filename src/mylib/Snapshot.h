@@ -0,0 +1,227 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * How CSomeContainer::SaveSnapshot/LoadSnapshot encode an object. Specialize
+ * for the stored type:
+ *
+ *   static void Save(const IObject& object, std::string& out);           // append the encoding
+ *   static std::auto_ptr<IObject> Load(const char* data, size_t size);   // throw on malformed data
+ *
+ * Arithmetic types and std::string are provided.
+ */
+template<typename IObject, typename Enable = void>
+struct ObjectSerializer;
+
+template<typename IObject>
+struct ObjectSerializer<IObject, typename std::enable_if<std::is_arithmetic<IObject>::value>::type> {
+    static void Save(const IObject& object, std::string& out) {
+        out.append(reinterpret_cast<const char*>(&object), sizeof(object));
+    }
+    static std::auto_ptr<IObject> Load(const char* data, size_t size) {
+        if (size != sizeof(IObject)) {
+            throw std::runtime_error("snapshot entry has the wrong size");
+        }
+        std::auto_ptr<IObject> object(new IObject);
+        std::memcpy(object.get(), data, sizeof(IObject));
+        return object;
+    }
+};
+
+template<>
+struct ObjectSerializer<std::string> {
+    static void Save(const std::string& object, std::string& out) {
+        out.append(object);
+    }
+    static std::auto_ptr<std::string> Load(const char* data, size_t size) {
+        return std::auto_ptr<std::string>(new std::string(data, size));
+    }
+};
+
+/*
+ * Snapshot file, host byte order:
+ *   SnapshotFileHeader
+ *   SnapshotLogPosition, version 2 only (write-ahead log checkpoints)
+ *   blocks, each: entry count (u32), then per entry id (i32), length (u32, ~0u for a null object), bytes
+ *   SnapshotBlockIndex for every block
+ *   SnapshotFooter
+ * Blocks hold ascending ids and decode independently; the index at the end
+ * lets the writer stream blocks without knowing their number up front.
+ */
+struct SnapshotFileHeader {
+    char magic[8]; // "SCSNAP01"
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct SnapshotBlockIndex {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum; // FNV-1a of the block bytes
+    uint32_t entries;
+    int32_t firstId;
+};
+
+struct SnapshotFooter {
+    uint64_t indexOffset;
+    uint64_t blockCount;
+    char magic[8]; // "SCSNAPIX"
+};
+
+struct SnapshotLogPosition {
+    uint64_t sequence;     // last log record the image includes
+    uint64_t firstSegment; // oldest log segment still needed
+};
+
+const uint32_t SnapshotNullObject = 0xffffffffu;
+
+inline uint64_t SnapshotChecksum(const char* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Moves a finished temporary file over path
+inline void SnapshotReplaceFile(const std::string& temporary, const std::string& path)
+{
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        // Windows does not replace an existing file
+        std::remove(path.c_str());
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("cannot replace " + path);
+        }
+    }
+}
+
+/*
+ * Reads the header, footer and block index of an open snapshot; position,
+ * when given, receives the log position of a checkpoint (zeros otherwise).
+ */
+inline std::vector<SnapshotBlockIndex> SnapshotReadIndex(std::FILE* file, const std::string& path, SnapshotLogPosition* position)
+{
+    auto read = [file, &path](void* data, size_t size) {
+        if (size != 0 && std::fread(data, size, 1, file) != 1) {
+            throw std::runtime_error("snapshot is truncated: " + path);
+        }
+    };
+    SnapshotFileHeader header;
+    read(&header, sizeof(header));
+    if (std::memcmp(header.magic, "SCSNAP01", sizeof(header.magic)) != 0 || (header.version != 1 && header.version != 2)) {
+        throw std::runtime_error("not a container snapshot: " + path);
+    }
+    SnapshotLogPosition logPosition = SnapshotLogPosition();
+    if (header.version == 2) {
+        read(&logPosition, sizeof(logPosition));
+    }
+    SnapshotFooter footer;
+    if (std::fseek(file, -static_cast<long>(sizeof(footer)), SEEK_END) != 0) {
+        throw std::runtime_error("not a container snapshot: " + path);
+    }
+    read(&footer, sizeof(footer));
+    if (std::memcmp(footer.magic, "SCSNAPIX", sizeof(footer.magic)) != 0
+            || std::fseek(file, static_cast<long>(footer.indexOffset), SEEK_SET) != 0) {
+        throw std::runtime_error("snapshot has no block index: " + path);
+    }
+    std::vector<SnapshotBlockIndex> index(static_cast<size_t>(footer.blockCount));
+    read(index.data(), index.size() * sizeof(SnapshotBlockIndex));
+    if (position != nullptr) {
+        *position = logPosition;
+    }
+    return index;
+}
+
+// Reads one block as stored, the checksum is left to the caller
+inline void SnapshotReadBlock(std::FILE* file, const std::string& path, const SnapshotBlockIndex& entry, std::string& block)
+{
+    block.resize(static_cast<size_t>(entry.size));
+    if (std::fseek(file, static_cast<long>(entry.offset), SEEK_SET) != 0
+            || (!block.empty() && std::fread(&block[0], block.size(), 1, file) != 1)) {
+        throw std::runtime_error("snapshot is truncated: " + path);
+    }
+}
+
+// Bytes of the encoded entry at data, without decoding the object
+inline size_t SnapshotEntrySize(const char* data, size_t available)
+{
+    uint32_t length = 0;
+    if (available < sizeof(int32_t) + sizeof(length)) {
+        throw std::runtime_error("snapshot block is truncated");
+    }
+    std::memcpy(&length, data + sizeof(int32_t), sizeof(length));
+    size_t size = sizeof(int32_t) + sizeof(length) + (length != SnapshotNullObject ? length : 0);
+    if (size > available) {
+        throw std::runtime_error("snapshot block is truncated");
+    }
+    return size;
+}
+
+// Appends one entry to a block being built
+template<typename IObject>
+void SnapshotEncodeEntry(int objectId, const IObject* object, std::string& block)
+{
+    int32_t id = objectId;
+    block.append(reinterpret_cast<const char*>(&id), sizeof(id));
+    size_t lengthAt = block.size();
+    uint32_t length = SnapshotNullObject;
+    block.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    if (object != nullptr) {
+        ObjectSerializer<IObject>::Save(*object, block);
+        length = static_cast<uint32_t>(block.size() - lengthAt - sizeof(length));
+        std::memcpy(&block[lengthAt], &length, sizeof(length));
+    }
+}
+
+/*
+ * Decodes a whole block into (id, object) pairs; on failure the objects
+ * decoded so far are deleted and the exception is passed on.
+ */
+template<typename IObject>
+std::vector<std::pair<int, IObject*> > SnapshotDecodeBlock(const std::string& block)
+{
+    std::vector<std::pair<int, IObject*> > entries;
+    try {
+        size_t position = 0;
+        auto read = [&block, &position](void* target, size_t size) {
+            if (block.size() - position < size) {
+                throw std::runtime_error("snapshot block is truncated");
+            }
+            std::memcpy(target, block.data() + position, size);
+            position += size;
+        };
+        uint32_t count = 0;
+        read(&count, sizeof(count));
+        entries.reserve(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            int32_t id = 0;
+            uint32_t length = 0;
+            read(&id, sizeof(id));
+            read(&length, sizeof(length));
+            IObject* object = nullptr;
+            if (length != SnapshotNullObject) {
+                if (block.size() - position < length) {
+                    throw std::runtime_error("snapshot block is truncated");
+                }
+                object = ObjectSerializer<IObject>::Load(block.data() + position, length).release();
+                position += length;
+            }
+            entries.push_back(std::make_pair(static_cast<int>(id), object));
+        }
+    } catch (...) {
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            delete it->second;
+        }
+        throw;
+    }
+    return entries;
+}
@@ -3,93 +3,1612 @@
 #include <map>
 #include <cassert>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <atomic>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <limits>
 #include "SomeContainerIterator.h"
+#include "WorkerPool.h"
+#include "AdaptiveMutex.h"
+#include "ContainerStats.h"
+#include "LockWatchdog.h"
+#include "OperationRecorder.h"
+#include "AllocationTracker.h"
+#include "MemoryUsage.h"
+#include "SpanTracer.h"
+#include "Snapshot.h"
+#include "FrozenContainer.h"
+#include "WriteAheadLog.h"
+#include "ForkSnapshot.h"
+#include "ChangeFeed.h"
+#include "Transaction.h"
 
 template<typename KeyType, typename ValueType>
-using  KeyValueStore = std::map<KeyType, ValueType>;
+using  KeyValueStore = std::map<KeyType, ValueType, std::less<KeyType>, CTrackingAllocator<std::pair<const KeyType, ValueType> > >;
 
-template<typename IObject>
+// What Query does with an id whose RegisterAsync factory is still running
+enum class PendingPolicy {
+    Miss, // behave as if only the already published state existed
+    Wait  // block until every pending construction of the id is published
+};
+
+// Where the objects detached by Clear or the destructor are destroyed
+enum class TeardownMode {
+    Inline,     // sequentially on the calling thread
+    Parallel,   // on the worker pool, the caller waits for completion
+    Background  // on the worker pool, the caller returns immediately;
+                // the destructor only returns early when the pool is shared and outlives the container
+};
+
+// How Register and Unregister get to the storage
+enum class WriteMode {
+    Locking,      // every writer takes the lock itself
+    FlatCombining // writers publish their operation, whoever holds the lock applies all published ones
+};
+
+/*
+ * LockPolicy guards the storage; any Lockable type works, e.g. std::mutex or
+ * CAdaptiveMutex for workloads dominated by short lookups under contention.
+ */
+template<typename IObject, typename LockPolicy = std::mutex>
 class CSomeContainer {
 public:
+    typedef std::function<std::auto_ptr<IObject>()> Factory;
+
     CSomeContainer();
+    explicit CSomeContainer(std::shared_ptr<CWorkerPool> workers);
     ~CSomeContainer();
     void Register(int objectId, std::auto_ptr<IObject> object);
-    IObject* Query(int objectId);
+    std::future<void> RegisterAsync(int objectId, Factory factory);
+    IObject* Query(int objectId, PendingPolicy pending = PendingPolicy::Miss);
     void Unregister(int objectId);
-    CSomeContainerIterator<IObject> Start();
-    CSomeContainerIterator<IObject> End();
+    void Commit(CTransaction<IObject>& transaction);
+    bool RegisterIfAbsent(int objectId, std::auto_ptr<IObject>& object);
+    bool ReplaceIfVersion(int objectId, uint64_t expectedVersion, std::auto_ptr<IObject>& object);
+    IObject* QueryVersioned(int objectId, uint64_t& version);
+    CSomeContainerIterator<IObject, LockPolicy> Start();
+    CSomeContainerIterator<IObject, LockPolicy> End();
+    void Clear(TeardownMode mode = TeardownMode::Inline);
+    void SetWorkerPool(std::shared_ptr<CWorkerPool> workers);
+    void SetTeardown(TeardownMode destructorMode, size_t maxConcurrentDestructors);
+    void SetWriteMode(WriteMode mode);
+    void EnableStats();
+    ContainerStats Stats() const;
+    void EnableWatchdog(std::chrono::nanoseconds threshold, size_t capacity = 256);
+    std::vector<WatchdogEvent> WatchdogEvents() const;
+    void StartRecording(const std::string& path);
+    uint64_t StopRecording();
+    void EnableAllocationTracking();
+    AllocationStats Allocations() const;
+    ContainerMemoryUsage MemoryUsage() const;
+    void EnableTracing(size_t spansPerThread = 65536);
+    void WriteTrace(std::ostream& out) const;
+    size_t SaveSnapshot(const std::string& path, size_t entriesPerBlock = 4096);
+    size_t LoadSnapshot(const std::string& path);
+    std::future<ForkSnapshotStats> SaveSnapshotForked(const std::string& path, size_t entriesPerBlock = 4096);
+    size_t SaveFrozenImage(const std::string& path, size_t entriesPerLock = 4096);
+    void EnableWriteAheadLog(const std::string& path, const WriteAheadLogOptions& options = WriteAheadLogOptions());
+    void SyncLog();
+    size_t CheckpointLog();
+    size_t RecoverFromLog(const std::string& path);
+    void EnableChangeFeed(size_t capacity = 65536);
+    CChangeSubscription Subscribe();
+    void EnableVersionTracking();
+    uint64_t Version() const;
+    CChangedSinceIterator<IObject, LockPolicy> ChangedSince(uint64_t version);
+    CChangedSinceIterator<IObject, LockPolicy> ChangedEnd();
+    bool NeedsRescan(uint64_t version) const;
+    size_t DropTombstones(uint64_t upToVersion);
+private:
+    friend class CSomeContainerIterator<IObject, LockPolicy>;
+    friend class CChangedSinceIterator<IObject, LockPolicy>;
+
+    // Owns the lock for one operation and feeds the instrumentation that is switched on
+    class CCriticalSection {
+    public:
+        CCriticalSection(CSomeContainer& container, ContainerOperation operation, int objectId);
+        ~CCriticalSection();
+        // Waits on condition until ready; the time without the lock counts as neither hold nor wait
+        template<typename Predicate>
+        void Wait(std::condition_variable_any& condition, Predicate ready) {
+            if (ready()) {
+                return;
+            }
+            Leave();
+            m_lock.lock();
+            condition.wait(m_lock, ready);
+            Resume();
+        }
+    private:
+        CCriticalSection(const CCriticalSection&);
+        CCriticalSection& operator=(const CCriticalSection&);
+        void Leave();
+        void Resume();
+    private:
+        std::unique_lock<LockPolicy> m_lock;
+        ContainerOperation m_operation;
+        int m_objectId;
+        CContainerStatsRecorder* m_stats;
+        CLockWatchdog* m_watchdog;
+        CSpanTracer* m_tracer;
+        uint64_t m_acquired;      // nanoseconds, for the stats
+        uint64_t m_traceRequested; // span timestamps, for the tracer
+        uint64_t m_traceAcquired;
+    };
+
+    enum { CombiningSlotCount = 64 };
+    enum { LoadEntriesPerLock = 4096 }; // a LoadSnapshot into a non-empty container merges this many per critical section
+    enum SlotState { SlotFree, SlotClaimed, SlotPending, SlotDone };
+    struct CombiningSlot {
+        CombiningSlot() : state(SlotFree), objectId(0), object(nullptr), displaced(nullptr), unregister(false) {}
+        std::atomic<int> state;
+        int objectId;
+        IObject* object;
+        IObject* displaced;
+        bool unregister;
+        char padding[64 - sizeof(std::atomic<int>) - sizeof(int) - 2 * sizeof(IObject*) - sizeof(bool)]; // one slot per cache line
+    };
 private:
+    std::shared_ptr<CWorkerPool> ImplWorkers();
+    void ImplRecord(ContainerOperation operation, int objectId);
+    CAllocationTracker* ImplAllocations() const;
+    static std::string& ImplLogBody();
+    void ImplEndScan(typename KeyValueStore<int, IObject*>::iterator position, uint64_t scanBegin);
+    bool ImplEncodeBlock(bool first, int& lastId, size_t limit, std::string& block, uint32_t& count,
+                         std::vector<std::pair<int, size_t> >* positions, CWriteAheadLog* log = nullptr, uint64_t* sequence = nullptr);
+    IObject* ImplDereference(int objectId);
+    void ImplRegister(int objectId, IObject* object);
     void ImplUnregister(int objectId);
+    void ImplFinishPending(int objectId);
+    void ImplChanged(ChangeOp op, int objectId);
+    void ImplMerged(typename KeyValueStore<int, IObject*>::iterator first, typename KeyValueStore<int, IObject*>::iterator last);
+    bool ImplConditionalRegister(int objectId, std::auto_ptr<IObject>& object, const uint64_t* expectedVersion);
+    bool ImplNextChange(uint64_t until, VersionedChange& change, IObject*& object);
+    CVersionIndex& ImplVersionIndex() const;
+    void ImplDestroy(KeyValueStore<int, IObject*>& detached, TeardownMode mode, size_t maxConcurrentDestructors);
+    static void ImplDestroyRange(typename KeyValueStore<int, IObject*>::iterator begin,
+                                 typename KeyValueStore<int, IObject*>::iterator end, CSpanTracer* tracer);
+    bool ImplCombine(int objectId, IObject* object, bool unregister);
+    void ImplApplyPublished();
 private:
+    std::shared_ptr<AllocationHook> m_allocationHook; // tracker created once by EnableAllocationTracking
     KeyValueStore<int, IObject*> m_storage;
-    std::mutex m_mutex;
+    mutable LockPolicy m_mutex;
+    std::condition_variable_any m_published;
+    std::map<int, unsigned> m_pending;
+    std::shared_ptr<CWorkerPool> m_workers;
+    TeardownMode m_teardownMode;
+    size_t m_maxConcurrentDestructors;
+    std::atomic<int> m_writeMode;
+    CombiningSlot m_slots[CombiningSlotCount];
+    std::atomic<CContainerStatsRecorder*> m_stats; // created once by EnableStats, owned by the container
+    std::atomic<CLockWatchdog*> m_watchdog;        // created once by EnableWatchdog, owned by the container
+    std::atomic<COperationRecorder*> m_recorder;
+    std::atomic<CSpanTracer*> m_tracer;           // created once by EnableTracing
+    std::shared_ptr<CSpanTracer> m_tracerOwner;   // shared with teardowns that may outlive the container
+    std::atomic<CWriteAheadLog*> m_log;           // created once by EnableWriteAheadLog
+    // set along with m_log, so types without an ObjectSerializer compile as long as they are not logged
+    void (*m_logEncode)(int, const IObject*, std::string&);
+    std::string m_recoveredLog; // path of the log RecoverFromLog restored, its records already hold the entries
+    // one recorder, restarted by every later StartRecording: a thread may still be inside Record of a stopped one
+    std::unique_ptr<COperationRecorder> m_recorderOwner;
+    std::mutex m_recordingMutex; // StartRecording and StopRecording, they write files and join its flusher
+    uint64_t m_version; // changes so far, guarded by m_mutex
+    std::atomic<CChangeFeed*> m_changeFeed;          // created once by EnableChangeFeed
+    std::shared_ptr<CChangeFeed> m_changeFeedOwner; // shared with the subscriptions
+    std::atomic<CVersionIndex*> m_versionIndex;      // created once by EnableVersionTracking
 };
 
-template<typename IObject>
-CSomeContainer<IObject>::CSomeContainer()
+template<typename IObject, typename LockPolicy>
+CSomeContainer<IObject, LockPolicy>::CSomeContainer()
+    : m_allocationHook(std::make_shared<AllocationHook>())
+    , m_storage(std::less<int>(), CTrackingAllocator<std::pair<const int, IObject*> >(m_allocationHook))
+    , m_teardownMode(TeardownMode::Inline)
+    , m_maxConcurrentDestructors(std::max<size_t>(std::thread::hardware_concurrency(), 1))
+    , m_writeMode(static_cast<int>(WriteMode::Locking))
+    , m_stats(nullptr)
+    , m_watchdog(nullptr)
+    , m_recorder(nullptr)
+    , m_tracer(nullptr)
+    , m_log(nullptr)
+    , m_logEncode(nullptr)
+    , m_version(0)
+    , m_changeFeed(nullptr)
+    , m_versionIndex(nullptr)
+{
+}
+
+template<typename IObject, typename LockPolicy>
+CSomeContainer<IObject, LockPolicy>::CSomeContainer(std::shared_ptr<CWorkerPool> workers)
+    : m_allocationHook(std::make_shared<AllocationHook>())
+    , m_storage(std::less<int>(), CTrackingAllocator<std::pair<const int, IObject*> >(m_allocationHook))
+    , m_workers(workers)
+    , m_teardownMode(TeardownMode::Inline)
+    , m_maxConcurrentDestructors(std::max<size_t>(std::thread::hardware_concurrency(), 1))
+    , m_writeMode(static_cast<int>(WriteMode::Locking))
+    , m_stats(nullptr)
+    , m_watchdog(nullptr)
+    , m_recorder(nullptr)
+    , m_tracer(nullptr)
+    , m_log(nullptr)
+    , m_logEncode(nullptr)
+    , m_version(0)
+    , m_changeFeed(nullptr)
+    , m_versionIndex(nullptr)
+{
+}
+
+template<typename IObject, typename LockPolicy>
+CSomeContainer<IObject, LockPolicy>::~CSomeContainer()
+{
+    {
+        // factories still running hold a pointer to this container
+        std::unique_lock<LockPolicy> lock(m_mutex);
+        m_published.wait(lock, [this]() { return m_pending.empty(); });
+    }
+    ImplDestroy(m_storage, m_teardownMode, m_maxConcurrentDestructors);
+    delete m_stats.load();
+    delete m_watchdog.load();
+    delete m_log.load();
+    delete m_versionIndex.load();
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::Register(int objectId, std::auto_ptr<IObject> object)
+{
+    ImplRecord(ContainerOperation::Register, objectId);
+    CAllocationScope allocations(ImplAllocations(), ContainerOperation::Register);
+    // a combiner cannot sequence other threads' writes for the log, logged writes take the lock
+    CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+    if (log == nullptr && ImplCombine(objectId, object.get(), false)) {
+        object.release();
+        return;
+    }
+    if (log != nullptr) {
+        m_logEncode(objectId, object.get(), ImplLogBody());
+    }
+    uint64_t sequence = 0;
+    {
+        CCriticalSection section(*this, ContainerOperation::Register, objectId);
+        ImplRegister(objectId, object.release());
+        sequence = log != nullptr ? log->Sequence() : 0;
+    }
+    if (log != nullptr) {
+        log->Append(sequence, LogRecordKind::Put, objectId, ImplLogBody());
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+std::future<void> CSomeContainer<IObject, LockPolicy>::RegisterAsync(int objectId, Factory factory)
+{
+    std::shared_ptr<CWorkerPool> workers;
+    {
+        std::unique_lock<LockPolicy> lock(m_mutex);
+        ++m_pending[objectId];
+        workers = ImplWorkers();
+    }
+    return workers->Async(std::function<void()>([this, objectId, factory]() {
+        try {
+            std::auto_ptr<IObject> object;
+            CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+            {
+                CSpanScope span(m_tracer.load(std::memory_order_acquire), SpanKind::Construct, objectId);
+                object = factory();
+                if (log != nullptr) {
+                    m_logEncode(objectId, object.get(), ImplLogBody());
+                }
+            }
+            ImplRecord(ContainerOperation::Register, objectId);
+            CAllocationScope allocations(ImplAllocations(), ContainerOperation::Register);
+            uint64_t sequence = 0;
+            {
+                CCriticalSection section(*this, ContainerOperation::Register, objectId);
+                ImplRegister(objectId, object.release());
+                sequence = log != nullptr ? log->Sequence() : 0;
+            }
+            if (log != nullptr) {
+                log->Append(sequence, LogRecordKind::Put, objectId, ImplLogBody());
+            }
+        } catch (...) {
+            std::unique_lock<LockPolicy> lock(m_mutex);
+            ImplFinishPending(objectId);
+            throw;
+        }
+        // only now, the destructor waits for this and then frees the stats, tracer and log used above
+        std::unique_lock<LockPolicy> lock(m_mutex);
+        ImplFinishPending(objectId);
+    }));
+}
+
+template<typename IObject, typename LockPolicy>
+IObject* CSomeContainer<IObject, LockPolicy>::Query(int objectId, PendingPolicy pending)
 {
+    ImplRecord(ContainerOperation::Query, objectId);
+    CAllocationScope allocations(ImplAllocations(), ContainerOperation::Query);
+    CCriticalSection section(*this, ContainerOperation::Query, objectId);
+    if (pending == PendingPolicy::Wait) {
+        section.Wait(m_published, [this, objectId]() { return m_pending.count(objectId) == 0; });
+    }
+    return m_storage.at(objectId);
 }
 
-template<typename IObject>
-CSomeContainer<IObject>::~CSomeContainer()
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::Unregister(int objectId)
 {
-    try
+    ImplRecord(ContainerOperation::Unregister, objectId);
+    CAllocationScope allocations(ImplAllocations(), ContainerOperation::Unregister);
+    CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+    if (log == nullptr && ImplCombine(objectId, nullptr, true)) {
+        return;
+    }
+    uint64_t sequence = 0;
     {
-        for (auto it = m_storage.begin(); it != m_storage.end(); ++it)
+        CCriticalSection section(*this, ContainerOperation::Unregister, objectId);
+        ImplUnregister(objectId);
+        sequence = log != nullptr ? log->Sequence() : 0;
+    }
+    if (log != nullptr) {
+        LogEncodeRemove(objectId, ImplLogBody());
+        log->Append(sequence, LogRecordKind::Remove, objectId, ImplLogBody());
+    }
+}
+
+/*
+ * Applies the staged operations in one critical section; the objects they
+ * displace are destroyed after it. With the write-ahead log on, the
+ * transaction is one record, so recovery applies all of it or none.
+ */
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::Commit(CTransaction<IObject>& transaction)
+{
+    if (transaction.Empty()) {
+        return;
+    }
+    CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+    std::string body;
+    if (log != nullptr) {
+        std::vector<std::pair<LogRecordKind, std::string> > logged;
+        for (auto it = transaction.Operations().begin(); it != transaction.Operations().end(); ++it) {
+            logged.push_back(std::make_pair(it->unregister ? LogRecordKind::Remove : LogRecordKind::Put, std::string()));
+            if (it->unregister) {
+                LogEncodeRemove(it->objectId, logged.back().second);
+            } else {
+                m_logEncode(it->objectId, it->object, logged.back().second);
+            }
+        }
+        LogEncodeTransaction(logged, body);
+    }
+    std::vector<typename CTransaction<IObject>::Operation> operations;
+    transaction.Release(operations);
+    for (auto it = operations.begin(); it != operations.end(); ++it) {
+        ImplRecord(it->unregister ? ContainerOperation::Unregister : ContainerOperation::Register, it->objectId);
+    }
+
+    std::vector<std::pair<int, IObject*> > displaced;
+    uint64_t sequence = 0;
+    {
+        CAllocationScope allocations(ImplAllocations(), ContainerOperation::Register);
+        CCriticalSection section(*this, ContainerOperation::Register, operations.front().objectId);
+        for (auto it = operations.begin(); it != operations.end(); ++it) {
+            auto position = m_storage.find(it->objectId);
+            if (it->unregister) {
+                if (position != m_storage.end()) {
+                    displaced.push_back(*position);
+                    m_storage.erase(position);
+                    ImplChanged(ChangeOp::Remove, it->objectId);
+                }
+            } else if (position != m_storage.end()) {
+                displaced.push_back(*position);
+                position->second = it->object;
+                ImplChanged(ChangeOp::Replace, it->objectId);
+            } else {
+                m_storage.insert(std::make_pair(it->objectId, it->object));
+                ImplChanged(ChangeOp::Insert, it->objectId);
+            }
+        }
+        sequence = log != nullptr ? log->Sequence() : 0;
+    }
+    if (log != nullptr) {
+        log->Append(sequence, LogRecordKind::Transaction, operations.front().objectId, body);
+    }
+    CSpanTracer* tracer = m_tracer.load(std::memory_order_acquire);
+    for (auto it = displaced.begin(); it != displaced.end(); ++it) {
+        try {
+            CSpanScope span(it->second != nullptr ? tracer : nullptr, SpanKind::Destroy, it->first);
+            delete it->second;
+        } catch (const std::exception &) {
+            //
+        }
+    }
+}
+
+// Registers object unless the id is present; on failure the caller keeps the object
+template<typename IObject, typename LockPolicy>
+bool CSomeContainer<IObject, LockPolicy>::RegisterIfAbsent(int objectId, std::auto_ptr<IObject>& object)
+{
+    return ImplConditionalRegister(objectId, object, nullptr);
+}
+
+/*
+ * Replaces the object of a present id whose version, as QueryVersioned or
+ * the delta iterator reported it, is still expectedVersion; the replaced
+ * object is destroyed after unlocking. On failure the caller keeps the object
+ * and can query again. Throws std::logic_error without version tracking.
+ */
+template<typename IObject, typename LockPolicy>
+bool CSomeContainer<IObject, LockPolicy>::ReplaceIfVersion(int objectId, uint64_t expectedVersion, std::auto_ptr<IObject>& object)
+{
+    return ImplConditionalRegister(objectId, object, &expectedVersion);
+}
+
+// Query that also returns the id's version, for ReplaceIfVersion; throws std::logic_error without version tracking
+template<typename IObject, typename LockPolicy>
+IObject* CSomeContainer<IObject, LockPolicy>::QueryVersioned(int objectId, uint64_t& version)
+{
+    ImplRecord(ContainerOperation::Query, objectId);
+    CAllocationScope allocations(ImplAllocations(), ContainerOperation::Query);
+    CCriticalSection section(*this, ContainerOperation::Query, objectId);
+    IObject* object = m_storage.at(objectId);
+    version = ImplVersionIndex().VersionOf(objectId);
+    return object;
+}
+
+template<typename IObject, typename LockPolicy>
+CSomeContainerIterator<IObject, LockPolicy> CSomeContainer<IObject, LockPolicy>::Start()
+{
+    uint64_t scanBegin = m_tracer.load(std::memory_order_acquire) != nullptr ? SpanTimestamp() : 0;
+    return CSomeContainerIterator<IObject, LockPolicy>(this, m_storage.begin(), scanBegin);
+}
+
+template<typename IObject, typename LockPolicy>
+CSomeContainerIterator<IObject, LockPolicy> CSomeContainer<IObject, LockPolicy>::End()
+{
+    return CSomeContainerIterator<IObject, LockPolicy>(this, m_storage.end());
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::Clear(TeardownMode mode)
+{
+    KeyValueStore<int, IObject*> detached(m_storage.get_allocator()); // keeps reporting to the same tracker
+    size_t maxConcurrentDestructors = 0;
+    CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+    uint64_t sequence = 0;
+    {
+        std::unique_lock<LockPolicy> lock(m_mutex);
+        m_storage.swap(detached);
+        ImplChanged(ChangeOp::Clear, 0);
+        maxConcurrentDestructors = m_maxConcurrentDestructors;
+        sequence = log != nullptr ? log->Sequence() : 0;
+    }
+    if (log != nullptr) {
+        log->Append(sequence, LogRecordKind::Clear, 0, std::string());
+    }
+    ImplDestroy(detached, mode, maxConcurrentDestructors);
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::SetWorkerPool(std::shared_ptr<CWorkerPool> workers)
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    // the previous pool is released after unlocking, its destructor drains tasks that need the lock
+    m_workers.swap(workers);
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::SetTeardown(TeardownMode destructorMode, size_t maxConcurrentDestructors)
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    m_teardownMode = destructorMode;
+    m_maxConcurrentDestructors = std::max<size_t>(maxConcurrentDestructors, 1);
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::SetWriteMode(WriteMode mode)
+{
+    m_writeMode.store(static_cast<int>(mode));
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::EnableStats()
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    if (m_stats.load() == nullptr) {
+        m_stats.store(new CContainerStatsRecorder, std::memory_order_release);
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+ContainerStats CSomeContainer<IObject, LockPolicy>::Stats() const
+{
+    CContainerStatsRecorder* stats = m_stats.load(std::memory_order_acquire);
+    return stats != nullptr ? stats->Snapshot() : ContainerStats();
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::EnableWatchdog(std::chrono::nanoseconds threshold, size_t capacity)
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    if (m_watchdog.load() == nullptr) {
+        m_watchdog.store(new CLockWatchdog(threshold, capacity), std::memory_order_release);
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+std::vector<WatchdogEvent> CSomeContainer<IObject, LockPolicy>::WatchdogEvents() const
+{
+    CLockWatchdog* watchdog = m_watchdog.load(std::memory_order_acquire);
+    return watchdog != nullptr ? watchdog->Events() : std::vector<WatchdogEvent>();
+}
+
+// Records every later operation to path, ending a recording still running
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::StartRecording(const std::string& path)
+{
+    std::unique_lock<std::mutex> lock(m_recordingMutex);
+    COperationRecorder* previous = m_recorder.exchange(nullptr);
+    if (previous != nullptr) {
+        previous->Stop();
+    }
+    if (m_recorderOwner) {
+        m_recorderOwner->Restart(path);
+    } else {
+        m_recorderOwner.reset(new COperationRecorder(path));
+    }
+    m_recorder.store(m_recorderOwner.get(), std::memory_order_release);
+}
+
+// Returns how many operations were dropped because a thread's buffer was full
+template<typename IObject, typename LockPolicy>
+uint64_t CSomeContainer<IObject, LockPolicy>::StopRecording()
+{
+    std::unique_lock<std::mutex> lock(m_recordingMutex);
+    COperationRecorder* recorder = m_recorder.exchange(nullptr);
+    if (recorder == nullptr) {
+        return 0;
+    }
+    recorder->Stop();
+    return recorder->Dropped();
+}
+
+/*
+ * Counts the container's own allocations (the map nodes) per operation from
+ * now on; LiveBytes covers the entries registered after this call, so enable
+ * it on an empty container to get the footprint per entry.
+ */
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::EnableAllocationTracking()
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    if (m_allocationHook->tracker.load() == nullptr) {
+        m_allocationHook->tracker.store(new CAllocationTracker, std::memory_order_release);
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+AllocationStats CSomeContainer<IObject, LockPolicy>::Allocations() const
+{
+    CAllocationTracker* tracker = ImplAllocations();
+    AllocationStats stats = tracker != nullptr ? tracker->Snapshot() : AllocationStats();
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    stats.entries = m_storage.size();
+    return stats;
+}
+
+// Walks every entry under the lock when the payload size is known, expect a long hold on large containers
+template<typename IObject, typename LockPolicy>
+ContainerMemoryUsage CSomeContainer<IObject, LockPolicy>::MemoryUsage() const
+{
+    ContainerMemoryUsage usage;
+    usage.payloadKnown = ObjectMemorySize<IObject>::Known;
+    {
+        std::unique_lock<LockPolicy> lock(m_mutex);
+        usage.entries = m_storage.size();
+        if (usage.payloadKnown) {
+            for (auto it = m_storage.begin(); it != m_storage.end(); ++it) {
+                usage.payloadBytes += it->second != nullptr ? ObjectMemorySize<IObject>::Of(*it->second) : 0;
+            }
+        }
+    }
+    usage.nodeBytes = m_allocationHook->nodeBytes.load(std::memory_order_relaxed);
+    usage.storageBytes = sizeof(*this) + usage.entries * usage.nodeBytes;
+    usage.allocatedBytes = sizeof(*this) + usage.entries * AllocatorChunkBytes(usage.nodeBytes);
+    usage.heapFragmentation = HeapFragmentation();
+    return usage;
+}
+
+/*
+ * Records spans of critical sections, RegisterAsync constructions, object
+ * destructions and iterator scans (Start() until the iterator reaches End(),
+ * abandoned scans are not recorded) into per-thread rings.
+ */
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::EnableTracing(size_t spansPerThread)
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    if (m_tracer.load() == nullptr) {
+        std::shared_ptr<CSpanTracer> tracer = std::make_shared<CSpanTracer>(spansPerThread);
+        std::atomic_store(&m_tracerOwner, tracer);
+        m_tracer.store(tracer.get(), std::memory_order_release);
+    }
+}
+
+// Chrome trace-event JSON of the spans still in the rings, for Perfetto or chrome://tracing
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::WriteTrace(std::ostream& out) const
+{
+    std::shared_ptr<CSpanTracer> tracer = std::atomic_load(&m_tracerOwner);
+    if (tracer) {
+        tracer->WriteChromeTrace(out);
+    } else {
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[]}\n";
+    }
+}
+
+/*
+ * Writes the entries to path (through a temporary file renamed at the end)
+ * using ObjectSerializer<IObject>. The lock is taken once per block, so
+ * writers wait for one block at a time; the snapshot is consistent per block,
+ * not as a whole. Returns the number of entries written.
+ */
+template<typename IObject, typename LockPolicy>
+size_t CSomeContainer<IObject, LockPolicy>::SaveSnapshot(const std::string& path, size_t entriesPerBlock)
+{
+    const std::string temporary = path + ".tmp";
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(temporary.c_str(), "wb"), std::fclose);
+    if (!file) {
+        throw std::runtime_error("cannot create snapshot " + temporary);
+    }
+    size_t saved = 0;
+    try {
+        auto write = [&file, &temporary](const void* data, size_t size) {
+            if (size != 0 && std::fwrite(data, size, 1, file.get()) != 1) {
+                throw std::runtime_error("cannot write snapshot " + temporary);
+            }
+        };
+        SnapshotFileHeader header;
+        std::memcpy(header.magic, "SCSNAP01", sizeof(header.magic));
+        header.version = 1;
+        header.reserved = 0;
+        write(&header, sizeof(header));
+
+        std::vector<SnapshotBlockIndex> index;
+        uint64_t offset = sizeof(header);
+        std::string block;
+        int lastId = 0;
+        for (bool done = false; !done; ) {
+            uint32_t count = 0;
+            SnapshotBlockIndex entry = SnapshotBlockIndex();
+            block.assign(sizeof(count), '\0');
+            done = ImplEncodeBlock(index.empty(), lastId, entriesPerBlock, block, count, nullptr);
+            if (count == 0) {
+                break;
+            }
+            std::memcpy(&block[0], &count, sizeof(count));
+            std::memcpy(&entry.firstId, block.data() + sizeof(count), sizeof(entry.firstId));
+            write(block.data(), block.size());
+            entry.offset = offset;
+            entry.size = block.size();
+            entry.checksum = SnapshotChecksum(block.data(), block.size());
+            entry.entries = count;
+            index.push_back(entry);
+            offset += block.size();
+            saved += count;
+        }
+
+        SnapshotFooter footer;
+        footer.indexOffset = offset;
+        footer.blockCount = index.size();
+        std::memcpy(footer.magic, "SCSNAPIX", sizeof(footer.magic));
+        write(index.data(), index.size() * sizeof(SnapshotBlockIndex));
+        write(&footer, sizeof(footer));
+        if (std::fclose(file.release()) != 0) {
+            throw std::runtime_error("cannot write snapshot " + temporary);
+        }
+        SnapshotReplaceFile(temporary, path);
+    } catch (...) {
+        file.reset();
+        std::remove(temporary.c_str());
+        throw;
+    }
+    return saved;
+}
+
+/*
+ * Writes the entries as a frozen image for CFrozenContainer, holding the lock
+ * for entriesPerLock entries at a time like SaveSnapshot. Returns the number
+ * of entries written.
+ */
+template<typename IObject, typename LockPolicy>
+size_t CSomeContainer<IObject, LockPolicy>::SaveFrozenImage(const std::string& path, size_t entriesPerLock)
+{
+    const std::string temporary = path + ".tmp";
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(temporary.c_str(), "wb"), std::fclose);
+    if (!file) {
+        throw std::runtime_error("cannot create frozen image " + temporary);
+    }
+    std::vector<FrozenIndexEntry> index;
+    try {
+        auto write = [&file, &temporary](const void* data, size_t size) {
+            if (size != 0 && std::fwrite(data, size, 1, file.get()) != 1) {
+                throw std::runtime_error("cannot write frozen image " + temporary);
+            }
+        };
+        FrozenImageHeader header = FrozenImageHeader();
+        write(&header, sizeof(header)); // filled in once the sizes are known
+
+        std::vector<std::pair<int, size_t> > positions;
+        std::string block;
+        uint64_t payloadSize = 0;
+        int lastId = 0;
+        for (bool done = false; !done; ) {
+            uint32_t count = 0;
+            block.clear();
+            positions.clear();
+            done = ImplEncodeBlock(index.empty(), lastId, entriesPerLock, block, count, &positions);
+            for (auto it = positions.begin(); it != positions.end(); ++it) {
+                FrozenIndexEntry entry = { it->first, 0, payloadSize + it->second };
+                index.push_back(entry);
+            }
+            write(block.data(), block.size());
+            payloadSize += block.size();
+        }
+
+        const char padding[sizeof(uint64_t)] = {};
+        size_t paddingSize = (sizeof(uint64_t) - (sizeof(header) + payloadSize) % sizeof(uint64_t)) % sizeof(uint64_t);
+        write(padding, paddingSize);
+        write(index.data(), index.size() * sizeof(FrozenIndexEntry));
+
+        std::memcpy(header.magic, "SCFROZN1", sizeof(header.magic));
+        header.version = 1;
+        header.entryCount = index.size();
+        header.payloadOffset = sizeof(header);
+        header.payloadSize = payloadSize;
+        header.indexOffset = sizeof(header) + payloadSize + paddingSize;
+        if (std::fseek(file.get(), 0, SEEK_SET) != 0) {
+            throw std::runtime_error("cannot write frozen image " + temporary);
+        }
+        write(&header, sizeof(header));
+        if (std::fclose(file.release()) != 0) {
+            throw std::runtime_error("cannot write frozen image " + temporary);
+        }
+        SnapshotReplaceFile(temporary, path);
+    } catch (...) {
+        file.reset();
+        std::remove(temporary.c_str());
+        throw;
+    }
+    return index.size();
+}
+
+/*
+ * SaveSnapshot of the state at the call from a fork()ed child (Linux). The
+ * lock is held only across fork(), the child writes its copy-on-write view
+ * of the storage while writers carry on, and the future reports the pause
+ * and the pages copied meanwhile. The objects are serialized in the child,
+ * so ObjectSerializer must not rely on other threads of the process.
+ */
+template<typename IObject, typename LockPolicy>
+std::future<ForkSnapshotStats> CSomeContainer<IObject, LockPolicy>::SaveSnapshotForked(const std::string& path, size_t entriesPerBlock)
+{
+    uint64_t requested = MonotonicNanoseconds();
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    uint64_t acquired = MonotonicNanoseconds();
+    // the child is the only thread left and owns the lock as well, it unlocks before saving
+    return ForkSnapshot(acquired - requested, acquired, [&lock]() { lock.unlock(); },
+                        [this, &path, entriesPerBlock]() { return SaveSnapshot(path, entriesPerBlock); });
+}
+
+/*
+ * Adds the entries of a snapshot, replacing objects with the same id. The
+ * calling thread reads the blocks, the worker pool verifies and decodes them;
+ * the sorted ids then build the storage with constant-time insertions, and an
+ * empty container takes it over in one swap. A non-empty one merges them
+ * LoadEntriesPerLock at a time, each chunk its own Reload change, so writers
+ * are held up for one chunk, not the whole snapshot, and meanwhile may see
+ * part of it merged. Throws
+ * std::runtime_error on a missing or damaged file, leaving the container
+ * unchanged.
+ */
+template<typename IObject, typename LockPolicy>
+size_t CSomeContainer<IObject, LockPolicy>::LoadSnapshot(const std::string& path)
+{
+    typedef std::vector<std::pair<int, IObject*> > Entries;
+    std::vector<std::future<Entries> > decoding;
+    std::exception_ptr failure;
+    CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+    std::vector<std::shared_ptr<std::string> > logged; // the blocks are log records as they are
+    try {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "rb"), std::fclose);
+        if (!file) {
+            throw std::runtime_error("cannot open snapshot " + path);
+        }
+        std::vector<SnapshotBlockIndex> index = SnapshotReadIndex(file.get(), path, nullptr);
+
+        std::shared_ptr<CWorkerPool> workers;
         {
-            if (it->second != nullptr) {
+            std::unique_lock<LockPolicy> lock(m_mutex);
+            workers = ImplWorkers();
+        }
+        for (auto it = index.begin(); it != index.end(); ++it) {
+            std::shared_ptr<std::string> block = std::make_shared<std::string>();
+            SnapshotReadBlock(file.get(), path, *it, *block);
+            if (log != nullptr) {
+                logged.push_back(block);
+            }
+            uint64_t checksum = it->checksum;
+            decoding.push_back(workers->Async(std::function<Entries()>([block, checksum]() {
+                if (SnapshotChecksum(block->data(), block->size()) != checksum) {
+                    throw std::runtime_error("snapshot block is damaged");
+                }
+                return SnapshotDecodeBlock<IObject>(*block);
+            })));
+        }
+    } catch (...) {
+        failure = std::current_exception();
+    }
+
+    std::vector<Entries> blocks;
+    for (auto it = decoding.begin(); it != decoding.end(); ++it) {
+        try {
+            blocks.push_back(it->get());
+        } catch (...) {
+            failure = failure ? failure : std::current_exception();
+        }
+    }
+    if (failure) {
+        for (auto block = blocks.begin(); block != blocks.end(); ++block) {
+            for (auto it = block->begin(); it != block->end(); ++it) {
                 delete it->second;
             }
         }
-    } catch (const std::exception &) {
-        //
+        std::rethrow_exception(failure);
     }
+
+    // ids arrive in ascending order, so the end is always the right hint
+    KeyValueStore<int, IObject*> loaded(m_storage.get_allocator());
+    std::vector<IObject*> displaced;
+    for (auto block = blocks.begin(); block != blocks.end(); ++block) {
+        for (auto it = block->begin(); it != block->end(); ++it) {
+            auto position = loaded.insert(loaded.end(), *it);
+            if (position->second != it->second) {
+                displaced.push_back(position->second);
+                position->second = it->second;
+            }
+        }
+    }
+    size_t count = loaded.size();
+    bool merged = false;
+    uint64_t sequence = 0;
+    {
+        CCriticalSection section(*this, ContainerOperation::Register, 0);
+        if (m_storage.empty()) {
+            sequence = !logged.empty() ? log->Sequence(logged.size()) : 0;
+            m_storage.swap(loaded);
+            ImplChanged(ChangeOp::Reload, 0);
+            merged = true;
+        }
+    }
+    if (merged) {
+        for (size_t i = 0; i < logged.size(); ++i) {
+            log->Append(sequence + i, LogRecordKind::Put, 0, *logged[i]);
+        }
+    }
+
+    // every chunk is logged with the sequence it took under its lock, a write to one of its ids lands before or after it
+    std::string body;
+    for (auto chunk = loaded.begin(); chunk != loaded.end(); ) {
+        auto chunkEnd = chunk;
+        uint32_t chunkSize = 0;
+        body.assign(sizeof(chunkSize), '\0');
+        for (; chunkEnd != loaded.end() && chunkSize < LoadEntriesPerLock; ++chunkEnd, ++chunkSize) {
+            if (log != nullptr) {
+                SnapshotEncodeEntry<IObject>(chunkEnd->first, chunkEnd->second, body);
+            }
+        }
+        std::memcpy(&body[0], &chunkSize, sizeof(chunkSize));
+        {
+            CCriticalSection section(*this, ContainerOperation::Register, chunk->first);
+            ImplMerged(chunk, chunkEnd);
+            auto hint = m_storage.lower_bound(chunk->first);
+            for (; chunk != chunkEnd; ++chunk) {
+                hint = m_storage.insert(hint, *chunk);
+                if (hint->second != chunk->second) {
+                    displaced.push_back(hint->second);
+                    hint->second = chunk->second;
+                }
+                ++hint;
+            }
+            sequence = log != nullptr ? log->Sequence() : 0;
+        }
+        if (log != nullptr) {
+            log->Append(sequence, LogRecordKind::Put, 0, body);
+        }
+    }
+    for (auto it = displaced.begin(); it != displaced.end(); ++it) {
+        try {
+            delete *it;
+        } catch (const std::exception &) {
+            //
+        }
+    }
+    return count;
 }
 
-template<typename IObject>
-void CSomeContainer<IObject>::Register(int objectId, std::auto_ptr<IObject> object)
+/*
+ * Logs every later Register, RegisterAsync, Unregister, Clear and
+ * LoadSnapshot to a write-ahead log at path (a prefix for its files) and
+ * continues the sequence of a log already there. The entries already in the
+ * container are logged first, a block of options.entriesPerBlock entries per
+ * lock, so recovery restores them too, unless RecoverFromLog just restored
+ * them from the same path. Writes that are in flight while the
+ * log is enabled may be missed, enable it before the writers start.
+ * Flat combining is bypassed from then on.
+ */
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::EnableWriteAheadLog(const std::string& path, const WriteAheadLogOptions& options)
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    if (m_storage[objectId] != nullptr) {
-        ImplUnregister(objectId);
+    CWriteAheadLog* log = nullptr;
+    {
+        std::unique_lock<LockPolicy> lock(m_mutex);
+        if (m_log.load() != nullptr) {
+            return;
+        }
+        m_logEncode = &LogEncodePut<IObject>;
+        log = new CWriteAheadLog(path, options);
+        m_log.store(log, std::memory_order_release);
+        if (path == m_recoveredLog) {
+            return;
+        }
+    }
+    // a write to an id before its block is logged takes an earlier sequence, the block then carries its result
+    std::string block;
+    int lastId = 0;
+    for (bool done = false, first = true; !done; first = false) {
+        uint32_t count = 0;
+        uint64_t sequence = 0;
+        block.assign(sizeof(count), '\0');
+        done = ImplEncodeBlock(first, lastId, std::max<size_t>(options.entriesPerBlock, 1), block, count, nullptr, log, &sequence);
+        if (count == 0) {
+            break;
+        }
+        std::memcpy(&block[0], &count, sizeof(count));
+        log->Append(sequence, LogRecordKind::Put, lastId, block);
+    }
+}
+
+// Waits until the writes made so far are on disk
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::SyncLog()
+{
+    CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+    if (log != nullptr) {
+        log->Sync();
+    }
+}
+
+// Folds the committed log into its base image, returns the number of records folded
+template<typename IObject, typename LockPolicy>
+size_t CSomeContainer<IObject, LockPolicy>::CheckpointLog()
+{
+    CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+    return log != nullptr ? log->Checkpoint() : 0;
+}
+
+/*
+ * Loads the base image of the write-ahead log at path, then replays the
+ * records after it. Call before EnableWriteAheadLog, on an empty container;
+ * enabling the same log afterwards, before any write, continues it without
+ * logging the restored entries again. Returns the number of records replayed.
+ */
+template<typename IObject, typename LockPolicy>
+size_t CSomeContainer<IObject, LockPolicy>::RecoverFromLog(const std::string& path)
+{
+    if (m_log.load() != nullptr) {
+        throw std::logic_error("recover before enabling the write-ahead log");
+    }
+    const std::string basePath = CWriteAheadLog::BasePath(path);
+    bool hasBase = std::unique_ptr<std::FILE, int(*)(std::FILE*)>(std::fopen(basePath.c_str(), "rb"), std::fclose) != nullptr;
+    if (hasBase) {
+        LoadSnapshot(basePath);
+    }
+    {
+        std::unique_lock<LockPolicy> lock(m_mutex);
+        m_recoveredLog = path;
+    }
+    return CWriteAheadLog::Replay(path, [this](LogRecordKind kind, const std::string& body) {
+        if (kind == LogRecordKind::Clear) {
+            Clear();
+        } else {
+            std::vector<std::pair<LogRecordKind, std::string> > records;
+            if (kind == LogRecordKind::Transaction) {
+                records = LogDecodeTransaction(body);
+            } else {
+                records.push_back(std::make_pair(kind, body));
+            }
+            // decoded before locking, a transaction then applies in one critical section
+            std::vector<typename CTransaction<IObject>::Operation> operations;
+            try {
+                for (auto it = records.begin(); it != records.end(); ++it) {
+                    if (it->first == LogRecordKind::Remove) {
+                        int32_t id = 0;
+                        std::memcpy(&id, it->second.data(), std::min(sizeof(id), it->second.size()));
+                        typename CTransaction<IObject>::Operation operation = { id, nullptr, true };
+                        operations.push_back(operation);
+                        continue;
+                    }
+                    std::vector<std::pair<int, IObject*> > entries = SnapshotDecodeBlock<IObject>(it->second);
+                    for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
+                        typename CTransaction<IObject>::Operation operation = { entry->first, entry->second, false };
+                        operations.push_back(operation);
+                    }
+                }
+            } catch (...) {
+                for (auto it = operations.begin(); it != operations.end(); ++it) {
+                    delete it->object;
+                }
+                throw;
+            }
+            CCriticalSection section(*this, ContainerOperation::Register, operations.empty() ? 0 : operations.front().objectId);
+            for (auto it = operations.begin(); it != operations.end(); ++it) {
+                if (it->unregister) {
+                    ImplUnregister(it->objectId);
+                } else {
+                    ImplRegister(it->objectId, it->object);
+                }
+            }
+        }
+    });
+}
+
+/*
+ * Publishes every later change to the storage, RegisterAsync and combined
+ * writes included, to a ring of capacity events that subscribers read at
+ * their own pace. Writers never wait for subscribers; one that falls behind
+ * by more than the capacity is told to resync.
+ */
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::EnableChangeFeed(size_t capacity)
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    if (m_changeFeed.load() == nullptr) {
+        std::shared_ptr<CChangeFeed> feed = std::make_shared<CChangeFeed>(capacity);
+        std::atomic_store(&m_changeFeedOwner, feed);
+        m_changeFeed.store(feed.get(), std::memory_order_release);
+    }
+}
+
+// A subscription to the changes from now on; throws std::logic_error when the feed is not enabled
+template<typename IObject, typename LockPolicy>
+CChangeSubscription CSomeContainer<IObject, LockPolicy>::Subscribe()
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    std::shared_ptr<CChangeFeed> feed = std::atomic_load(&m_changeFeedOwner);
+    if (!feed) {
+        throw std::logic_error("the change feed is not enabled");
+    }
+    return CChangeSubscription(feed);
+}
+
+/*
+ * Stamps every later change with the container's version and keeps removed
+ * ids as tombstones, so ChangedSince can walk just the changes after a
+ * version. Entries present now get the current version. Costs a hash map and
+ * a tree node per id, present or removed, until DropTombstones.
+ */
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::EnableVersionTracking()
+{
+    CCriticalSection section(*this, ContainerOperation::Register, 0);
+    if (m_versionIndex.load() == nullptr) {
+        std::unique_ptr<CVersionIndex> index(new CVersionIndex(m_version));
+        for (auto it = m_storage.begin(); it != m_storage.end(); ++it) {
+            index->Stamp(it->first, m_version, false);
+        }
+        m_versionIndex.store(index.release(), std::memory_order_release);
+    }
+}
+
+// Version of the latest change, counted whether or not anything tracks it
+template<typename IObject, typename LockPolicy>
+uint64_t CSomeContainer<IObject, LockPolicy>::Version() const
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    return m_version;
+}
+
+/*
+ * Iterates the ids changed after version, tombstones included, up to the
+ * version of the latest change now; pass the iterator's Until() to the next
+ * call. Check NeedsRescan(version) first, a Clear, a LoadSnapshot into an
+ * empty container or a dropped tombstone after version is not among the
+ * changes; a LoadSnapshot merged into entries already there is.
+ */
+template<typename IObject, typename LockPolicy>
+CChangedSinceIterator<IObject, LockPolicy> CSomeContainer<IObject, LockPolicy>::ChangedSince(uint64_t version)
+{
+    uint64_t until = 0;
+    {
+        std::unique_lock<LockPolicy> lock(m_mutex);
+        ImplVersionIndex();
+        until = m_version;
+    }
+    CChangedSinceIterator<IObject, LockPolicy> iterator(this, until);
+    iterator.m_change.version = version;
+    iterator.m_change.objectId = std::numeric_limits<int>::max(); // past every id of that version
+    return ++iterator;
+}
+
+template<typename IObject, typename LockPolicy>
+CChangedSinceIterator<IObject, LockPolicy> CSomeContainer<IObject, LockPolicy>::ChangedEnd()
+{
+    return CChangedSinceIterator<IObject, LockPolicy>(this, 0);
+}
+
+template<typename IObject, typename LockPolicy>
+bool CSomeContainer<IObject, LockPolicy>::NeedsRescan(uint64_t version) const
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    return ImplVersionIndex().NeedsRescan(version);
+}
+
+// Forgets removed ids changed up to a version; returns how many were dropped
+template<typename IObject, typename LockPolicy>
+size_t CSomeContainer<IObject, LockPolicy>::DropTombstones(uint64_t upToVersion)
+{
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    return ImplVersionIndex().DropTombstones(upToVersion);
+}
+
+/*
+ * Appends up to limit entries with ids above lastId, or from the first one,
+ * to block under the lock; positions, when given, receive each entry's id and
+ * offset in block, and log, when given, hands out the sequence of the block
+ * under the same lock. Returns whether the last entry was reached.
+ */
+template<typename IObject, typename LockPolicy>
+bool CSomeContainer<IObject, LockPolicy>::ImplEncodeBlock(bool first, int& lastId, size_t limit, std::string& block,
+                                                          uint32_t& count, std::vector<std::pair<int, size_t> >* positions,
+                                                          CWriteAheadLog* log, uint64_t* sequence)
+{
+    CCriticalSection section(*this, ContainerOperation::Query, lastId);
+    auto it = first ? m_storage.begin() : m_storage.upper_bound(lastId);
+    for (count = 0; it != m_storage.end() && count < limit; ++it, ++count) {
+        if (positions != nullptr) {
+            positions->push_back(std::make_pair(it->first, block.size()));
+        }
+        SnapshotEncodeEntry<IObject>(it->first, it->second, block);
+        lastId = it->first;
+    }
+    if (log != nullptr && count != 0) {
+        *sequence = log->Sequence();
     }
-    m_storage[objectId] = object.release();
+    return it == m_storage.end();
 }
 
-template<typename IObject>
-IObject* CSomeContainer<IObject>::Query(int objectId)
+template<typename IObject, typename LockPolicy>
+std::string& CSomeContainer<IObject, LockPolicy>::ImplLogBody()
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
+    static thread_local std::string body; // reused, a log record rarely needs an allocation
+    return body;
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplEndScan(typename KeyValueStore<int, IObject*>::iterator position, uint64_t scanBegin)
+{
+    CSpanTracer* tracer = m_tracer.load(std::memory_order_acquire);
+    if (tracer != nullptr && position == m_storage.end()) {
+        tracer->Record(SpanKind::IteratorScan, -1, scanBegin, SpanTimestamp());
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+CAllocationTracker* CSomeContainer<IObject, LockPolicy>::ImplAllocations() const
+{
+    return m_allocationHook->tracker.load(std::memory_order_acquire);
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplRecord(ContainerOperation operation, int objectId)
+{
+    COperationRecorder* recorder = m_recorder.load(std::memory_order_acquire);
+    if (recorder != nullptr) {
+        recorder->Record(operation, objectId);
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+std::shared_ptr<CWorkerPool> CSomeContainer<IObject, LockPolicy>::ImplWorkers()
+{
+    if (!m_workers) {
+        m_workers = std::make_shared<CWorkerPool>();
+    }
+    return m_workers;
+}
+
+template<typename IObject, typename LockPolicy>
+IObject* CSomeContainer<IObject, LockPolicy>::ImplDereference(int objectId)
+{
+    ImplRecord(ContainerOperation::IteratorDereference, objectId);
+    CAllocationScope allocations(ImplAllocations(), ContainerOperation::IteratorDereference);
+    CCriticalSection section(*this, ContainerOperation::IteratorDereference, objectId);
     return m_storage.at(objectId);
 }
 
-template<typename IObject>
-void CSomeContainer<IObject>::Unregister(int objectId)
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplRegister(int objectId, IObject* object)
+{
+    auto position = m_storage.insert(std::make_pair(objectId, static_cast<IObject*>(nullptr)));
+    IObject* displaced = position.first->second;
+    position.first->second = object;
+    ImplChanged(position.second ? ChangeOp::Insert : ChangeOp::Replace, objectId);
+    if (displaced != nullptr) {
+        CSpanScope span(m_tracer.load(std::memory_order_acquire), SpanKind::Destroy, objectId);
+        delete displaced;
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplFinishPending(int objectId)
+{
+    auto it = m_pending.find(objectId);
+    if (--it->second == 0) {
+        m_pending.erase(it);
+        m_published.notify_all();
+    }
+}
+
+// Without expectedVersion registers only an absent id, with it replaces only a present id of that version
+template<typename IObject, typename LockPolicy>
+bool CSomeContainer<IObject, LockPolicy>::ImplConditionalRegister(int objectId, std::auto_ptr<IObject>& object,
+                                                                  const uint64_t* expectedVersion)
+{
+    ImplRecord(ContainerOperation::Register, objectId);
+    CAllocationScope allocations(ImplAllocations(), ContainerOperation::Register);
+    CWriteAheadLog* log = m_log.load(std::memory_order_acquire);
+    if (log != nullptr) {
+        m_logEncode(objectId, object.get(), ImplLogBody());
+    }
+    IObject* displaced = nullptr;
+    uint64_t sequence = 0;
+    {
+        CCriticalSection section(*this, ContainerOperation::Register, objectId);
+        auto position = m_storage.find(objectId);
+        if (expectedVersion == nullptr) {
+            if (position != m_storage.end()) {
+                return false;
+            }
+            m_storage.insert(std::make_pair(objectId, object.get()));
+            ImplChanged(ChangeOp::Insert, objectId);
+        } else {
+            uint64_t version = ImplVersionIndex().VersionOf(objectId);
+            if (position == m_storage.end() || version != *expectedVersion) {
+                return false;
+            }
+            displaced = position->second;
+            position->second = object.get();
+            ImplChanged(ChangeOp::Replace, objectId);
+        }
+        object.release();
+        sequence = log != nullptr ? log->Sequence() : 0;
+    }
+    if (log != nullptr) {
+        log->Append(sequence, LogRecordKind::Put, objectId, ImplLogBody());
+    }
+    try {
+        CSpanScope span(displaced != nullptr ? m_tracer.load(std::memory_order_acquire) : nullptr, SpanKind::Destroy, objectId);
+        delete displaced;
+    } catch (const std::exception &) {
+        //
+    }
+    return true;
+}
+
+// Called under the lock for every change applied to the storage
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplChanged(ChangeOp op, int objectId)
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
-    ImplUnregister(objectId);
+    ++m_version;
+    CChangeFeed* feed = m_changeFeed.load(std::memory_order_relaxed);
+    if (feed != nullptr) {
+        feed->Publish(op, objectId, m_version);
+    }
+    CVersionIndex* index = m_versionIndex.load(std::memory_order_relaxed);
+    if (index != nullptr) {
+        if (op == ChangeOp::Clear || op == ChangeOp::Reload) {
+            // every entry left came with this change, scans since an older version rescan instead
+            index->Reset(m_version);
+        } else {
+            index->Stamp(objectId, m_version, op == ChangeOp::Remove);
+        }
+    }
 }
 
-template<typename IObject>
-CSomeContainerIterator<IObject> CSomeContainer<IObject>::Start()
+// A LoadSnapshot chunk merged into a non-empty container, one change that stamps only the ids it carries
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplMerged(typename KeyValueStore<int, IObject*>::iterator first,
+                                                     typename KeyValueStore<int, IObject*>::iterator last)
 {
-    return CSomeContainerIterator<IObject>(this, m_storage.begin());
+    ++m_version;
+    CChangeFeed* feed = m_changeFeed.load(std::memory_order_relaxed);
+    if (feed != nullptr) {
+        feed->Publish(ChangeOp::Reload, 0, m_version);
+    }
+    CVersionIndex* index = m_versionIndex.load(std::memory_order_relaxed);
+    for (auto it = first; index != nullptr && it != last; ++it) {
+        index->Stamp(it->first, m_version, false);
+    }
 }
 
-template<typename IObject>
-CSomeContainerIterator<IObject> CSomeContainer<IObject>::End()
+template<typename IObject, typename LockPolicy>
+bool CSomeContainer<IObject, LockPolicy>::ImplNextChange(uint64_t until, VersionedChange& change, IObject*& object)
 {
-    return CSomeContainerIterator<IObject>(this, m_storage.end());
+    std::unique_lock<LockPolicy> lock(m_mutex);
+    if (!ImplVersionIndex().Next(change.version, change.objectId, until, change)) {
+        return false;
+    }
+    object = change.removed ? nullptr : m_storage.at(change.objectId);
+    return true;
 }
 
-template<typename IObject>
-void CSomeContainer<IObject>::ImplUnregister(int objectId)
+// Throws std::logic_error when version tracking is not enabled, call under the lock
+template<typename IObject, typename LockPolicy>
+CVersionIndex& CSomeContainer<IObject, LockPolicy>::ImplVersionIndex() const
+{
+    CVersionIndex* index = m_versionIndex.load(std::memory_order_relaxed);
+    if (index == nullptr) {
+        throw std::logic_error("version tracking is not enabled");
+    }
+    return *index;
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplUnregister(int objectId)
 {
     try {
         IObject* objPtr = m_storage.at(objectId);
+        CSpanScope span(m_tracer.load(std::memory_order_acquire), SpanKind::Destroy, objectId);
         delete objPtr;
         m_storage.erase(objectId);
+        ImplChanged(ChangeOp::Remove, objectId);
     } catch (const std::out_of_range&) {
 
     }
 }
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplDestroy(KeyValueStore<int, IObject*>& detached, TeardownMode mode, size_t maxConcurrentDestructors)
+{
+    if (detached.empty()) {
+        return;
+    }
+    std::shared_ptr<CSpanTracer> tracer = std::atomic_load(&m_tracerOwner);
+    if (mode == TeardownMode::Inline) {
+        ImplDestroyRange(detached.begin(), detached.end(), tracer.get());
+        detached.clear();
+        return;
+    }
+
+    // the chunks must not refer to this container, background teardown may outlive it
+    std::shared_ptr<KeyValueStore<int, IObject*> > objects = std::make_shared<KeyValueStore<int, IObject*> >();
+    objects->swap(detached);
+    std::shared_ptr<CWorkerPool> workers = ImplWorkers();
+    size_t chunkCount = std::min(std::min(maxConcurrentDestructors, workers->ThreadCount()), objects->size());
+    size_t chunkSize = (objects->size() + chunkCount - 1) / chunkCount;
+
+    std::vector<std::future<void> > chunks;
+    auto begin = objects->begin();
+    while (begin != objects->end()) {
+        auto end = begin;
+        for (size_t i = 0; i < chunkSize && end != objects->end(); ++i) {
+            ++end;
+        }
+        chunks.push_back(workers->Async(std::function<void()>([objects, begin, end, tracer]() {
+            ImplDestroyRange(begin, end, tracer.get());
+        })));
+        begin = end;
+    }
+    if (mode == TeardownMode::Parallel) {
+        for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+            it->wait();
+        }
+        // a worker may still hold a chunk's reference, free the nodes here so they are gone when Clear returns
+        objects->clear();
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplDestroyRange(typename KeyValueStore<int, IObject*>::iterator begin,
+                                                           typename KeyValueStore<int, IObject*>::iterator end,
+                                                           CSpanTracer* tracer)
+{
+    for (auto it = begin; it != end; ++it) {
+        try {
+            CSpanScope span(tracer, SpanKind::Destroy, it->first);
+            delete it->second;
+        } catch (const std::exception &) {
+            //
+        }
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+bool CSomeContainer<IObject, LockPolicy>::ImplCombine(int objectId, IObject* object, bool unregister)
+{
+    if (m_writeMode.load(std::memory_order_relaxed) != static_cast<int>(WriteMode::FlatCombining)) {
+        return false;
+    }
+
+    size_t first = std::hash<std::thread::id>()(std::this_thread::get_id());
+    CombiningSlot* slot = nullptr;
+    for (size_t i = 0; i < CombiningSlotCount && slot == nullptr; ++i) {
+        CombiningSlot& candidate = m_slots[(first + i) % CombiningSlotCount];
+        int expected = SlotFree;
+        if (candidate.state.compare_exchange_strong(expected, SlotClaimed, std::memory_order_acquire)) {
+            slot = &candidate;
+        }
+    }
+    if (slot == nullptr) {
+        return false; // more concurrent writers than slots, take the lock directly
+    }
+
+    slot->objectId = objectId;
+    slot->object = object;
+    slot->unregister = unregister;
+    slot->displaced = nullptr;
+    CContainerStatsRecorder* stats = m_stats.load(std::memory_order_acquire);
+    CSpanTracer* tracer = m_tracer.load(std::memory_order_acquire);
+    ContainerOperation operation = unregister ? ContainerOperation::Unregister : ContainerOperation::Register;
+    uint64_t published = stats != nullptr ? MonotonicNanoseconds() : 0;
+    uint64_t tracePublished = tracer != nullptr ? SpanTimestamp() : 0;
+    slot->state.store(SlotPending, std::memory_order_release);
+    while (slot->state.load(std::memory_order_acquire) != SlotDone) {
+        if (m_mutex.try_lock()) {
+            uint64_t acquired = stats != nullptr ? MonotonicNanoseconds() : 0;
+            uint64_t traceAcquired = tracer != nullptr ? SpanTimestamp() : 0;
+            CLockWatchdog* watchdog = m_watchdog.load(std::memory_order_acquire);
+            if (watchdog != nullptr) {
+                watchdog->Enter(operation, objectId);
+            }
+            ImplApplyPublished();
+            WatchdogEvent slow;
+            bool reportSlow = watchdog != nullptr && watchdog->Exit(slow);
+            m_mutex.unlock();
+            if (reportSlow) {
+                watchdog->ReportSlow(slow);
+            }
+            if (tracer != nullptr) {
+                tracer->Record(ToSpanKind(operation), objectId, traceAcquired, SpanTimestamp(), tracePublished);
+            }
+            if (stats != nullptr) {
+                stats->RecordHold(operation, MonotonicNanoseconds() - acquired);
+            }
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    if (stats != nullptr) {
+        // for combined writes the wait spans publishing to being applied, by whichever thread combined
+        stats->RecordWait(operation, MonotonicNanoseconds() - published);
+    }
+
+    // the displaced object is destroyed by the thread that displaced it, outside the lock
+    IObject* displaced = slot->displaced;
+    slot->state.store(SlotFree, std::memory_order_release);
+    try {
+        CSpanScope span(displaced != nullptr ? tracer : nullptr, SpanKind::Destroy, objectId);
+        delete displaced;
+    } catch (const std::exception &) {
+        //
+    }
+    return true;
+}
+
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::ImplApplyPublished()
+{
+    CombiningSlot* batch[CombiningSlotCount];
+    size_t batchSize = 0;
+    for (size_t i = 0; i < CombiningSlotCount; ++i) {
+        if (m_slots[i].state.load(std::memory_order_acquire) == SlotPending) {
+            batch[batchSize++] = &m_slots[i];
+        }
+    }
+    std::stable_sort(batch, batch + batchSize, [](const CombiningSlot* left, const CombiningSlot* right) {
+        return left->objectId < right->objectId;
+    });
+
+    // ascending ids let every insertion use the position after the previous one as its hint
+    auto hint = m_storage.begin();
+    for (size_t i = 0; i < batchSize; ++i) {
+        CombiningSlot& slot = *batch[i];
+        if (slot.unregister) {
+            auto it = m_storage.find(slot.objectId);
+            if (it != m_storage.end()) {
+                slot.displaced = it->second;
+                hint = m_storage.erase(it);
+                ImplChanged(ChangeOp::Remove, slot.objectId);
+            }
+        } else {
+            size_t size = m_storage.size();
+            auto it = m_storage.insert(hint, std::make_pair(slot.objectId, static_cast<IObject*>(nullptr)));
+            slot.displaced = it->second;
+            it->second = slot.object;
+            hint = ++it;
+            ImplChanged(m_storage.size() != size ? ChangeOp::Insert : ChangeOp::Replace, slot.objectId);
+        }
+    }
+    for (size_t i = 0; i < batchSize; ++i) {
+        batch[i]->state.store(SlotDone, std::memory_order_release);
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+CSomeContainer<IObject, LockPolicy>::CCriticalSection::CCriticalSection(CSomeContainer& container, ContainerOperation operation, int objectId)
+    : m_lock(container.m_mutex, std::defer_lock)
+    , m_operation(operation)
+    , m_objectId(objectId)
+    , m_stats(container.m_stats.load(std::memory_order_acquire))
+    , m_watchdog(container.m_watchdog.load(std::memory_order_acquire))
+    , m_tracer(container.m_tracer.load(std::memory_order_acquire))
+    , m_acquired(0)
+    , m_traceRequested(0)
+    , m_traceAcquired(0)
+{
+    if (m_stats == nullptr && m_tracer == nullptr) {
+        m_lock.lock();
+    } else {
+        uint64_t requested = m_stats != nullptr ? MonotonicNanoseconds() : 0;
+        m_traceRequested = m_tracer != nullptr ? SpanTimestamp() : 0;
+        m_lock.lock();
+        m_traceAcquired = m_tracer != nullptr ? SpanTimestamp() : 0;
+        if (m_stats != nullptr) {
+            m_acquired = MonotonicNanoseconds();
+            m_stats->RecordWait(m_operation, m_acquired - requested);
+        }
+    }
+    if (m_watchdog != nullptr) {
+        m_watchdog->Enter(operation, objectId);
+    }
+}
+
+template<typename IObject, typename LockPolicy>
+CSomeContainer<IObject, LockPolicy>::CCriticalSection::~CCriticalSection()
+{
+    if (m_lock.owns_lock()) {
+        Leave();
+    }
+}
+
+// Unlocks, then records the hold and reports it when it was slow; the stack is captured outside the lock
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::CCriticalSection::Leave()
+{
+    WatchdogEvent slow;
+    bool reportSlow = m_watchdog != nullptr && m_watchdog->Exit(slow);
+    m_lock.unlock();
+    if (m_tracer != nullptr) {
+        m_tracer->Record(ToSpanKind(m_operation), m_objectId, m_traceAcquired, SpanTimestamp(), m_traceRequested);
+    }
+    if (m_stats != nullptr) {
+        m_stats->RecordHold(m_operation, MonotonicNanoseconds() - m_acquired);
+    }
+    if (reportSlow) {
+        m_watchdog->ReportSlow(slow);
+    }
+}
+
+// Restarts the timers once Wait holds the lock again, as a section of its own that did not wait for it
+template<typename IObject, typename LockPolicy>
+void CSomeContainer<IObject, LockPolicy>::CCriticalSection::Resume()
+{
+    m_traceAcquired = m_tracer != nullptr ? SpanTimestamp() : 0;
+    m_traceRequested = m_traceAcquired;
+    m_acquired = m_stats != nullptr ? MonotonicNanoseconds() : 0;
+    if (m_watchdog != nullptr) {
+        m_watchdog->Enter(m_operation, m_objectId);
+    }
+}
@@ -3,34 +3,93 @@
 #include <map>
 #include <cassert>
 #include <mutex>
+#include <cstdint>
+#include "AllocationTracker.h"
+#include "VersionIndex.h"
 
 template<typename KeyType, typename ValueType>
-using  KeyValueStore = std::map<KeyType, ValueType>;
+using  KeyValueStore = std::map<KeyType, ValueType, std::less<KeyType>, CTrackingAllocator<std::pair<const KeyType, ValueType> > >;
 
-template<typename IObject>
+template<typename IObject, typename LockPolicy>
 class CSomeContainer;
 
-template<typename IObject>
+template<typename IObject, typename LockPolicy = std::mutex>
 class CSomeContainerIterator {
 public:
-    CSomeContainerIterator(CSomeContainer<IObject>* baseContainer, const typename KeyValueStore<int, IObject*>::iterator baseIterator)
+    // scanBegin is the start of a traced scan, 0 when tracing is off
+    CSomeContainerIterator(CSomeContainer<IObject, LockPolicy>* baseContainer, const typename KeyValueStore<int, IObject*>::iterator baseIterator,
+                           uint64_t scanBegin = 0)
         : m_baseContainer(baseContainer)
-        , m_iterator(baseIterator) {}
+        , m_iterator(baseIterator)
+        , m_scanBegin(scanBegin) {}
 
-    bool operator==(const CSomeContainerIterator<IObject>& right) const {
+    bool operator==(const CSomeContainerIterator<IObject, LockPolicy>& right) const {
         return m_iterator == right.m_iterator;
     }
 
     IObject* operator*() const {
-        return m_baseContainer->Query(m_iterator->first);
+        return m_baseContainer->ImplDereference(m_iterator->first);
     }
 
-    CSomeContainerIterator<IObject>& operator++() {
+    CSomeContainerIterator<IObject, LockPolicy>& operator++() {
         ++m_iterator;
+        if (m_scanBegin != 0) {
+            m_baseContainer->ImplEndScan(m_iterator, m_scanBegin);
+        }
         return *this;
     }
 
 private:
     typename KeyValueStore<int, IObject*>::iterator m_iterator;
-    CSomeContainer<IObject>* m_baseContainer;
+    CSomeContainer<IObject, LockPolicy>* m_baseContainer;
+    uint64_t m_scanBegin;
+};
+
+/*
+ * Walks the changes of a container with version tracking in version order,
+ * from a given version up to the container's version when the walk started.
+ * Every step takes the lock once and finds the next change in logarithmic
+ * time; an id changed again meanwhile shows up at its newer version, or in
+ * the next walk when that is past the end of this one.
+ */
+template<typename IObject, typename LockPolicy = std::mutex>
+class CChangedSinceIterator {
+public:
+    CChangedSinceIterator(CSomeContainer<IObject, LockPolicy>* baseContainer, uint64_t until)
+        : m_baseContainer(baseContainer)
+        , m_until(until)
+        , m_object(nullptr) {}
+
+    bool operator==(const CChangedSinceIterator<IObject, LockPolicy>& right) const {
+        return m_change.version == right.m_change.version && m_change.objectId == right.m_change.objectId;
+    }
+
+    const VersionedChange& operator*() const {
+        return m_change;
+    }
+
+    // the object as of the step that reached this change, nullptr for a tombstone
+    IObject* Object() const {
+        return m_object;
+    }
+
+    // the version to pass to the next walk
+    uint64_t Until() const {
+        return m_until;
+    }
+
+    CChangedSinceIterator<IObject, LockPolicy>& operator++() {
+        if (!m_baseContainer->ImplNextChange(m_until, m_change, m_object)) {
+            m_change = VersionedChange();
+            m_object = nullptr;
+        }
+        return *this;
+    }
+
+private:
+    friend class CSomeContainer<IObject, LockPolicy>;
+    CSomeContainer<IObject, LockPolicy>* m_baseContainer;
+    uint64_t m_until;
+    VersionedChange m_change; // also the position of the walk, version 0 at the end
+    IObject* m_object;
 };
@@ -0,0 +1,222 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "ContainerStats.h"
+
+// The first values match ContainerOperation, those spans are critical sections
+enum class SpanKind {
+    Register,
+    Query,
+    Unregister,
+    IteratorDereference,
+    Construct,   // RegisterAsync factory call
+    Destroy,     // object destructor
+    IteratorScan // Start() until the iterator reaches End()
+};
+
+inline const char* ToString(SpanKind kind)
+{
+    switch (kind) {
+    case SpanKind::Construct: return "Construct";
+    case SpanKind::Destroy: return "Destroy";
+    case SpanKind::IteratorScan: return "IteratorScan";
+    default: return ToString(static_cast<ContainerOperation>(kind));
+    }
+}
+
+inline SpanKind ToSpanKind(ContainerOperation operation)
+{
+    return static_cast<SpanKind>(operation);
+}
+
+// Span timestamps: the TSC on x86, a few times cheaper than the steady clock; converted when dumping
+inline uint64_t SpanTimestamp()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return MonotonicNanoseconds();
+#endif
+}
+
+/*
+ * Flight recorder of spans: every thread writes into its own ring and
+ * overwrites its oldest spans, WriteChromeTrace dumps what the rings hold as
+ * Chrome trace-event JSON (loads in Perfetto and chrome://tracing) while the
+ * writers keep running. Recording a span is a few relaxed stores into the
+ * thread's own ring, no locks and no allocation after the thread's first span.
+ */
+class CSpanTracer {
+public:
+    explicit CSpanTracer(size_t spansPerThread = 65536);
+    // begin, end and requested are SpanTimestamp() values; requested is when the lock was asked for
+    void Record(SpanKind kind, int objectId, uint64_t begin, uint64_t end, uint64_t requested = 0);
+    void WriteChromeTrace(std::ostream& out) const;
+private:
+    CSpanTracer(const CSpanTracer&);
+    CSpanTracer& operator=(const CSpanTracer&);
+    struct Slot {
+        std::atomic<uint64_t> begin;
+        std::atomic<uint64_t> end;
+        std::atomic<uint64_t> requested;
+        std::atomic<uint64_t> idAndKind; // objectId in the low 32 bits, kind above
+    };
+    struct Ring {
+        explicit Ring(size_t capacity) : written(0), slots(new Slot[capacity]) {}
+        std::atomic<uint64_t> written;
+        std::unique_ptr<Slot[]> slots;
+    };
+    struct Span {
+        uint64_t begin;
+        uint64_t end;
+        uint64_t requested;
+        uint64_t idAndKind;
+    };
+    static unsigned long long NextInstanceId();
+    Ring* LocalRing();
+private:
+    const unsigned long long m_instanceId;
+    const uint64_t m_startNanoseconds;
+    const uint64_t m_startTimestamp;
+    const size_t m_capacity; // power of two
+    mutable std::mutex m_ringsMutex;
+    std::vector<std::shared_ptr<Ring> > m_rings; // threads hold weak references to theirs
+};
+
+inline CSpanTracer::CSpanTracer(size_t spansPerThread)
+    : m_instanceId(NextInstanceId())
+    , m_startNanoseconds(MonotonicNanoseconds())
+    , m_startTimestamp(SpanTimestamp())
+    , m_capacity(spansPerThread < 2 ? 2 : 1ull << (HighestBit(spansPerThread - 1) + 1))
+{
+}
+
+inline void CSpanTracer::Record(SpanKind kind, int objectId, uint64_t begin, uint64_t end, uint64_t requested)
+{
+    Ring* ring = LocalRing();
+    uint64_t index = ring->written.load(std::memory_order_relaxed);
+    Slot& slot = ring->slots[index & (m_capacity - 1)];
+    slot.begin.store(begin, std::memory_order_relaxed);
+    slot.end.store(end, std::memory_order_relaxed);
+    slot.requested.store(requested, std::memory_order_relaxed);
+    slot.idAndKind.store(static_cast<uint32_t>(objectId) | static_cast<uint64_t>(kind) << 32, std::memory_order_relaxed);
+    ring->written.store(index + 1, std::memory_order_release);
+}
+
+inline void CSpanTracer::WriteChromeTrace(std::ostream& out) const
+{
+    // timestamp units per nanosecond, measured over the tracer's lifetime but at least 10 ms
+    uint64_t elapsed = MonotonicNanoseconds() - m_startNanoseconds;
+    if (elapsed < 10000000) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(10000000 - elapsed));
+    }
+    uint64_t nowTimestamp = SpanTimestamp();
+    double nanoseconds = static_cast<double>(MonotonicNanoseconds() - m_startNanoseconds);
+    double unitsPerNanosecond = (nowTimestamp - m_startTimestamp) / nanoseconds;
+
+    std::unique_lock<std::mutex> lock(m_ringsMutex);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    char buffer[256];
+    for (size_t thread = 0; thread < m_rings.size(); ++thread) {
+        const Ring& ring = *m_rings[thread];
+        uint64_t written = ring.written.load(std::memory_order_acquire);
+        uint64_t oldest = written > m_capacity ? written - m_capacity : 0;
+        std::vector<Span> spans;
+        for (uint64_t index = oldest; index < written; ++index) {
+            const Slot& slot = ring.slots[index & (m_capacity - 1)];
+            Span span = { slot.begin.load(std::memory_order_relaxed), slot.end.load(std::memory_order_relaxed),
+                          slot.requested.load(std::memory_order_relaxed), slot.idAndKind.load(std::memory_order_relaxed) };
+            spans.push_back(span);
+        }
+        // the owner kept writing while we copied, drop the slots it may have overwritten meanwhile,
+        // including the one it may be writing right now
+        uint64_t unsafe = ring.written.load(std::memory_order_acquire) + 1;
+        size_t overwritten = static_cast<size_t>(std::min<uint64_t>(spans.size(),
+                unsafe > m_capacity + oldest ? unsafe - m_capacity - oldest : 0));
+
+        std::snprintf(buffer, sizeof(buffer), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+                      "\"args\":{\"name\":\"container thread %zu\"}}", first ? "" : ",", thread + 1, thread + 1);
+        out << buffer;
+        first = false;
+        for (size_t i = overwritten; i < spans.size(); ++i) {
+            const Span& span = spans[i];
+            SpanKind kind = static_cast<SpanKind>(span.idAndKind >> 32);
+            const char* category = kind == SpanKind::Construct || kind == SpanKind::Destroy ? "lifecycle"
+                                 : kind == SpanKind::IteratorScan ? "scan" : "lock";
+            std::snprintf(buffer, sizeof(buffer), ",{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+                          "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"id\":%d,\"wait_ns\":%llu}}",
+                          ToString(kind), category, thread + 1,
+                          static_cast<int64_t>(span.begin - m_startTimestamp) / unitsPerNanosecond / 1000.0,
+                          (span.end - span.begin) / unitsPerNanosecond / 1000.0, static_cast<int32_t>(span.idAndKind & 0xffffffffu),
+                          static_cast<unsigned long long>(span.requested != 0 ? (span.begin - span.requested) / unitsPerNanosecond : 0));
+            out << buffer;
+        }
+    }
+    out << "]}\n";
+}
+
+inline unsigned long long CSpanTracer::NextInstanceId()
+{
+    static std::atomic<unsigned long long> counter(0);
+    return ++counter;
+}
+
+inline CSpanTracer::Ring* CSpanTracer::LocalRing()
+{
+    // keyed by instance id rather than address, a new tracer may reuse a destroyed one's memory
+    struct LocalEntry {
+        unsigned long long instanceId;
+        Ring* ring;
+        std::weak_ptr<Ring> owner; // expires with the tracer
+    };
+    static thread_local std::vector<LocalEntry> rings;
+    for (auto it = rings.begin(); it != rings.end(); ++it) {
+        if (it->instanceId == m_instanceId) {
+            return it->ring;
+        }
+    }
+
+    // entries of destroyed tracers go here, so the list holds only live ones and this new one
+    rings.erase(std::remove_if(rings.begin(), rings.end(), [](const LocalEntry& entry) { return entry.owner.expired(); }),
+                rings.end());
+    std::unique_lock<std::mutex> lock(m_ringsMutex);
+    m_rings.push_back(std::shared_ptr<Ring>(new Ring(m_capacity)));
+    LocalEntry entry = { m_instanceId, m_rings.back().get(), m_rings.back() };
+    rings.push_back(entry);
+    return entry.ring;
+}
+
+// Records a span from construction to destruction when a tracer is given
+class CSpanScope {
+public:
+    CSpanScope(CSpanTracer* tracer, SpanKind kind, int objectId)
+        : m_tracer(tracer), m_kind(kind), m_objectId(objectId), m_begin(tracer != nullptr ? SpanTimestamp() : 0) {}
+
+    ~CSpanScope() {
+        if (m_tracer != nullptr) {
+            m_tracer->Record(m_kind, m_objectId, m_begin, SpanTimestamp());
+        }
+    }
+
+private:
+    CSpanScope(const CSpanScope&);
+    CSpanScope& operator=(const CSpanScope&);
+private:
+    CSpanTracer* m_tracer;
+    SpanKind m_kind;
+    int m_objectId;
+    uint64_t m_begin;
+};
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+/*
+ * Bounded single-producer/single-consumer ring.
+ * Capacity must be a power of two; head and tail are kept on separate cache lines.
+ */
+template<typename T, size_t Capacity>
+class CSpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+public:
+    CSpscRing() : m_head(0), m_tail(0) {}
+    bool TryPush(const T& value);
+    size_t PopBatch(T* out, size_t maxCount);
+    // Consumer side: whether nothing is waiting to be popped
+    bool Empty() const { return m_tail.load(std::memory_order_acquire) == m_head.load(std::memory_order_relaxed); }
+private:
+    // padded rather than alignas, over-aligned new needs C++17
+    std::atomic<size_t> m_head; // next slot to pop, written by the consumer
+    char m_headPadding[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail; // next slot to push, written by the producer
+    char m_tailPadding[64 - sizeof(std::atomic<size_t>)];
+    T m_items[Capacity];
+};
+
+template<typename T, size_t Capacity>
+bool CSpscRing<T, Capacity>::TryPush(const T& value)
+{
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) == Capacity) {
+        return false;
+    }
+    m_items[tail & (Capacity - 1)] = value;
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T, size_t Capacity>
+size_t CSpscRing<T, Capacity>::PopBatch(T* out, size_t maxCount)
+{
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t available = m_tail.load(std::memory_order_acquire) - head;
+    size_t count = available < maxCount ? available : maxCount;
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = m_items[(head + i) & (Capacity - 1)];
+    }
+    m_head.store(head + count, std::memory_order_release);
+    return count;
+}
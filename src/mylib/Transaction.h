@@ -0,0 +1,66 @@
+#pragma once
+#include <exception>
+#include <memory>
+#include <vector>
+
+/*
+ * Register and Unregister calls staged for CSomeContainer::Commit or
+ * CShardedContainer::Commit, which apply all of them at once: no other
+ * operation sees some of them applied and others not. Operations on the same
+ * id apply in the order they were staged. The staged objects belong to the
+ * transaction until the commit, and are deleted with it when it is dropped.
+ */
+template<typename IObject>
+class CTransaction {
+public:
+    struct Operation {
+        int objectId;
+        IObject* object; // nullptr for an Unregister
+        bool unregister;
+    };
+
+    CTransaction() {}
+    ~CTransaction() { Rollback(); }
+    void Register(int objectId, std::auto_ptr<IObject> object);
+    void Unregister(int objectId);
+    // Drops the staged operations, deleting their objects
+    void Rollback();
+    size_t Size() const { return m_operations.size(); }
+    bool Empty() const { return m_operations.empty(); }
+    const std::vector<Operation>& Operations() const { return m_operations; }
+    // Hands the operations and their objects over to the committing container
+    void Release(std::vector<Operation>& operations) { operations.swap(m_operations); m_operations.clear(); }
+private:
+    CTransaction(const CTransaction&);
+    CTransaction& operator=(const CTransaction&);
+private:
+    std::vector<Operation> m_operations;
+};
+
+template<typename IObject>
+void CTransaction<IObject>::Register(int objectId, std::auto_ptr<IObject> object)
+{
+    Operation operation = { objectId, object.get(), false };
+    m_operations.push_back(operation);
+    object.release();
+}
+
+template<typename IObject>
+void CTransaction<IObject>::Unregister(int objectId)
+{
+    Operation operation = { objectId, nullptr, true };
+    m_operations.push_back(operation);
+}
+
+template<typename IObject>
+void CTransaction<IObject>::Rollback()
+{
+    for (auto it = m_operations.begin(); it != m_operations.end(); ++it) {
+        try {
+            delete it->object;
+        } catch (const std::exception &) {
+            //
+        }
+    }
+    m_operations.clear();
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+// An entry as a delta scan reports it
+struct VersionedChange {
+    VersionedChange() : objectId(0), version(0), removed(false) {}
+    int objectId;
+    uint64_t version; // of the id's last change
+    bool removed;     // a tombstone, the id is gone
+};
+
+/*
+ * Last change version of every id, present or removed, and the same ids
+ * ordered by that version, so the changes after a version are found with one
+ * lookup plus a step per change. Not synchronized, the container calls it
+ * under its lock.
+ */
+class CVersionIndex {
+public:
+    explicit CVersionIndex(uint64_t version) : m_tombstones(0), m_rescanBefore(version) {}
+    void Stamp(int objectId, uint64_t version, bool removed);
+    // Clear or LoadSnapshot: the changes before version cannot be told apart any more
+    void Reset(uint64_t version);
+    // 0 for an id never seen since the index was created, or whose tombstone was dropped
+    uint64_t VersionOf(int objectId) const;
+    bool Removed(int objectId) const;
+    // The change following (after, afterId) in (version, id) order with a version up to until, false when there is none
+    bool Next(uint64_t after, int afterId, uint64_t until, VersionedChange& change) const;
+    // Whether a scan since version misses changes: it started before a reset or a dropped tombstone
+    bool NeedsRescan(uint64_t version) const { return version < m_rescanBefore; }
+    size_t DropTombstones(uint64_t upToVersion);
+    size_t Tombstones() const { return m_tombstones; }
+private:
+    struct Entry {
+        uint64_t version;
+        bool removed;
+    };
+    std::unordered_map<int, Entry> m_entries;
+    // (version, id) of every id's latest change; ids stamped together share a version
+    std::set<std::pair<uint64_t, int> > m_byVersion;
+    size_t m_tombstones;
+    uint64_t m_rescanBefore;
+};
+
+inline void CVersionIndex::Stamp(int objectId, uint64_t version, bool removed)
+{
+    auto inserted = m_entries.insert(std::make_pair(objectId, Entry()));
+    Entry& entry = inserted.first->second;
+    if (!inserted.second) {
+        m_byVersion.erase(std::make_pair(entry.version, objectId));
+        m_tombstones -= entry.removed ? 1 : 0;
+    }
+    entry.version = version;
+    entry.removed = removed;
+    m_tombstones += removed ? 1 : 0;
+    m_byVersion.insert(std::make_pair(version, objectId));
+}
+
+inline void CVersionIndex::Reset(uint64_t version)
+{
+    m_entries.clear();
+    m_byVersion.clear();
+    m_tombstones = 0;
+    m_rescanBefore = version;
+}
+
+inline uint64_t CVersionIndex::VersionOf(int objectId) const
+{
+    auto it = m_entries.find(objectId);
+    return it != m_entries.end() ? it->second.version : 0;
+}
+
+inline bool CVersionIndex::Removed(int objectId) const
+{
+    auto it = m_entries.find(objectId);
+    return it != m_entries.end() && it->second.removed;
+}
+
+inline bool CVersionIndex::Next(uint64_t after, int afterId, uint64_t until, VersionedChange& change) const
+{
+    auto it = m_byVersion.upper_bound(std::make_pair(after, afterId));
+    if (it == m_byVersion.end() || it->first > until) {
+        return false;
+    }
+    change.objectId = it->second;
+    change.version = it->first;
+    change.removed = m_entries.find(it->second)->second.removed;
+    return true;
+}
+
+// Forgets the tombstones up to a version, walking the changes up to it; scans since an older version then need a rescan
+inline size_t CVersionIndex::DropTombstones(uint64_t upToVersion)
+{
+    size_t dropped = 0;
+    for (auto it = m_byVersion.begin(); it != m_byVersion.end() && it->first <= upToVersion && m_tombstones != 0; ) {
+        auto entry = m_entries.find(it->second);
+        if (entry->second.removed) {
+            m_entries.erase(entry);
+            it = m_byVersion.erase(it);
+            --m_tombstones;
+            ++dropped;
+        } else {
+            ++it;
+        }
+    }
+    if (upToVersion > m_rescanBefore) {
+        m_rescanBefore = upToVersion;
+    }
+    return dropped;
+}
@@ -0,0 +1,403 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/*
+ * Multi-version id to object registry. Every write gets the next timestamp
+ * and pushes a version onto the id's chain, newest first, a removal pushes a
+ * tombstone. A reader opens a view at a timestamp and sees every id as of
+ * that timestamp, however many ids it reads and whatever writers do
+ * meanwhile; reading takes no lock, a view only claims a reader slot.
+ *
+ * Writers serialize on a mutex and collect the versions no open view can
+ * reach: for every id the newest version at or before the oldest open
+ * timestamp is the last one kept. Only ids written since their chain was
+ * last trimmed are visited. An id's node and its last version stay, so a
+ * removed id keeps costing a node and a tombstone.
+ *
+ * The bucket array does not grow; size it for the expected number of ids.
+ */
+template<typename IObject>
+class CVersionedContainer {
+public:
+    class CReadView;
+
+    // At most readerSlots views can be open at once, opening one more throws
+    explicit CVersionedContainer(size_t bucketCount = 1 << 16, size_t readerSlots = 64);
+    // Views must be closed by now
+    ~CVersionedContainer();
+    // Both return the timestamp of the write
+    uint64_t Register(int objectId, std::auto_ptr<IObject> object);
+    uint64_t Unregister(int objectId);
+    // Timestamp of the latest write
+    uint64_t Now() const { return m_clock.load(std::memory_order_acquire); }
+    // A view at the latest timestamp; throws std::runtime_error when every reader slot is held
+    CReadView Read();
+    // A view at an earlier timestamp; throws std::out_of_range once its versions may be collected
+    CReadView ReadAt(uint64_t timestamp);
+    // Trims the chains now rather than when enough of them grew, returns the number of versions freed
+    size_t Collect();
+    // Versions kept, tombstones included
+    size_t Versions() const;
+
+private:
+    CVersionedContainer(const CVersionedContainer&);
+    CVersionedContainer& operator=(const CVersionedContainer&);
+    struct Version {
+        uint64_t timestamp;
+        IObject* object; // nullptr for a tombstone
+        std::atomic<Version*> older;
+    };
+    struct Node {
+        int objectId;
+        bool trimmed; // has one version, not in m_untrimmed
+        std::atomic<Version*> newest;
+        std::atomic<Node*> next;
+    };
+    struct ReaderSlot {
+        std::atomic<uint64_t> timestamp; // view timestamp + 1, 0 when free
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    Node* Find(int objectId) const;
+    const Version* VersionAt(int objectId, uint64_t timestamp) const;
+    uint64_t Write(int objectId, IObject* object);
+    size_t Trim(std::vector<IObject*>& freed);
+    ReaderSlot* Claim(uint64_t timestamp);
+    static void Destroy(std::vector<IObject*>& objects);
+private:
+    std::unique_ptr<std::atomic<Node*>[]> m_buckets;
+    size_t m_mask;
+    std::unique_ptr<ReaderSlot[]> m_readers;
+    size_t m_readerCount;
+    std::atomic<uint64_t> m_clock;
+    std::atomic<uint64_t> m_horizon; // versions only an older view could need may be freed
+    mutable std::mutex m_writers;
+    std::vector<Node*> m_untrimmed; // ids with more than one version
+    size_t m_trimAt;                // m_untrimmed size that triggers the next trim
+    size_t m_versions;
+};
+
+/*
+ * Reads of one timestamp. Objects returned stay valid while the view is
+ * open. A view is used by one thread at a time and must be closed, i.e.
+ * destroyed, before the container.
+ */
+template<typename IObject>
+class CVersionedContainer<IObject>::CReadView {
+public:
+    CReadView(CReadView&& other)
+        : m_container(other.m_container), m_slot(other.m_slot), m_timestamp(other.m_timestamp) {
+        other.m_slot = nullptr;
+    }
+    ~CReadView() {
+        if (m_slot != nullptr) {
+            m_slot->timestamp.store(0, std::memory_order_release);
+        }
+    }
+    uint64_t Timestamp() const { return m_timestamp; }
+    // Throws std::out_of_range for an id absent at the view's timestamp
+    const IObject* Query(int objectId) const;
+    bool Contains(int objectId) const { return m_container->VersionAt(objectId, m_timestamp) != nullptr; }
+    // Calls visit(id, object) for every id present at the view's timestamp, in no particular order
+    void ForEach(const std::function<void(int, const IObject*)>& visit) const;
+private:
+    friend class CVersionedContainer<IObject>;
+    CReadView(const CVersionedContainer* container, ReaderSlot* slot, uint64_t timestamp)
+        : m_container(container), m_slot(slot), m_timestamp(timestamp) {}
+    CReadView(const CReadView&);
+    CReadView& operator=(const CReadView&);
+private:
+    const CVersionedContainer* m_container;
+    ReaderSlot* m_slot;
+    uint64_t m_timestamp;
+};
+
+template<typename IObject>
+CVersionedContainer<IObject>::CVersionedContainer(size_t bucketCount, size_t readerSlots)
+    : m_mask(0)
+    , m_readerCount(std::max<size_t>(readerSlots, 1))
+    , m_clock(0)
+    , m_horizon(0)
+    , m_trimAt(256)
+    , m_versions(0)
+{
+    size_t size = 1;
+    while (size < bucketCount) {
+        size <<= 1;
+    }
+    m_buckets.reset(new std::atomic<Node*>[size]);
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+        m_buckets[i].store(nullptr, std::memory_order_relaxed);
+    }
+    m_readers.reset(new ReaderSlot[m_readerCount]);
+    for (size_t i = 0; i < m_readerCount; ++i) {
+        m_readers[i].timestamp.store(0, std::memory_order_relaxed);
+    }
+}
+
+template<typename IObject>
+CVersionedContainer<IObject>::~CVersionedContainer()
+{
+    for (size_t i = 0; i <= m_mask; ++i) {
+        Node* node = m_buckets[i].load(std::memory_order_relaxed);
+        while (node != nullptr) {
+            Version* version = node->newest.load(std::memory_order_relaxed);
+            while (version != nullptr) {
+                Version* older = version->older.load(std::memory_order_relaxed);
+                try {
+                    delete version->object;
+                } catch (const std::exception &) {
+                    //
+                }
+                delete version;
+                version = older;
+            }
+            Node* next = node->next.load(std::memory_order_relaxed);
+            delete node;
+            node = next;
+        }
+    }
+}
+
+template<typename IObject>
+uint64_t CVersionedContainer<IObject>::Register(int objectId, std::auto_ptr<IObject> object)
+{
+    uint64_t timestamp = Write(objectId, object.get());
+    object.release();
+    return timestamp;
+}
+
+template<typename IObject>
+uint64_t CVersionedContainer<IObject>::Unregister(int objectId)
+{
+    return Write(objectId, nullptr);
+}
+
+template<typename IObject>
+typename CVersionedContainer<IObject>::CReadView CVersionedContainer<IObject>::Read()
+{
+    uint64_t timestamp = 0;
+    ReaderSlot* slot = nullptr;
+    do {
+        timestamp = m_clock.load(std::memory_order_seq_cst);
+        slot = Claim(timestamp);
+    } while (slot == nullptr); // a collection overtook the timestamp, the next one is newer
+    return CReadView(this, slot, timestamp);
+}
+
+template<typename IObject>
+typename CVersionedContainer<IObject>::CReadView CVersionedContainer<IObject>::ReadAt(uint64_t timestamp)
+{
+    if (timestamp > Now()) {
+        throw std::out_of_range("the timestamp is in the future");
+    }
+    ReaderSlot* slot = Claim(timestamp);
+    if (slot == nullptr) {
+        throw std::out_of_range("the versions of this timestamp may be collected");
+    }
+    return CReadView(this, slot, timestamp);
+}
+
+template<typename IObject>
+size_t CVersionedContainer<IObject>::Collect()
+{
+    std::vector<IObject*> freed;
+    size_t count = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_writers);
+        count = Trim(freed);
+    }
+    Destroy(freed);
+    return count;
+}
+
+template<typename IObject>
+size_t CVersionedContainer<IObject>::Versions() const
+{
+    std::unique_lock<std::mutex> lock(m_writers);
+    return m_versions;
+}
+
+template<typename IObject>
+const IObject* CVersionedContainer<IObject>::CReadView::Query(int objectId) const
+{
+    const Version* version = m_container->VersionAt(objectId, m_timestamp);
+    if (version == nullptr) {
+        throw std::out_of_range("no object with this id at the view's timestamp");
+    }
+    return version->object;
+}
+
+template<typename IObject>
+void CVersionedContainer<IObject>::CReadView::ForEach(const std::function<void(int, const IObject*)>& visit) const
+{
+    for (size_t i = 0; i <= m_container->m_mask; ++i) {
+        for (Node* node = m_container->m_buckets[i].load(std::memory_order_acquire); node != nullptr;
+                node = node->next.load(std::memory_order_acquire)) {
+            const Version* version = m_container->VersionAt(node->objectId, m_timestamp);
+            if (version != nullptr) {
+                visit(node->objectId, version->object);
+            }
+        }
+    }
+}
+
+template<typename IObject>
+typename CVersionedContainer<IObject>::Node* CVersionedContainer<IObject>::Find(int objectId) const
+{
+    size_t bucket = (static_cast<uint32_t>(objectId) * 2654435761u) & m_mask;
+    Node* node = m_buckets[bucket].load(std::memory_order_acquire);
+    while (node != nullptr && node->objectId != objectId) {
+        node = node->next.load(std::memory_order_acquire);
+    }
+    return node;
+}
+
+// The version a view at timestamp sees, nullptr when the id is absent or removed then
+template<typename IObject>
+const typename CVersionedContainer<IObject>::Version* CVersionedContainer<IObject>::VersionAt(int objectId, uint64_t timestamp) const
+{
+    Node* node = Find(objectId);
+    const Version* version = node != nullptr ? node->newest.load(std::memory_order_acquire) : nullptr;
+    // stops at the first version at or before timestamp, a collection never frees that one or a newer one
+    while (version != nullptr && version->timestamp > timestamp) {
+        version = version->older.load(std::memory_order_acquire);
+    }
+    return version != nullptr && version->object != nullptr ? version : nullptr;
+}
+
+template<typename IObject>
+uint64_t CVersionedContainer<IObject>::Write(int objectId, IObject* object)
+{
+    std::vector<IObject*> freed;
+    uint64_t timestamp = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_writers);
+        Node* node = Find(objectId);
+        Version* newest = node != nullptr ? node->newest.load(std::memory_order_relaxed) : nullptr;
+        if (object == nullptr && (newest == nullptr || newest->object == nullptr)) {
+            return m_clock.load(std::memory_order_relaxed); // nothing to remove
+        }
+        timestamp = m_clock.load(std::memory_order_relaxed) + 1;
+        std::unique_ptr<Version> version(new Version);
+        version->timestamp = timestamp;
+        version->object = object;
+        version->older.store(newest, std::memory_order_relaxed);
+        if (node == nullptr) {
+            std::unique_ptr<Node> created(new Node);
+            created->objectId = objectId;
+            created->trimmed = true;
+            created->newest.store(nullptr, std::memory_order_relaxed);
+            std::atomic<Node*>& bucket = m_buckets[(static_cast<uint32_t>(objectId) * 2654435761u) & m_mask];
+            created->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            node = created.release();
+            bucket.store(node, std::memory_order_release);
+        }
+        if (newest != nullptr && node->trimmed) {
+            node->trimmed = false;
+            m_untrimmed.push_back(node);
+        }
+        node->newest.store(version.release(), std::memory_order_release);
+        ++m_versions;
+        // the version is reachable before any view can open at its timestamp
+        m_clock.store(timestamp, std::memory_order_seq_cst);
+        if (m_untrimmed.size() >= m_trimAt) {
+            Trim(freed);
+            // chains held by long views stay untrimmed, wait for as many again before the next pass
+            m_trimAt = std::max<size_t>(256, 2 * m_untrimmed.size());
+        }
+    }
+    Destroy(freed);
+    return timestamp;
+}
+
+/*
+ * Cuts every untrimmed chain below its newest version at or before the
+ * horizon, the oldest timestamp an open or opening view may have. Called
+ * with m_writers held; the objects of the freed versions are handed back.
+ */
+template<typename IObject>
+size_t CVersionedContainer<IObject>::Trim(std::vector<IObject*>& freed)
+{
+    // A view claims its slot, then checks the horizon. Publishing the clock as
+    // the horizon before scanning means a view this scan misses sees at least
+    // that value and either opens at a timestamp no older or retries.
+    uint64_t horizon = m_clock.load(std::memory_order_seq_cst);
+    m_horizon.store(horizon, std::memory_order_seq_cst);
+    for (size_t i = 0; i < m_readerCount; ++i) {
+        uint64_t claimed = m_readers[i].timestamp.load(std::memory_order_seq_cst);
+        if (claimed != 0) {
+            horizon = std::min(horizon, claimed - 1);
+        }
+    }
+    m_horizon.store(horizon, std::memory_order_seq_cst);
+
+    size_t count = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < m_untrimmed.size(); ++i) {
+        Node* node = m_untrimmed[i];
+        Version* last = node->newest.load(std::memory_order_relaxed);
+        while (last->timestamp > horizon && last->older.load(std::memory_order_relaxed) != nullptr) {
+            last = last->older.load(std::memory_order_relaxed);
+        }
+        Version* version = last->timestamp <= horizon ? last->older.exchange(nullptr, std::memory_order_relaxed) : nullptr;
+        while (version != nullptr) {
+            Version* older = version->older.load(std::memory_order_relaxed);
+            freed.push_back(version->object);
+            delete version;
+            version = older;
+            ++count;
+        }
+        if (node->newest.load(std::memory_order_relaxed)->older.load(std::memory_order_relaxed) == nullptr) {
+            node->trimmed = true;
+        } else {
+            m_untrimmed[kept++] = node;
+        }
+    }
+    m_untrimmed.resize(kept);
+    m_versions -= count;
+    return count;
+}
+
+/*
+ * A free slot holding timestamp, nullptr when a collection may already have
+ * freed its versions. Throws when no slot is free, waiting for one could wait
+ * on a view of the calling thread.
+ */
+template<typename IObject>
+typename CVersionedContainer<IObject>::ReaderSlot* CVersionedContainer<IObject>::Claim(uint64_t timestamp)
+{
+    size_t first = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (size_t attempt = 0; attempt < m_readerCount; ++attempt) {
+        ReaderSlot& slot = m_readers[(first + attempt) % m_readerCount];
+        uint64_t expected = 0;
+        if (slot.timestamp.compare_exchange_strong(expected, timestamp + 1, std::memory_order_seq_cst)) {
+            if (timestamp < m_horizon.load(std::memory_order_seq_cst)) {
+                slot.timestamp.store(0, std::memory_order_release);
+                return nullptr;
+            }
+            return &slot;
+        }
+    }
+    throw std::runtime_error("every reader slot is held by an open view");
+}
+
+template<typename IObject>
+void CVersionedContainer<IObject>::Destroy(std::vector<IObject*>& objects)
+{
+    for (auto it = objects.begin(); it != objects.end(); ++it) {
+        try {
+            delete *it;
+        } catch (const std::exception &) {
+            //
+        }
+    }
+}
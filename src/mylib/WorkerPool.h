@@ -0,0 +1,97 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed set of worker threads draining a FIFO task queue.
+ * The destructor runs every task that was already submitted before joining.
+ */
+class CWorkerPool {
+public:
+    explicit CWorkerPool(size_t threadCount = std::thread::hardware_concurrency());
+    ~CWorkerPool();
+    void Submit(std::function<void()> task);
+    template<typename Result>
+    std::future<Result> Async(std::function<Result()> task);
+    size_t ThreadCount() const;
+private:
+    CWorkerPool(const CWorkerPool&);
+    CWorkerPool& operator=(const CWorkerPool&);
+    void WorkerLoop();
+private:
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()> > m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    bool m_stopping;
+};
+
+inline CWorkerPool::CWorkerPool(size_t threadCount)
+    : m_stopping(false)
+{
+    threadCount = std::max<size_t>(threadCount, 1);
+    for (size_t i = 0; i < threadCount; ++i) {
+        m_threads.push_back(std::thread(&CWorkerPool::WorkerLoop, this));
+    }
+}
+
+inline CWorkerPool::~CWorkerPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeUp.notify_all();
+    for (auto it = m_threads.begin(); it != m_threads.end(); ++it) {
+        it->join();
+    }
+}
+
+inline void CWorkerPool::Submit(std::function<void()> task)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_wakeUp.notify_one();
+}
+
+template<typename Result>
+std::future<Result> CWorkerPool::Async(std::function<Result()> task)
+{
+    // std::function needs a copyable target, packaged_task is move-only
+    std::shared_ptr<std::packaged_task<Result()> > packaged =
+            std::make_shared<std::packaged_task<Result()> >(std::move(task));
+    std::future<Result> result = packaged->get_future();
+    Submit([packaged]() { (*packaged)(); });
+    return result;
+}
+
+inline size_t CWorkerPool::ThreadCount() const
+{
+    return m_threads.size();
+}
+
+inline void CWorkerPool::WorkerLoop()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeUp.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+            if (m_tasks.empty()) {
+                return;
+            }
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,727 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "Snapshot.h"
+
+enum class LogRecordKind {
+    Put,        // body: a snapshot block (entry count, entries) with the objects written
+    Remove,     // body: the id (i32)
+    Clear,      // no body
+    Transaction // body: operation count (u32), then per operation its kind (u32), body size (u32) and a Put or Remove body
+};
+
+/*
+ * Write-ahead log files for a path prefix, host byte order:
+ *   <path>.log.<n>  segments: LogSegmentHeader, then records, each a LogRecordHeader and its body
+ *   <path>.base     the checkpoint, a version 2 snapshot that records which log prefix it includes
+ * Sequences are dense but records reach the segments in commit order, so
+ * replay sorts them and stops at the first gap: the writes a crash cut off.
+ */
+struct LogSegmentHeader {
+    char magic[8];          // "SCWALOG1"
+    uint32_t version;
+    uint32_t restarted;     // 1 for the first segment of a log instance
+    uint64_t firstSequence; // first sequence that instance hands out
+};
+
+struct LogRecordHeader {
+    uint64_t sequence;
+    uint32_t kind;     // LogRecordKind
+    uint32_t size;     // of the body
+    uint64_t checksum; // FNV-1a of the body, a torn tail fails it
+};
+
+struct WriteAheadLogOptions {
+    WriteAheadLogOptions()
+        : shards(16), commitInterval(std::chrono::milliseconds(2)), syncToDisk(true)
+        , checkpointInterval(std::chrono::milliseconds(0)), entriesPerBlock(4096) {}
+
+    size_t shards;                              // append buffers, picked by id
+    std::chrono::microseconds commitInterval;   // group commit period
+    bool syncToDisk;                            // fsync every group commit
+    std::chrono::milliseconds checkpointInterval; // 0: only explicit Checkpoint calls
+    size_t entriesPerBlock;                     // of the blocks checkpoints write
+};
+
+// Encodes the log body of a write, a one-entry snapshot block
+template<typename IObject>
+void LogEncodePut(int objectId, const IObject* object, std::string& body)
+{
+    uint32_t count = 1;
+    body.assign(reinterpret_cast<const char*>(&count), sizeof(count));
+    SnapshotEncodeEntry<IObject>(objectId, object, body);
+}
+
+inline void LogEncodeRemove(int objectId, std::string& body)
+{
+    int32_t id = objectId;
+    body.assign(reinterpret_cast<const char*>(&id), sizeof(id));
+}
+
+// Encodes the operations of a transaction as one record body, so replay applies all of them or none
+inline void LogEncodeTransaction(const std::vector<std::pair<LogRecordKind, std::string> >& operations, std::string& body)
+{
+    uint32_t count = static_cast<uint32_t>(operations.size());
+    body.assign(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (auto it = operations.begin(); it != operations.end(); ++it) {
+        uint32_t header[2] = { static_cast<uint32_t>(it->first), static_cast<uint32_t>(it->second.size()) };
+        body.append(reinterpret_cast<const char*>(header), sizeof(header));
+        body.append(it->second);
+    }
+}
+
+inline std::vector<std::pair<LogRecordKind, std::string> > LogDecodeTransaction(const std::string& body)
+{
+    std::vector<std::pair<LogRecordKind, std::string> > operations;
+    uint32_t count = 0;
+    std::memcpy(&count, body.data(), std::min(sizeof(count), body.size()));
+    size_t offset = sizeof(count);
+    for (uint32_t i = 0; i < count && offset + 2 * sizeof(uint32_t) <= body.size(); ++i) {
+        uint32_t header[2];
+        std::memcpy(header, body.data() + offset, sizeof(header));
+        offset += sizeof(header);
+        if (header[1] > body.size() - offset) {
+            throw std::runtime_error("write-ahead log transaction record is damaged");
+        }
+        operations.push_back(std::make_pair(static_cast<LogRecordKind>(header[0]), body.substr(offset, header[1])));
+        offset += header[1];
+    }
+    return operations;
+}
+
+/*
+ * Write-ahead log behind CSomeContainer::EnableWriteAheadLog. A writer takes
+ * a sequence while it holds the container lock, so sequences follow the order
+ * writes were applied, and appends the record to its shard's buffer after
+ * unlocking. A background thread swaps the buffers out and writes them as
+ * one group commit; nothing on the writer's path touches the disk.
+ *
+ * Checkpoint folds the committed segments into the base image: blocks of the
+ * previous base no record touched are copied as they are, only the others
+ * are rewritten, and the folded segments are deleted. Recovery then loads the
+ * base and replays the records after it.
+ */
+class CWriteAheadLog {
+public:
+    // Continues an existing log at path, or starts one
+    explicit CWriteAheadLog(const std::string& path, const WriteAheadLogOptions& options = WriteAheadLogOptions());
+    // Commits what is buffered
+    ~CWriteAheadLog();
+    // Takes count consecutive sequences, under the container lock so they follow the order writes were applied
+    uint64_t Sequence(size_t count = 1) { return m_nextSequence.fetch_add(count, std::memory_order_relaxed); }
+    void Append(uint64_t sequence, LogRecordKind kind, int objectId, const std::string& body);
+    // Waits until every record sequenced before the call is on disk, throws when a commit fails to write them
+    void Sync();
+    // Last sequence that is on disk together with all before it
+    uint64_t Durable() const { return m_durable.load(std::memory_order_acquire); }
+    // Returns the number of records folded into the base image
+    size_t Checkpoint();
+
+    static std::string BasePath(const std::string& path) { return path + ".base"; }
+    static std::string SegmentPath(const std::string& path, uint64_t segment) {
+        return path + ".log." + std::to_string(segment);
+    }
+    // Calls apply for the records after the base image in sequence order, returns how many there were
+    static size_t Replay(const std::string& path, const std::function<void(LogRecordKind, const std::string&)>& apply);
+
+private:
+    CWriteAheadLog(const CWriteAheadLog&);
+    CWriteAheadLog& operator=(const CWriteAheadLog&);
+    struct Shard {
+        Shard() {}
+        std::mutex mutex;
+        std::string buffer;
+        std::vector<uint64_t> sequences;
+        char padding[64];
+    };
+    struct Record {
+        uint64_t sequence;
+        LogRecordKind kind;
+        std::string body;
+    };
+    struct SegmentScan {
+        SegmentScan() : baseSequence(0), firstSegment(1), endSegment(1) {}
+        uint64_t baseSequence;
+        uint64_t firstSegment;
+        uint64_t endSegment;        // one past the last existing segment
+        std::vector<Record> records; // after the base, sorted, up to the first gap
+        std::vector<uint64_t> maxSequences; // per segment from firstSegment
+    };
+    static SegmentScan Scan(const std::string& path, uint64_t endSegment);
+    static void ReadSegment(const std::string& path, std::vector<Record>& records, uint64_t& maxSequence);
+    void OpenSegment(bool restarted);
+    void RewindSegment();
+    void CommitLoop();
+    void CheckpointLoop();
+    void Commit();
+    void WriteBase(const std::map<int, std::string>& changes, bool cleared, const SnapshotLogPosition& position);
+private:
+    const std::string m_path;
+    const WriteAheadLogOptions m_options;
+    std::unique_ptr<Shard[]> m_shards;
+    std::atomic<uint64_t> m_nextSequence;
+    std::atomic<uint64_t> m_durable;
+    std::vector<uint64_t> m_committed; // sequences on disk above m_durable, a min-heap
+    std::string m_batch;                // taken from the shards but not written yet
+    std::vector<uint64_t> m_batchSequences;
+
+    std::mutex m_fileMutex; // the segment being written
+    std::FILE* m_file;  // nullptr after a failed commit until the next one rewinds the segment
+    uint64_t m_segment;
+    long m_segmentSize; // up to the end of the last batch written whole, 0 before the header is
+
+    std::mutex m_checkpointMutex;
+    uint64_t m_baseSequence;
+
+    std::mutex m_commitMutex;
+    std::condition_variable m_commitWakeUp;
+    std::condition_variable m_durableChanged;
+    bool m_syncRequested;
+    bool m_stopping;
+    uint64_t m_commits;    // group commits finished
+    std::string m_failure; // why the last one failed, empty when it succeeded
+    std::thread m_committer;
+    std::thread m_checkpointer;
+};
+
+inline CWriteAheadLog::CWriteAheadLog(const std::string& path, const WriteAheadLogOptions& options)
+    : m_path(path)
+    , m_options(options)
+    , m_shards(new Shard[std::max<size_t>(options.shards, 1)])
+    , m_nextSequence(0)
+    , m_durable(0)
+    , m_file(nullptr)
+    , m_segment(0)
+    , m_segmentSize(0)
+    , m_baseSequence(0)
+    , m_syncRequested(false)
+    , m_stopping(false)
+    , m_commits(0)
+{
+    SegmentScan scan = Scan(path, 0);
+    uint64_t last = scan.records.empty() ? scan.baseSequence : scan.records.back().sequence;
+    m_nextSequence.store(last + 1);
+    m_durable.store(last);
+    m_baseSequence = scan.baseSequence;
+    m_segment = scan.endSegment;
+    OpenSegment(true);
+    m_committer = std::thread(&CWriteAheadLog::CommitLoop, this);
+    if (options.checkpointInterval.count() != 0) {
+        m_checkpointer = std::thread(&CWriteAheadLog::CheckpointLoop, this);
+    }
+}
+
+inline CWriteAheadLog::~CWriteAheadLog()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_commitMutex);
+        m_stopping = true;
+    }
+    m_commitWakeUp.notify_all();
+    if (m_checkpointer.joinable()) {
+        m_checkpointer.join();
+    }
+    m_committer.join();
+    if (m_file != nullptr) {
+        std::fclose(m_file);
+    }
+}
+
+inline void CWriteAheadLog::Append(uint64_t sequence, LogRecordKind kind, int objectId, const std::string& body)
+{
+    LogRecordHeader header;
+    header.sequence = sequence;
+    header.kind = static_cast<uint32_t>(kind);
+    header.size = static_cast<uint32_t>(body.size());
+    header.checksum = SnapshotChecksum(body.data(), body.size());
+    Shard& shard = m_shards[static_cast<uint32_t>(objectId) % std::max<size_t>(m_options.shards, 1)];
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    shard.buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    shard.buffer.append(body);
+    shard.sequences.push_back(sequence);
+}
+
+inline void CWriteAheadLog::Sync()
+{
+    uint64_t target = m_nextSequence.load() - 1;
+    std::unique_lock<std::mutex> lock(m_commitMutex);
+    uint64_t commits = m_commits;
+    m_syncRequested = true;
+    m_commitWakeUp.notify_all();
+    // a commit that fails after the call keeps the target from ever becoming durable
+    m_durableChanged.wait(lock, [this, target, commits]() {
+        return Durable() >= target || (m_commits != commits && !m_failure.empty());
+    });
+    if (Durable() < target) {
+        throw std::runtime_error(m_failure);
+    }
+}
+
+inline size_t CWriteAheadLog::Checkpoint()
+{
+    std::unique_lock<std::mutex> checkpointLock(m_checkpointMutex);
+    Sync();
+    SnapshotLogPosition position;
+    position.sequence = Durable();
+    if (position.sequence == m_baseSequence) {
+        return 0;
+    }
+    uint64_t endSegment = 0;
+    {
+        // later records go to a new segment, the closed ones are folded
+        std::unique_lock<std::mutex> fileLock(m_fileMutex);
+        if (m_file == nullptr) {
+            RewindSegment();
+        }
+        std::fclose(m_file);
+        ++m_segment;
+        OpenSegment(false);
+        endSegment = m_segment;
+    }
+
+    SegmentScan scan = Scan(m_path, endSegment);
+    std::map<int, std::string> changes; // encoded entries, empty for a removal
+    bool cleared = false;
+    auto fold = [&changes](LogRecordKind kind, const std::string& body) {
+        if (kind == LogRecordKind::Remove) {
+            int32_t id = 0;
+            std::memcpy(&id, body.data(), std::min(sizeof(id), body.size()));
+            changes[id].clear();
+        } else if (kind == LogRecordKind::Put) {
+            uint32_t count = 0;
+            std::memcpy(&count, body.data(), std::min(sizeof(count), body.size()));
+            size_t offset = sizeof(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                size_t size = SnapshotEntrySize(body.data() + offset, body.size() - offset);
+                int32_t id = 0;
+                std::memcpy(&id, body.data() + offset, sizeof(id));
+                changes[id].assign(body, offset, size);
+                offset += size;
+            }
+        }
+    };
+    size_t folded = 0;
+    for (auto it = scan.records.begin(); it != scan.records.end() && it->sequence <= position.sequence; ++it, ++folded) {
+        if (it->kind == LogRecordKind::Clear) {
+            changes.clear();
+            cleared = true;
+        } else if (it->kind == LogRecordKind::Transaction) {
+            std::vector<std::pair<LogRecordKind, std::string> > operations = LogDecodeTransaction(it->body);
+            for (auto operation = operations.begin(); operation != operations.end(); ++operation) {
+                fold(operation->first, operation->second);
+            }
+        } else {
+            fold(it->kind, it->body);
+        }
+    }
+
+    // segments holding nothing after the new base are no longer needed
+    position.firstSegment = scan.firstSegment;
+    while (position.firstSegment - scan.firstSegment < scan.maxSequences.size()
+           && scan.maxSequences[position.firstSegment - scan.firstSegment] <= position.sequence) {
+        ++position.firstSegment;
+    }
+    WriteBase(changes, cleared, position);
+    for (uint64_t segment = scan.firstSegment; segment < position.firstSegment; ++segment) {
+        std::remove(SegmentPath(m_path, segment).c_str());
+    }
+    m_baseSequence = position.sequence;
+    return folded;
+}
+
+inline size_t CWriteAheadLog::Replay(const std::string& path, const std::function<void(LogRecordKind, const std::string&)>& apply)
+{
+    SegmentScan scan = Scan(path, 0);
+    for (auto it = scan.records.begin(); it != scan.records.end(); ++it) {
+        apply(it->kind, it->body);
+    }
+    return scan.records.size();
+}
+
+/*
+ * Reads the base position and the segments from the base's first one up to
+ * endSegment (0: as far as they exist). A segment that starts a new log
+ * instance discards the records the previous instance wrote at or after its
+ * first sequence: they were beyond a gap and their sequences are reused.
+ */
+inline CWriteAheadLog::SegmentScan CWriteAheadLog::Scan(const std::string& path, uint64_t endSegment)
+{
+    SegmentScan scan;
+    std::string basePath = BasePath(path);
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> base(std::fopen(basePath.c_str(), "rb"), std::fclose);
+    if (base) {
+        SnapshotLogPosition position;
+        SnapshotReadIndex(base.get(), basePath, &position);
+        scan.baseSequence = position.sequence;
+        scan.firstSegment = std::max<uint64_t>(position.firstSegment, 1);
+    }
+
+    std::vector<Record> records;
+    for (scan.endSegment = scan.firstSegment; endSegment == 0 || scan.endSegment < endSegment; ++scan.endSegment) {
+        std::string segmentPath = SegmentPath(path, scan.endSegment);
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(segmentPath.c_str(), "rb"), std::fclose);
+        if (!file) {
+            break;
+        }
+        LogSegmentHeader header;
+        if (std::fread(&header, sizeof(header), 1, file.get()) != 1
+                || std::memcmp(header.magic, "SCWALOG1", sizeof(header.magic)) != 0 || header.version != 1) {
+            throw std::runtime_error("not a write-ahead log segment: " + segmentPath);
+        }
+        if (header.restarted != 0) {
+            uint64_t first = header.firstSequence;
+            records.erase(std::remove_if(records.begin(), records.end(),
+                                         [first](const Record& record) { return record.sequence >= first; }),
+                          records.end());
+        }
+        file.reset();
+        uint64_t maxSequence = 0;
+        ReadSegment(segmentPath, records, maxSequence);
+        scan.maxSequences.push_back(maxSequence);
+    }
+
+    std::sort(records.begin(), records.end(), [](const Record& left, const Record& right) {
+        return left.sequence < right.sequence;
+    });
+    uint64_t expected = scan.baseSequence + 1;
+    for (auto it = records.begin(); it != records.end(); ++it) {
+        if (it->sequence < expected) {
+            continue; // already in the base
+        }
+        if (it->sequence != expected) {
+            break;
+        }
+        scan.records.push_back(std::move(*it));
+        ++expected;
+    }
+    return scan;
+}
+
+// Reads the records of a segment up to its end or a torn record
+inline void CWriteAheadLog::ReadSegment(const std::string& path, std::vector<Record>& records, uint64_t& maxSequence)
+{
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "rb"), std::fclose);
+    if (!file || std::fseek(file.get(), 0, SEEK_END) != 0) {
+        throw std::runtime_error("cannot read write-ahead log segment " + path);
+    }
+    long remaining = std::ftell(file.get()) - static_cast<long>(sizeof(LogSegmentHeader));
+    std::fseek(file.get(), sizeof(LogSegmentHeader), SEEK_SET);
+    LogRecordHeader header;
+    while (remaining >= static_cast<long>(sizeof(header)) && std::fread(&header, sizeof(header), 1, file.get()) == 1) {
+        remaining -= sizeof(header);
+        if (header.size > static_cast<unsigned long>(remaining) || header.kind > static_cast<uint32_t>(LogRecordKind::Transaction)) {
+            break;
+        }
+        Record record;
+        record.sequence = header.sequence;
+        record.kind = static_cast<LogRecordKind>(header.kind);
+        record.body.resize(header.size);
+        if ((header.size != 0 && std::fread(&record.body[0], header.size, 1, file.get()) != 1)
+                || SnapshotChecksum(record.body.data(), record.body.size()) != header.checksum) {
+            break;
+        }
+        remaining -= header.size;
+        maxSequence = std::max(maxSequence, record.sequence);
+        records.push_back(std::move(record));
+    }
+}
+
+inline void CWriteAheadLog::OpenSegment(bool restarted)
+{
+    std::string path = SegmentPath(m_path, m_segment);
+    m_segmentSize = 0;
+    m_file = std::fopen(path.c_str(), "wb");
+    if (m_file == nullptr) {
+        throw std::runtime_error("cannot create write-ahead log segment " + path);
+    }
+    LogSegmentHeader header;
+    std::memcpy(header.magic, "SCWALOG1", sizeof(header.magic));
+    header.version = 1;
+    header.restarted = restarted ? 1 : 0;
+    header.firstSequence = m_nextSequence.load();
+    if (std::fwrite(&header, sizeof(header), 1, m_file) != 1 || std::fflush(m_file) != 0) {
+        // a segment without its header would stop every later scan
+        std::fclose(m_file);
+        m_file = nullptr;
+        std::remove(path.c_str());
+        throw std::runtime_error("cannot create write-ahead log segment " + path);
+    }
+    m_segmentSize = sizeof(header);
+}
+
+// Cuts what a failed commit left of its batch off the segment, the retry writes the batch whole after the last good one
+inline void CWriteAheadLog::RewindSegment()
+{
+    if (m_segmentSize == 0) {
+        OpenSegment(false);
+        return;
+    }
+    std::string path = SegmentPath(m_path, m_segment);
+#if defined(_WIN32)
+    int descriptor = _open(path.c_str(), _O_RDWR | _O_BINARY);
+    bool truncated = descriptor != -1 && _chsize_s(descriptor, m_segmentSize) == 0;
+    if (descriptor != -1) {
+        _close(descriptor);
+    }
+#else
+    bool truncated = truncate(path.c_str(), m_segmentSize) == 0;
+#endif
+    if (!truncated) {
+        throw std::runtime_error("cannot rewind write-ahead log segment " + path);
+    }
+    m_file = std::fopen(path.c_str(), "r+b");
+    if (m_file == nullptr || std::fseek(m_file, 0, SEEK_END) != 0) {
+        if (m_file != nullptr) {
+            std::fclose(m_file);
+            m_file = nullptr;
+        }
+        throw std::runtime_error("cannot reopen write-ahead log segment " + path);
+    }
+}
+
+inline void CWriteAheadLog::CommitLoop()
+{
+    std::unique_lock<std::mutex> lock(m_commitMutex);
+    bool stopping = false;
+    while (!stopping) {
+        m_commitWakeUp.wait_for(lock, m_options.commitInterval, [this]() { return m_stopping || m_syncRequested; });
+        m_syncRequested = false;
+        stopping = m_stopping; // one more commit for what was buffered before the stop
+        lock.unlock();
+        std::string failure;
+        try {
+            Commit();
+        } catch (const std::exception &error) {
+            failure = error.what();
+        }
+        lock.lock();
+        m_failure = failure;
+        ++m_commits;
+        m_durableChanged.notify_all();
+    }
+}
+
+inline void CWriteAheadLog::CheckpointLoop()
+{
+    std::unique_lock<std::mutex> lock(m_commitMutex);
+    while (!m_commitWakeUp.wait_for(lock, m_options.checkpointInterval, [this]() { return m_stopping; })) {
+        lock.unlock();
+        try {
+            Checkpoint();
+        } catch (const std::exception &) {
+            // the log keeps growing, the next checkpoint tries again
+        }
+        lock.lock();
+    }
+}
+
+/*
+ * A batch that fails to write or sync stays for the next commit and the
+ * failure is thrown, Durable stops advancing meanwhile. The segment is closed
+ * with whatever part of the batch reached it, and the next commit cuts that
+ * part off before writing the batch again, so no torn record ends up between
+ * the records of a segment.
+ */
+inline void CWriteAheadLog::Commit()
+{
+    std::unique_lock<std::mutex> fileLock(m_fileMutex);
+    for (size_t i = 0; i < std::max<size_t>(m_options.shards, 1); ++i) {
+        Shard& shard = m_shards[i];
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        m_batch.append(shard.buffer);
+        m_batchSequences.insert(m_batchSequences.end(), shard.sequences.begin(), shard.sequences.end());
+        shard.buffer.clear();
+        shard.sequences.clear();
+    }
+    if (m_batch.empty()) {
+        return;
+    }
+    if (m_file == nullptr) {
+        RewindSegment();
+    }
+    bool written = std::fwrite(m_batch.data(), m_batch.size(), 1, m_file) == 1 && std::fflush(m_file) == 0;
+    if (written && m_options.syncToDisk) {
+#if defined(_WIN32)
+        written = _commit(_fileno(m_file)) == 0;
+#else
+        written = fsync(fileno(m_file)) == 0;
+#endif
+    }
+    if (!written) {
+        std::fclose(m_file);
+        m_file = nullptr;
+        throw std::runtime_error("cannot write write-ahead log segment " + SegmentPath(m_path, m_segment));
+    }
+    m_segmentSize += static_cast<long>(m_batch.size());
+
+    // durable moves over the sequences that are now contiguous
+    uint64_t durable = m_durable.load(std::memory_order_relaxed);
+    for (auto it = m_batchSequences.begin(); it != m_batchSequences.end(); ++it) {
+        m_committed.push_back(*it);
+        std::push_heap(m_committed.begin(), m_committed.end(), std::greater<uint64_t>());
+    }
+    m_batch.clear();
+    m_batchSequences.clear();
+    while (!m_committed.empty() && m_committed.front() == durable + 1) {
+        std::pop_heap(m_committed.begin(), m_committed.end(), std::greater<uint64_t>());
+        m_committed.pop_back();
+        ++durable;
+    }
+    m_durable.store(durable, std::memory_order_release);
+}
+
+/*
+ * Writes the new base through a temporary file: the blocks of the old base
+ * merged with changes, or only the changes once a Clear was folded.
+ */
+inline void CWriteAheadLog::WriteBase(const std::map<int, std::string>& changes, bool cleared, const SnapshotLogPosition& position)
+{
+    const std::string basePath = BasePath(m_path);
+    const std::string temporary = basePath + ".tmp";
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> previous(cleared ? nullptr : std::fopen(basePath.c_str(), "rb"), std::fclose);
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(temporary.c_str(), "wb"), std::fclose);
+    if (!file) {
+        throw std::runtime_error("cannot create write-ahead log base " + temporary);
+    }
+    try {
+        auto write = [&file, &temporary](const void* data, size_t size) {
+            if (size != 0 && std::fwrite(data, size, 1, file.get()) != 1) {
+                throw std::runtime_error("cannot write write-ahead log base " + temporary);
+            }
+        };
+        SnapshotFileHeader header;
+        std::memcpy(header.magic, "SCSNAP01", sizeof(header.magic));
+        header.version = 2;
+        header.reserved = 0;
+        write(&header, sizeof(header));
+        write(&position, sizeof(position));
+
+        std::vector<SnapshotBlockIndex> index;
+        uint64_t offset = sizeof(header) + sizeof(position);
+        std::string block;
+        uint32_t count = 0;
+        auto writeBlock = [&]() {
+            if (count == 0) {
+                return;
+            }
+            SnapshotBlockIndex entry;
+            std::memcpy(&block[0], &count, sizeof(count));
+            std::memcpy(&entry.firstId, block.data() + sizeof(count), sizeof(entry.firstId));
+            entry.offset = offset;
+            entry.size = block.size();
+            entry.checksum = SnapshotChecksum(block.data(), block.size());
+            entry.entries = count;
+            write(block.data(), block.size());
+            index.push_back(entry);
+            offset += block.size();
+            count = 0;
+        };
+        auto add = [&](const char* entry, size_t size) {
+            if (count == 0) {
+                block.assign(sizeof(count), '\0');
+            }
+            block.append(entry, size);
+            if (++count == m_options.entriesPerBlock) {
+                writeBlock();
+            }
+        };
+        auto change = changes.begin();
+        auto addChange = [&]() {
+            if (!change->second.empty()) {
+                add(change->second.data(), change->second.size());
+            }
+            ++change;
+        };
+
+        std::vector<SnapshotBlockIndex> previousIndex;
+        if (previous) {
+            previousIndex = SnapshotReadIndex(previous.get(), basePath, nullptr);
+        }
+        std::string previousBlock;
+        for (size_t i = 0; i < previousIndex.size(); ++i) {
+            // a block takes the changes up to the next block's first id
+            auto changesEnd = i + 1 < previousIndex.size() ? changes.lower_bound(previousIndex[i + 1].firstId) : changes.end();
+            SnapshotReadBlock(previous.get(), basePath, previousIndex[i], previousBlock);
+            if (SnapshotChecksum(previousBlock.data(), previousBlock.size()) != previousIndex[i].checksum) {
+                throw std::runtime_error("write-ahead log base is damaged: " + basePath);
+            }
+            if (change == changesEnd) {
+                writeBlock();
+                SnapshotBlockIndex entry = previousIndex[i];
+                entry.offset = offset;
+                write(previousBlock.data(), previousBlock.size());
+                index.push_back(entry);
+                offset += previousBlock.size();
+                continue;
+            }
+            size_t position = sizeof(uint32_t);
+            while (position < previousBlock.size()) {
+                size_t size = SnapshotEntrySize(previousBlock.data() + position, previousBlock.size() - position);
+                int32_t id = 0;
+                std::memcpy(&id, previousBlock.data() + position, sizeof(id));
+                while (change != changesEnd && change->first < id) {
+                    addChange();
+                }
+                if (change != changesEnd && change->first == id) {
+                    addChange();
+                } else {
+                    add(previousBlock.data() + position, size);
+                }
+                position += size;
+            }
+            while (change != changesEnd) {
+                addChange();
+            }
+        }
+        while (change != changes.end()) {
+            addChange();
+        }
+        writeBlock();
+
+        SnapshotFooter footer;
+        footer.indexOffset = offset;
+        footer.blockCount = index.size();
+        std::memcpy(footer.magic, "SCSNAPIX", sizeof(footer.magic));
+        write(index.data(), index.size() * sizeof(SnapshotBlockIndex));
+        write(&footer, sizeof(footer));
+        if (std::fflush(file.get()) != 0) {
+            throw std::runtime_error("cannot write write-ahead log base " + temporary);
+        }
+        if (m_options.syncToDisk) {
+#if defined(_WIN32)
+            _commit(_fileno(file.get()));
+#else
+            fsync(fileno(file.get()));
+#endif
+        }
+        if (std::fclose(file.release()) != 0) {
+            throw std::runtime_error("cannot write write-ahead log base " + temporary);
+        }
+        previous.reset();
+        SnapshotReplaceFile(temporary, basePath);
+    } catch (...) {
+        file.reset();
+        std::remove(temporary.c_str());
+        throw;
+    }
+}
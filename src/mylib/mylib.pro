@@ -9,4 +9,23 @@ SOURCES += \
 
 HEADERS += \
     SomeContainer.h \
-    SomeContainerIterator.h
+    SomeContainerIterator.h \
+    WorkerPool.h \
+    AdaptiveMutex.h \
+    SpscRing.h \
+    ShardedContainer.h \
+    ContainerStats.h \
+    LockWatchdog.h \
+    OperationRecorder.h \
+    AllocationTracker.h \
+    MemoryUsage.h \
+    SpanTracer.h \
+    Snapshot.h \
+    FrozenContainer.h \
+    WriteAheadLog.h \
+    ForkSnapshot.h \
+    SharedContainer.h \
+    ChangeFeed.h \
+    VersionIndex.h \
+    VersionedContainer.h \
+    Transaction.h
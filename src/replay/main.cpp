@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include "SomeContainer.h"
+#include "BenchHarness.h"
+
+/*
+ * Replays a trace recorded with CSomeContainer::StartRecording against a
+ * container configuration. Every recorded thread gets its own replay thread
+ * and keeps its own order; iterator dereferences are replayed as Query.
+ *
+ *   --trace file                trace to replay (required)
+ *   --timing original|fast      keep the recorded inter-arrival times, or run flat out (default)
+ *   --config mutex|adaptive|combining
+ *   --compare mutex|adaptive|combining   replay again on a second configuration and report the difference
+ *   --prefill N                 register ids 0..N-1 first, for traces taken from a populated container
+ *   --output file.json
+ */
+
+struct ReplayResult {
+    std::string config;
+    double seconds;
+    uint64_t operations;
+    std::vector<HistogramSnapshot> latencies;
+};
+
+template<typename LockPolicy>
+ReplayResult replay(const std::vector<std::vector<TraceRecord> >& threads, WriteMode writeMode, bool originalTiming, int prefill) {
+    CSomeContainer<int, LockPolicy> container;
+    container.SetWriteMode(writeMode);
+    for (int i = 0; i < prefill; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+
+    std::vector<CLatencyHistograms> latencies(threads.size(), CLatencyHistograms(ContainerOperationCount));
+    std::atomic<uint64_t> operations(0);
+    std::atomic<uint64_t> start(0);
+    ReplayResult result;
+    result.seconds = RunThreads(static_cast<int>(threads.size()), [&](int thread) {
+        // the first thread through fixes time zero of the replay
+        uint64_t base = 0;
+        start.compare_exchange_strong(base, MonotonicNanoseconds());
+        base = start.load();
+        const std::vector<TraceRecord>& records = threads[thread];
+        for (auto it = records.begin(); it != records.end(); ++it) {
+            if (originalTiming) {
+                uint64_t due = base + it->timestamp;
+                for (uint64_t now = MonotonicNanoseconds(); now < due; now = MonotonicNanoseconds()) {
+                    if (due - now > 100000) {
+                        std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - 50000));
+                    }
+                }
+            }
+            uint64_t begin = MonotonicNanoseconds();
+            ContainerOperation operation = static_cast<ContainerOperation>(it->operation);
+            switch (operation) {
+            case ContainerOperation::Register:
+                container.Register(it->objectId, std::auto_ptr<int>(new int(it->objectId)));
+                break;
+            case ContainerOperation::Unregister:
+                container.Unregister(it->objectId);
+                break;
+            case ContainerOperation::Query:
+            case ContainerOperation::IteratorDereference:
+                try {
+                    container.Query(it->objectId);
+                } catch (const std::out_of_range&) {
+                }
+                break;
+            }
+            latencies[thread].Record(it->operation, MonotonicNanoseconds() - begin);
+        }
+        operations += records.size();
+    });
+    result.operations = operations.load();
+    result.latencies = CLatencyHistograms::Merge(latencies);
+    return result;
+}
+
+ReplayResult replayConfigured(const std::string& config, const std::vector<std::vector<TraceRecord> >& threads,
+                              bool originalTiming, int prefill) {
+    ReplayResult result;
+    if (config == "adaptive") {
+        result = replay<CAdaptiveMutex>(threads, WriteMode::Locking, originalTiming, prefill);
+    } else if (config == "combining") {
+        result = replay<std::mutex>(threads, WriteMode::FlatCombining, originalTiming, prefill);
+    } else {
+        result = replay<std::mutex>(threads, WriteMode::Locking, originalTiming, prefill);
+    }
+    result.config = config;
+    return result;
+}
+
+void writeResult(CJsonWriter& json, const ReplayResult& result) {
+    json.BeginObject();
+    json.Key("config").String(result.config);
+    json.Key("seconds").Number(result.seconds);
+    json.Key("ops_per_second").Number(result.operations / result.seconds);
+    json.Key("operations").BeginObject();
+    for (size_t operation = 0; operation < ContainerOperationCount; ++operation) {
+        const HistogramSnapshot& latency = result.latencies[operation];
+        json.Key(ToString(static_cast<ContainerOperation>(operation))).BeginObject();
+        json.Key("count").Integer(static_cast<long long>(latency.count));
+        json.Key("p50_ns").Integer(static_cast<long long>(latency.p50));
+        json.Key("p99_ns").Integer(static_cast<long long>(latency.p99));
+        json.Key("p999_ns").Integer(static_cast<long long>(latency.p999));
+        json.EndObject();
+    }
+    json.EndObject();
+    json.EndObject();
+}
+
+void printResult(const ReplayResult& result) {
+    std::fprintf(stderr, "%-10s %12.0f ops/s over %.3f s\n", result.config.c_str(), result.operations / result.seconds, result.seconds);
+    for (size_t operation = 0; operation < ContainerOperationCount; ++operation) {
+        const HistogramSnapshot& latency = result.latencies[operation];
+        if (latency.count != 0) {
+            std::fprintf(stderr, "  %-20s p50 %8llu ns  p99 %10llu ns  p99.9 %10llu ns\n",
+                         ToString(static_cast<ContainerOperation>(operation)), static_cast<unsigned long long>(latency.p50),
+                         static_cast<unsigned long long>(latency.p99), static_cast<unsigned long long>(latency.p999));
+        }
+    }
+}
+
+double percentChange(double before, double after) {
+    return before == 0 ? 0 : (after - before) * 100.0 / before;
+}
+
+int main(int argc, char* argv[]) {
+    CCommandLine options(argc, argv);
+    std::string trace = options.Get("--trace", "");
+    if (trace.empty()) {
+        std::fprintf(stderr, "usage: replay --trace file [--timing original|fast] [--config c] [--compare c] [--prefill N]\n");
+        return 2;
+    }
+    bool originalTiming = options.Get("--timing", "fast") == "original";
+    int prefill = static_cast<int>(options.GetInt("--prefill", 0));
+
+    std::vector<TraceRecord> records = ReadTrace(trace);
+    std::map<uint16_t, std::vector<TraceRecord> > byThread;
+    for (auto it = records.begin(); it != records.end(); ++it) {
+        byThread[it->thread].push_back(*it);
+    }
+    std::vector<std::vector<TraceRecord> > threads;
+    for (auto it = byThread.begin(); it != byThread.end(); ++it) {
+        std::stable_sort(it->second.begin(), it->second.end(), [](const TraceRecord& left, const TraceRecord& right) {
+            return left.timestamp < right.timestamp;
+        });
+        threads.push_back(it->second);
+    }
+    std::fprintf(stderr, "%zu operations from %zu threads\n", records.size(), threads.size());
+
+    std::vector<ReplayResult> results;
+    results.push_back(replayConfigured(options.Get("--config", "mutex"), threads, originalTiming, prefill));
+    if (options.Has("--compare")) {
+        results.push_back(replayConfigured(options.Get("--compare", "mutex"), threads, originalTiming, prefill));
+    }
+    for (auto it = results.begin(); it != results.end(); ++it) {
+        printResult(*it);
+    }
+
+    std::string output = options.Get("--output", "");
+    std::ofstream file;
+    if (!output.empty()) {
+        file.open(output.c_str());
+    }
+    std::ostream& out = output.empty() ? std::cout : file;
+    CJsonWriter json(out);
+    json.BeginObject();
+    json.Key("schema").Integer(1);
+    WriteBuildInfo(json);
+    json.Key("trace").String(trace);
+    json.Key("timing").String(originalTiming ? "original" : "fast");
+    json.Key("runs").BeginArray();
+    for (auto it = results.begin(); it != results.end(); ++it) {
+        writeResult(json, *it);
+    }
+    json.EndArray();
+    if (results.size() == 2) {
+        const ReplayResult& base = results[0];
+        const ReplayResult& candidate = results[1];
+        double throughputChange = percentChange(base.operations / base.seconds, candidate.operations / candidate.seconds);
+        std::fprintf(stderr, "%s vs %s: throughput %+.1f%%\n", candidate.config.c_str(), base.config.c_str(), throughputChange);
+        json.Key("difference").BeginObject();
+        json.Key("throughput_percent").Number(throughputChange);
+        for (size_t operation = 0; operation < ContainerOperationCount; ++operation) {
+            if (base.latencies[operation].count == 0) {
+                continue;
+            }
+            double p50 = percentChange(base.latencies[operation].p50, candidate.latencies[operation].p50);
+            double p99 = percentChange(base.latencies[operation].p99, candidate.latencies[operation].p99);
+            std::fprintf(stderr, "  %-20s p50 %+.1f%%  p99 %+.1f%%\n", ToString(static_cast<ContainerOperation>(operation)), p50, p99);
+            json.Key(ToString(static_cast<ContainerOperation>(operation))).BeginObject();
+            json.Key("p50_percent").Number(p50);
+            json.Key("p99_percent").Number(p99);
+            json.EndObject();
+        }
+        json.EndObject();
+    }
+    json.EndObject();
+    out << "\n";
+    return 0;
+}
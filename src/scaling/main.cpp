@@ -0,0 +1,201 @@
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include "SomeContainer.h"
+#include "BenchHarness.h"
+
+/*
+ * Thread-scaling regression check for CSomeContainer. Runs one fixed workload
+ * (random Query/Register/Unregister over a prefilled key space, a fixed number
+ * of operations per thread) at every thread count and keeps the median
+ * throughput of the repetitions.
+ *
+ *   --threads 1,2,4             default powers of two up to the hardware threads
+ *   --operations N              operations per thread (default 200000)
+ *   --keys N                    key space, fully prefilled (default 10000)
+ *   --read-percent N            the rest is split evenly between Register and Unregister (default 90)
+ *   --repetitions N             default 5
+ *   --config mutex|adaptive|combining
+ *   --save-baseline file.json   store the results as the new baseline
+ *   --baseline file.json        compare against a stored baseline
+ *   --max-regression P          fail when throughput drops by more than P percent (default 10)
+ *   --output file.json          results of this run, stdout by default
+ *
+ * Exit code 0 when within bounds, 1 on a regression, 2 when the baseline is
+ * unusable (missing, unreadable or taken with a different workload).
+ */
+
+struct Workload {
+    long long operations;
+    int keys;
+    int readPercent;
+    int repetitions;
+    std::string config;
+};
+
+struct ScalingPoint {
+    int threads;
+    double opsPerSecond;
+    std::vector<double> seconds;
+};
+
+template<typename LockPolicy>
+double runOnce(const Workload& workload, WriteMode writeMode, int threads) {
+    CSomeContainer<int, LockPolicy> container;
+    container.SetWriteMode(writeMode);
+    for (int i = 0; i < workload.keys; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    const int writeHalf = workload.readPercent + (100 - workload.readPercent) / 2;
+    return RunThreads(threads, [&](int thread) {
+        std::minstd_rand random(thread + 1);
+        for (long long i = 0; i < workload.operations; ++i) {
+            int id = static_cast<int>(random() % workload.keys);
+            int pick = static_cast<int>(random() % 100);
+            if (pick < workload.readPercent) {
+                try {
+                    container.Query(id);
+                } catch (const std::out_of_range&) {
+                }
+            } else if (pick < writeHalf) {
+                container.Register(id, std::auto_ptr<int>(new int(id)));
+            } else {
+                container.Unregister(id);
+            }
+        }
+    });
+}
+
+double runConfigured(const Workload& workload, int threads) {
+    if (workload.config == "adaptive") {
+        return runOnce<CAdaptiveMutex>(workload, WriteMode::Locking, threads);
+    } else if (workload.config == "combining") {
+        return runOnce<std::mutex>(workload, WriteMode::FlatCombining, threads);
+    } else if (workload.config == "mutex") {
+        return runOnce<std::mutex>(workload, WriteMode::Locking, threads);
+    }
+    throw std::invalid_argument("unknown config: " + workload.config);
+}
+
+void writeResults(std::ostream& out, const Workload& workload, const std::vector<ScalingPoint>& points) {
+    CJsonWriter json(out);
+    json.BeginObject();
+    json.Key("schema").Integer(1);
+    WriteBuildInfo(json);
+    json.Key("workload").BeginObject();
+    json.Key("operations_per_thread").Integer(workload.operations);
+    json.Key("keys").Integer(workload.keys);
+    json.Key("read_percent").Integer(workload.readPercent);
+    json.Key("repetitions").Integer(workload.repetitions);
+    json.Key("config").String(workload.config);
+    json.EndObject();
+    json.Key("results").BeginArray();
+    for (auto it = points.begin(); it != points.end(); ++it) {
+        json.BeginObject();
+        json.Key("threads").Integer(it->threads);
+        json.Key("ops_per_second").Number(it->opsPerSecond);
+        json.Key("seconds").BeginArray();
+        for (auto seconds = it->seconds.begin(); seconds != it->seconds.end(); ++seconds) {
+            json.Number(*seconds);
+        }
+        json.EndArray();
+        json.EndObject();
+    }
+    json.EndArray();
+    json.EndObject();
+    out << "\n";
+}
+
+// Returns the number of regressed thread counts; throws std::runtime_error when the baseline cannot be used
+int compareWithBaseline(const std::string& path, const Workload& workload, const std::vector<ScalingPoint>& points,
+                        double maxRegression) {
+    std::ifstream file(path.c_str());
+    if (!file) {
+        throw std::runtime_error("cannot open baseline " + path);
+    }
+    CJsonValue baseline = CJsonValue::Parse(file);
+    const CJsonValue& stored = baseline["workload"];
+    if (stored["operations_per_thread"].AsNumber() != workload.operations || stored["keys"].AsNumber() != workload.keys
+            || stored["read_percent"].AsNumber() != workload.readPercent || stored["config"].AsString() != workload.config) {
+        throw std::runtime_error("baseline " + path + " was taken with a different workload");
+    }
+    if (baseline["build"]["hardware_threads"].AsNumber() != HardwareThreads()) {
+        std::fprintf(stderr, "warning: baseline was taken on %d hardware threads, this machine has %d\n",
+                     static_cast<int>(baseline["build"]["hardware_threads"].AsNumber()), HardwareThreads());
+    }
+
+    std::map<int, double> expected;
+    const std::vector<CJsonValue>& results = baseline["results"].Items();
+    for (auto it = results.begin(); it != results.end(); ++it) {
+        expected[static_cast<int>((*it)["threads"].AsNumber())] = (*it)["ops_per_second"].AsNumber();
+    }
+
+    int regressions = 0;
+    std::fprintf(stderr, "%8s %16s %16s %9s\n", "threads", "baseline ops/s", "current ops/s", "change");
+    for (auto it = points.begin(); it != points.end(); ++it) {
+        auto reference = expected.find(it->threads);
+        if (reference == expected.end()) {
+            std::fprintf(stderr, "%8d %16s %16.0f %9s\n", it->threads, "-", it->opsPerSecond, "new");
+            continue;
+        }
+        double change = (it->opsPerSecond - reference->second) * 100.0 / reference->second;
+        bool regressed = change < -maxRegression;
+        regressions += regressed ? 1 : 0;
+        std::fprintf(stderr, "%8d %16.0f %16.0f %+8.1f%%%s\n", it->threads, reference->second, it->opsPerSecond, change,
+                     regressed ? "  REGRESSION" : "");
+    }
+    if (regressions != 0) {
+        std::fprintf(stderr, "FAILED: throughput dropped by more than %.1f%% at %d thread count(s)\n", maxRegression, regressions);
+    } else {
+        std::fprintf(stderr, "OK: no thread count dropped by more than %.1f%%\n", maxRegression);
+    }
+    return regressions;
+}
+
+int main(int argc, char* argv[]) {
+    CCommandLine options(argc, argv);
+    Workload workload;
+    workload.operations = options.GetInt("--operations", 200000);
+    workload.keys = static_cast<int>(options.GetInt("--keys", 10000));
+    workload.readPercent = static_cast<int>(options.GetInt("--read-percent", 90));
+    workload.repetitions = static_cast<int>(std::max(1ll, options.GetInt("--repetitions", 5)));
+    workload.config = options.Get("--config", "mutex");
+    std::vector<long long> threadCounts = options.GetList("--threads", PowerOfTwoThreadCounts());
+
+    std::vector<ScalingPoint> points;
+    for (auto threads = threadCounts.begin(); threads != threadCounts.end(); ++threads) {
+        ScalingPoint point;
+        point.threads = static_cast<int>(*threads);
+        for (int repetition = 0; repetition < workload.repetitions; ++repetition) {
+            point.seconds.push_back(runConfigured(workload, point.threads));
+        }
+        point.opsPerSecond = workload.operations * point.threads / Median(point.seconds);
+        std::fprintf(stderr, "%4d threads %14.0f ops/s\n", point.threads, point.opsPerSecond);
+        points.push_back(point);
+    }
+
+    std::string output = options.Get("--output", "");
+    if (output.empty()) {
+        writeResults(std::cout, workload, points);
+    } else {
+        std::ofstream file(output.c_str());
+        writeResults(file, workload, points);
+    }
+    std::string saveBaseline = options.Get("--save-baseline", "");
+    if (!saveBaseline.empty()) {
+        std::ofstream file(saveBaseline.c_str());
+        writeResults(file, workload, points);
+    }
+
+    std::string baseline = options.Get("--baseline", "");
+    if (baseline.empty()) {
+        return 0;
+    }
+    try {
+        return compareWithBaseline(baseline, workload, points, options.GetDouble("--max-regression", 10)) == 0 ? 0 : 1;
+    } catch (const std::runtime_error& error) {
+        std::fprintf(stderr, "FAILED: %s\n", error.what());
+        return 2;
+    }
+}
@@ -3,7 +3,15 @@ TEMPLATE = subdirs
 SUBDIRS += \
     demo \
     test \
+    bench \
+    loadgen \
+    replay \
+    scaling \
     mylib
 
 demo.depends = mylib
 test.depends = mylib
+bench.depends = mylib
+loadgen.depends = mylib
+replay.depends = mylib
+scaling.depends = mylib
@@ -1,7 +1,21 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <set>
+#include <fstream>
+#include <sstream>
 #include <thread>
 #include "SomeContainer.h"
+#include "ShardedContainer.h"
+#include "SharedContainer.h"
+#include "VersionedContainer.h"
+#include "Transaction.h"
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#endif
+#if defined(__linux__)
+#include <csignal>
+#include <sys/resource.h>
+#endif
 
 /*
  * SomeContainer:
@@ -45,7 +59,8 @@ public:
     }
 };
 
-IObjectDestructable* RegisterDestructableObject(CSomeContainer<IObjectDestructable>& someContainer, int index) {
+template<typename Container>
+IObjectDestructable* RegisterDestructableObject(Container& someContainer, int index) {
     MockIObjectDestructable* storedObject = new MockIObjectDestructable;
     EXPECT_CALL(*storedObject, Die());
     std::auto_ptr<IObjectDestructable> storedObjectPtr(storedObject);
@@ -200,3 +215,1343 @@ TEST(SomeContainerIterator, IteratorReturnsEndValue) {
 TEST(SomeContainerIterator, ShouldNotBlockAccessToContainer) {
     
 }
+
+std::auto_ptr<int> ConstructSlowly(int value, int milliseconds) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+    return std::auto_ptr<int>(new int(value));
+}
+
+TEST(SomeContainerAsync, RegisterAsyncPublishesObject) {
+    CSomeContainer<int> container(std::make_shared<CWorkerPool>(2));
+    std::future<void> done = container.RegisterAsync(0, std::bind(ConstructSlowly, 7, 0));
+    done.get();
+    EXPECT_EQ(7, *container.Query(0));
+}
+
+TEST(SomeContainerAsync, QueryMissesPendingObject) {
+    CSomeContainer<int> container(std::make_shared<CWorkerPool>(1));
+    std::future<void> done = container.RegisterAsync(0, std::bind(ConstructSlowly, 7, 500));
+    EXPECT_THROW(container.Query(0, PendingPolicy::Miss), std::out_of_range);
+    done.get();
+}
+
+TEST(SomeContainerAsync, QueryWaitsForPendingObject) {
+    CSomeContainer<int> container(std::make_shared<CWorkerPool>(1));
+    container.RegisterAsync(0, std::bind(ConstructSlowly, 7, 200));
+    EXPECT_EQ(7, *container.Query(0, PendingPolicy::Wait));
+}
+
+TEST(SomeContainerAsync, FactoryExceptionIsReportedThroughFuture) {
+    CSomeContainer<int> container(std::make_shared<CWorkerPool>(1));
+    std::future<void> done = container.RegisterAsync(0, []() -> std::auto_ptr<int> { throw std::runtime_error("failed"); });
+    EXPECT_THROW(done.get(), std::runtime_error);
+    EXPECT_THROW(container.Query(0, PendingPolicy::Wait), std::out_of_range);
+}
+
+void RegisterDestructableObjects(CSomeContainer<IObjectDestructable>& container, int count) {
+    for (int i = 0; i < count; ++i) {
+        RegisterDestructableObject(container, i);
+    }
+}
+
+TEST(SomeContainerTeardown, ClearDestroysObjectsInline) {
+    CSomeContainer<IObjectDestructable> container;
+    RegisterDestructableObjects(container, 3);
+    container.Clear();
+    EXPECT_EQ(container.Start(), container.End());
+}
+
+TEST(SomeContainerTeardown, ClearDestroysObjectsInParallel) {
+    CSomeContainer<IObjectDestructable> container(std::make_shared<CWorkerPool>(4));
+    RegisterDestructableObjects(container, 10);
+    container.Clear(TeardownMode::Parallel);
+    EXPECT_EQ(container.Start(), container.End());
+}
+
+TEST(SomeContainerTeardown, ClearInBackgroundReturnsBeforeDestruction) {
+    std::shared_ptr<CWorkerPool> workers = std::make_shared<CWorkerPool>(2);
+    CSomeContainer<IObjectDestructable> container(workers);
+    MockIObjectDestructableWithSleep* storedObject = new MockIObjectDestructableWithSleep;
+    EXPECT_CALL(*storedObject, Die()).Times(1);
+    container.Register(0, std::auto_ptr<IObjectDestructable>(storedObject));
+
+    auto start = std::chrono::steady_clock::now();
+    container.Clear(TeardownMode::Background);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+    EXPECT_THROW(container.Query(0), std::out_of_range);
+}
+
+TEST(SomeContainerTeardown, DestructorUsesConfiguredTeardown) {
+    CSomeContainer<IObjectDestructable> container(std::make_shared<CWorkerPool>(4));
+    container.SetTeardown(TeardownMode::Parallel, 2);
+    RegisterDestructableObjects(container, 10);
+}
+
+void CountUnderLock(CAdaptiveMutex& mutex, int& counter, int iterations) {
+    for (int i = 0; i < iterations; ++i) {
+        std::unique_lock<CAdaptiveMutex> lock(mutex);
+        ++counter;
+    }
+}
+
+TEST(AdaptiveMutex, ProvidesMutualExclusion) {
+    CAdaptiveMutex mutex;
+    int counter = 0;
+    const int threadCount = 8;
+    const int iterations = 20000;
+    std::thread t[threadCount];
+    for (int i = 0; i < threadCount; ++i) {
+        t[i] = std::thread(CountUnderLock, std::ref(mutex), std::ref(counter), iterations);
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        t[i].join();
+    }
+    EXPECT_EQ(threadCount * iterations, counter);
+}
+
+TEST(AdaptiveMutex, TryLockFailsWhileHeld) {
+    CAdaptiveMutex mutex;
+    mutex.lock();
+    EXPECT_FALSE(mutex.try_lock());
+    mutex.unlock();
+    EXPECT_TRUE(mutex.try_lock());
+    mutex.unlock();
+}
+
+TEST(AdaptiveMutex, WorksAsContainerLockPolicy) {
+    CSomeContainer<int, CAdaptiveMutex> container;
+    container.Register(0, std::auto_ptr<int>(new int(3)));
+    EXPECT_EQ(3, *container.Query(0));
+    CSomeContainerIterator<int, CAdaptiveMutex> start = container.Start();
+    EXPECT_EQ(3, **start);
+    container.Unregister(0);
+    EXPECT_THROW(container.Query(0), std::out_of_range);
+}
+
+void RegisterRange(CSomeContainer<int>& container, int start, int count) {
+    for (int i = start; i < start + count; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+}
+
+void UnregisterRange(CSomeContainer<int>& container, int start, int count) {
+    for (int i = start; i < start + count; ++i) {
+        container.Unregister(i);
+    }
+}
+
+TEST(SomeContainerFlatCombining, AppliesConcurrentWrites) {
+    CSomeContainer<int> container;
+    container.SetWriteMode(WriteMode::FlatCombining);
+    const int threadCount = 8;
+    const int count = 500;
+    std::thread t[threadCount];
+    for (int i = 0; i < threadCount; ++i) {
+        t[i] = std::thread(RegisterRange, std::ref(container), i * count, count);
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        t[i].join();
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        t[i] = std::thread(UnregisterRange, std::ref(container), i * count, count / 2);
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        t[i].join();
+    }
+    for (int i = 0; i < threadCount * count; ++i) {
+        if (i % count < count / 2) {
+            EXPECT_THROW(container.Query(i), std::out_of_range);
+        } else {
+            EXPECT_EQ(i, *container.Query(i));
+        }
+    }
+}
+
+TEST(SomeContainerFlatCombining, DestroysReplacedObject) {
+    CSomeContainer<IObjectDestructable> container;
+    container.SetWriteMode(WriteMode::FlatCombining);
+    RegisterDestructableObject(container, 0);
+    IObjectDestructable* secondObject = RegisterDestructableObject(container, 0);
+    EXPECT_EQ(secondObject, container.Query(0));
+    container.Unregister(0);
+    EXPECT_THROW(container.Query(0), std::out_of_range);
+}
+
+TEST(ShardedContainer, RegistersQueriesAndUnregisters) {
+    CShardedContainer<int> container(4, false);
+    for (int i = 0; i < 100; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(i, *container.Query(i));
+    }
+    container.Unregister(5);
+    EXPECT_THROW(container.Query(5), std::out_of_range);
+}
+
+TEST(ShardedContainer, DestroysReplacedAndRemainingObjects) {
+    CShardedContainer<IObjectDestructable> container(2, false);
+    RegisterDestructableObject(container, 0);
+    IObjectDestructable* secondObject = RegisterDestructableObject(container, 0);
+    EXPECT_EQ(secondObject, container.Query(0));
+    RegisterDestructableObject(container, 1);
+}
+
+TEST(ShardedContainer, QueryBatchReturnsNullForMissingIds) {
+    CShardedContainer<int> container(3, false);
+    container.Register(1, std::auto_ptr<int>(new int(10)));
+    container.Register(2, std::auto_ptr<int>(new int(20)));
+    int ids[] = { 1, 2, 3 };
+    int* results[3];
+    container.QueryBatch(ids, 3, results);
+    EXPECT_EQ(10, *results[0]);
+    EXPECT_EQ(20, *results[1]);
+    EXPECT_EQ(nullptr, results[2]);
+}
+
+TEST(ShardedContainer, IteratesInIdOrder) {
+    CShardedContainer<int> container(4, false);
+    for (int i = 9; i >= 0; --i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    int expected = 0;
+    for (auto it = container.Start(); !(it == container.End()); ++it) {
+        EXPECT_EQ(expected++, **it);
+    }
+    EXPECT_EQ(10, expected);
+}
+
+TEST(ShardedContainer, ServesConcurrentClients) {
+    CShardedContainer<int> container(2, false);
+    const int threadCount = 4;
+    std::thread t[threadCount];
+    for (int i = 0; i < threadCount; ++i) {
+        t[i] = std::thread([&container, i]() {
+            for (int id = i * 100; id < (i + 1) * 100; ++id) {
+                container.Register(id, std::auto_ptr<int>(new int(id)));
+                EXPECT_EQ(id, *container.Query(id));
+            }
+        });
+    }
+    for (int i = 0; i < threadCount; ++i) {
+        t[i].join();
+    }
+    EXPECT_EQ(350, *container.Query(350));
+}
+
+TEST(ShardedContainer, WakesParkedWorkers) {
+    CShardedContainer<int> container(2, false);
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+    for (int i = 0; i < 5; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20)); // long enough for the idle workers to park
+        container.Register(i + 2, std::auto_ptr<int>(new int(i)));
+        EXPECT_EQ(i, *container.Query(i + 2));
+    }
+}
+
+TEST(ShardedContainer, ReusesRingsOfExitedThreads) {
+    CShardedContainer<int> container(2, false);
+    // more threads than MaxClients, one at a time
+    for (int i = 0; i < 1500; ++i) {
+        std::thread([&container, i]() {
+            container.Register(i, std::auto_ptr<int>(new int(i)));
+        }).join();
+    }
+    EXPECT_EQ(1499, *container.Query(1499));
+}
+
+TEST(ContainerStats, BucketsKeepRelativeErrorSmall) {
+    const uint64_t values[] = { 0, 7, 15, 16, 17, 100, 1000, 123456, 987654321 };
+    for (uint64_t value : values) {
+        uint64_t bucketValue = LogLinearBuckets::ValueOf(LogLinearBuckets::IndexOf(value));
+        EXPECT_LE(bucketValue > value ? bucketValue - value : value - bucketValue, value / 16 + 1);
+    }
+}
+
+TEST(ContainerStats, RecordsLockTimesPerOperation) {
+    CSomeContainer<int> container;
+    container.EnableStats();
+    container.Register(0, std::auto_ptr<int>(new int(1)));
+    container.Register(1, std::auto_ptr<int>(new int(2)));
+    container.Query(0);
+    for (auto it = container.Start(); !(it == container.End()); ++it) {
+        *it;
+    }
+    container.Unregister(0);
+
+    ContainerStats stats = container.Stats();
+    EXPECT_EQ(2u, stats[ContainerOperation::Register].wait.count);
+    EXPECT_EQ(2u, stats[ContainerOperation::Register].hold.count);
+    EXPECT_EQ(1u, stats[ContainerOperation::Query].hold.count);
+    EXPECT_EQ(2u, stats[ContainerOperation::IteratorDereference].hold.count);
+    EXPECT_EQ(1u, stats[ContainerOperation::Unregister].hold.count);
+    EXPECT_LE(stats[ContainerOperation::Query].hold.p50, stats[ContainerOperation::Query].hold.p999);
+}
+
+TEST(ContainerStats, IsEmptyUntilEnabled) {
+    CSomeContainer<int> container;
+    container.Register(0, std::auto_ptr<int>(new int(1)));
+    EXPECT_EQ(0u, container.Stats()[ContainerOperation::Register].hold.count);
+}
+
+class SlowDestructor {
+public:
+    ~SlowDestructor() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+};
+
+TEST(LockWatchdog, ReportsSlowDestructorUnderLock) {
+    CSomeContainer<SlowDestructor> container;
+    container.EnableWatchdog(std::chrono::milliseconds(20));
+    container.Register(42, std::auto_ptr<SlowDestructor>(new SlowDestructor));
+    container.Unregister(42);
+
+    std::vector<WatchdogEvent> events = container.WatchdogEvents();
+    ASSERT_FALSE(events.empty());
+    const WatchdogEvent& completed = events.back();
+    EXPECT_FALSE(completed.inProgress);
+    EXPECT_EQ(ContainerOperation::Unregister, completed.operation);
+    EXPECT_EQ(42, completed.objectId);
+    EXPECT_GE(completed.heldNanoseconds, 100000000u);
+    EXPECT_FALSE(completed.stack.empty());
+}
+
+TEST(LockWatchdog, WaitingForPendingObjectIsNotAHold) {
+    CSomeContainer<int> container;
+    container.EnableWatchdog(std::chrono::milliseconds(50));
+    container.EnableStats();
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+    std::future<void> pending = container.RegisterAsync(0, []() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        return std::auto_ptr<int>(new int(7));
+    });
+    std::thread other([&container]() {
+        for (int i = 0; i < 20; ++i) {
+            container.Query(1); // its Exit runs while the waiting Query is between Enter and Exit
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+    EXPECT_EQ(7, *container.Query(0, PendingPolicy::Wait));
+    other.join();
+    pending.wait();
+    EXPECT_TRUE(container.WatchdogEvents().empty());
+    EXPECT_LT(container.Stats()[ContainerOperation::Query].hold.max, 50000000u);
+}
+
+TEST(LockWatchdog, IgnoresShortCriticalSections) {
+    CSomeContainer<int> container;
+    container.EnableWatchdog(std::chrono::milliseconds(50));
+    container.Register(0, std::auto_ptr<int>(new int(1)));
+    container.Query(0);
+    EXPECT_TRUE(container.WatchdogEvents().empty());
+}
+
+TEST(LockWatchdog, RingKeepsNewestEvents) {
+    CLockWatchdog watchdog(std::chrono::nanoseconds(0), 2);
+    for (int i = 0; i < 3; ++i) {
+        watchdog.Enter(ContainerOperation::Query, i);
+        watchdog.Exit();
+    }
+    std::vector<WatchdogEvent> events = watchdog.Events();
+    ASSERT_EQ(2u, events.size());
+    EXPECT_EQ(1, events[0].objectId);
+    EXPECT_EQ(2, events[1].objectId);
+}
+
+TEST(OperationRecorder, RecordsOperationsInOrder) {
+    std::string path = testing::TempDir() + "container.trace";
+    CSomeContainer<int> container;
+    container.Register(0, std::auto_ptr<int>(new int(1)));
+    container.StartRecording(path);
+    container.Register(7, std::auto_ptr<int>(new int(2)));
+    container.Query(7);
+    container.Unregister(7);
+    EXPECT_EQ(0u, container.StopRecording());
+    container.Query(0);
+
+    std::vector<TraceRecord> records = ReadTrace(path);
+    std::remove(path.c_str());
+    ASSERT_EQ(3u, records.size());
+    EXPECT_EQ(static_cast<uint8_t>(ContainerOperation::Register), records[0].operation);
+    EXPECT_EQ(static_cast<uint8_t>(ContainerOperation::Query), records[1].operation);
+    EXPECT_EQ(static_cast<uint8_t>(ContainerOperation::Unregister), records[2].operation);
+    for (auto it = records.begin(); it != records.end(); ++it) {
+        EXPECT_EQ(7, it->objectId);
+        EXPECT_EQ(records[0].thread, it->thread);
+    }
+    EXPECT_LE(records[0].timestamp, records[2].timestamp);
+}
+
+TEST(OperationRecorder, RestartsIntoANewFile) {
+    std::string first = testing::TempDir() + "first.trace";
+    std::string second = testing::TempDir() + "second.trace";
+    CSomeContainer<int> container;
+    container.StartRecording(first);
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+    container.StartRecording(second); // ends the first recording
+    container.Query(1);
+    container.StopRecording();
+    container.Query(1);
+    container.StartRecording(first);
+    container.Unregister(1);
+    container.StopRecording();
+
+    std::vector<TraceRecord> records = ReadTrace(second);
+    ASSERT_EQ(1u, records.size());
+    EXPECT_EQ(static_cast<uint8_t>(ContainerOperation::Query), records[0].operation);
+    records = ReadTrace(first);
+    ASSERT_EQ(1u, records.size());
+    EXPECT_EQ(static_cast<uint8_t>(ContainerOperation::Unregister), records[0].operation);
+    std::remove(first.c_str());
+    std::remove(second.c_str());
+}
+
+TEST(AllocationTracker, CountsContainerAllocationsPerOperation) {
+    CSomeContainer<int> container;
+    container.EnableAllocationTracking();
+    for (int i = 0; i < 3; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    container.Query(1);
+    container.Unregister(2);
+
+    AllocationStats stats = container.Allocations();
+    EXPECT_EQ(3u, stats[ContainerOperation::Register].calls);
+    EXPECT_EQ(3u, stats[ContainerOperation::Register].allocations);
+    EXPECT_GT(stats[ContainerOperation::Register].bytes, 0u);
+    EXPECT_EQ(1u, stats[ContainerOperation::Query].calls);
+    EXPECT_EQ(0u, stats[ContainerOperation::Query].allocations);
+    EXPECT_EQ(1u, stats[ContainerOperation::Unregister].frees);
+    EXPECT_EQ(2u, stats.entries);
+    EXPECT_DOUBLE_EQ(stats[ContainerOperation::Register].BytesPerCall(), stats.BytesPerEntry());
+}
+
+TEST(AllocationTracker, ClearReleasesTrackedFootprint) {
+    CSomeContainer<int> container;
+    container.EnableAllocationTracking();
+    container.Register(0, std::auto_ptr<int>(new int(0)));
+    container.Clear(TeardownMode::Parallel);
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+
+    AllocationStats stats = container.Allocations();
+    EXPECT_EQ(1u, stats.other.frees);
+    EXPECT_EQ(stats[ContainerOperation::Register].BytesPerCall(), static_cast<double>(stats.LiveBytes()));
+}
+
+struct SizedObject {
+    size_t MemorySize() const { return 100; }
+};
+
+TEST(MemoryUsage, ReportsNodesAndPayload) {
+    CSomeContainer<int> container;
+    for (int i = 0; i < 10; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    ContainerMemoryUsage usage = container.MemoryUsage();
+    EXPECT_EQ(10u, usage.entries);
+    EXPECT_GE(usage.nodeBytes, sizeof(int) + sizeof(int*));
+    EXPECT_GE(usage.allocatedBytes, usage.storageBytes);
+    EXPECT_TRUE(usage.payloadKnown);
+    EXPECT_EQ(10 * sizeof(int), usage.payloadBytes);
+    EXPECT_GT(usage.OverheadRatio(), 1.0);
+}
+
+TEST(MemoryUsage, AsksObjectsForTheirSize) {
+    CSomeContainer<SizedObject> sized;
+    sized.Register(0, std::auto_ptr<SizedObject>(new SizedObject));
+    EXPECT_EQ(100u, sized.MemoryUsage().payloadBytes);
+
+    CSomeContainer<std::string> unknown;
+    unknown.Register(0, std::auto_ptr<std::string>(new std::string("payload")));
+    EXPECT_FALSE(unknown.MemoryUsage().payloadKnown);
+    EXPECT_EQ(0.0, unknown.MemoryUsage().OverheadRatio());
+}
+
+TEST(SpanTracer, ExportsSpansAsChromeTrace) {
+    CSomeContainer<int> container;
+    container.EnableTracing();
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+    container.RegisterAsync(2, []() { return std::auto_ptr<int>(new int(2)); }).get();
+    container.Query(1);
+    for (auto it = container.Start(); !(it == container.End()); ++it) {
+        *it;
+    }
+    container.Unregister(1);
+
+    std::ostringstream trace;
+    container.WriteTrace(trace);
+    std::string json = trace.str();
+    EXPECT_EQ(0u, json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+    const char* names[] = { "Register", "Query", "Unregister", "IteratorDereference", "Construct", "Destroy", "IteratorScan" };
+    for (const char* name : names) {
+        EXPECT_NE(std::string::npos, json.find(std::string("\"name\":\"") + name + "\"")) << name;
+    }
+    EXPECT_NE(std::string::npos, json.find("\"ph\":\"X\""));
+}
+
+TEST(SpanTracer, KeepsNewestSpansPerThread) {
+    CSpanTracer tracer(4);
+    for (int i = 0; i < 10; ++i) {
+        tracer.Record(SpanKind::Query, i, 100 + i, 200 + i);
+    }
+    std::ostringstream trace;
+    tracer.WriteChromeTrace(trace);
+    std::string json = trace.str();
+    EXPECT_EQ(std::string::npos, json.find("\"id\":5,"));
+    EXPECT_NE(std::string::npos, json.find("\"id\":8,"));
+    EXPECT_NE(std::string::npos, json.find("\"id\":9,"));
+}
+
+TEST(Snapshot, RoundTripsEntriesAcrossBlocks) {
+    std::string path = testing::TempDir() + "container.snapshot";
+    CSomeContainer<int> saved;
+    for (int i = 0; i < 1000; ++i) {
+        saved.Register(i * 3, std::auto_ptr<int>(new int(i)));
+    }
+    EXPECT_EQ(1000u, saved.SaveSnapshot(path, 64));
+
+    CSomeContainer<int> loaded;
+    EXPECT_EQ(1000u, loaded.LoadSnapshot(path));
+    std::remove(path.c_str());
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(i, *loaded.Query(i * 3));
+    }
+    EXPECT_THROW(loaded.Query(1), std::out_of_range);
+}
+
+TEST(Snapshot, LoadReplacesExistingObjects) {
+    std::string path = testing::TempDir() + "strings.snapshot";
+    CSomeContainer<std::string> saved;
+    saved.Register(1, std::auto_ptr<std::string>(new std::string("one")));
+    saved.Register(2, std::auto_ptr<std::string>(new std::string()));
+    saved.SaveSnapshot(path);
+
+    CSomeContainer<std::string> loaded;
+    loaded.Register(1, std::auto_ptr<std::string>(new std::string("stale")));
+    loaded.Register(3, std::auto_ptr<std::string>(new std::string("three")));
+    EXPECT_EQ(2u, loaded.LoadSnapshot(path));
+    std::remove(path.c_str());
+    EXPECT_EQ("one", *loaded.Query(1));
+    EXPECT_EQ("", *loaded.Query(2));
+    EXPECT_EQ("three", *loaded.Query(3));
+}
+
+TEST(Snapshot, MergesIntoPopulatedContainerInChunks) {
+    std::string path = testing::TempDir() + "merged.snapshot";
+    CSomeContainer<int> saved;
+    for (int i = 0; i < 10000; ++i) {
+        saved.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    saved.SaveSnapshot(path);
+
+    CSomeContainer<int> loaded;
+    loaded.Register(5, std::auto_ptr<int>(new int(-5)));
+    loaded.Register(20000, std::auto_ptr<int>(new int(20000)));
+    loaded.EnableStats();
+    EXPECT_EQ(10000u, loaded.LoadSnapshot(path));
+    std::remove(path.c_str());
+    EXPECT_EQ(5, *loaded.Query(5));
+    EXPECT_EQ(9999, *loaded.Query(9999));
+    EXPECT_EQ(20000, *loaded.Query(20000));
+    // the emptiness check, then one critical section per chunk
+    EXPECT_EQ(4u, loaded.Stats()[ContainerOperation::Register].hold.count);
+}
+
+TEST(Snapshot, DamagedFileLeavesContainerUnchanged) {
+    std::string path = testing::TempDir() + "damaged.snapshot";
+    CSomeContainer<int> saved;
+    for (int i = 0; i < 100; ++i) {
+        saved.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    saved.SaveSnapshot(path, 10);
+    {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(path.c_str(), "r+b"), std::fclose);
+        std::fseek(file.get(), sizeof(SnapshotFileHeader) + 40, SEEK_SET);
+        std::fputc(0x55, file.get());
+    }
+
+    CSomeContainer<int> loaded;
+    loaded.Register(7, std::auto_ptr<int>(new int(-7)));
+    EXPECT_THROW(loaded.LoadSnapshot(path), std::runtime_error);
+    EXPECT_THROW(loaded.LoadSnapshot(path + ".missing"), std::runtime_error);
+    std::remove(path.c_str());
+    EXPECT_EQ(-7, *loaded.Query(7));
+    EXPECT_THROW(loaded.Query(0), std::out_of_range);
+}
+
+TEST(FrozenContainer, ServesEntriesFromTheImage) {
+    std::string path = testing::TempDir() + "container.frozen";
+    CSomeContainer<std::string> saved;
+    for (int i = 0; i < 5000; ++i) {
+        saved.Register(i * 2, std::auto_ptr<std::string>(new std::string(std::to_string(i))));
+    }
+    saved.Register(-1, std::auto_ptr<std::string>());
+    EXPECT_EQ(5001u, saved.SaveFrozenImage(path, 100));
+
+    CFrozenContainer<std::string> frozen(path);
+    EXPECT_EQ(5001u, frozen.Size());
+    EXPECT_EQ(0u, frozen.Materialized());
+    EXPECT_EQ("1234", *frozen.Query(2468));
+    EXPECT_EQ("0", *frozen.Query(0));
+    EXPECT_EQ(nullptr, frozen.Query(-1));
+    EXPECT_TRUE(frozen.Contains(9998));
+    EXPECT_FALSE(frozen.Contains(3));
+    EXPECT_THROW(frozen.Query(3), std::out_of_range);
+    EXPECT_EQ(2u, frozen.Materialized());
+    std::remove(path.c_str());
+}
+
+TEST(FrozenContainer, MaterializesEachObjectOnce) {
+    std::string path = testing::TempDir() + "shared.frozen";
+    CSomeContainer<int> saved;
+    for (int i = 0; i < 100; ++i) {
+        saved.Register(i, std::auto_ptr<int>(new int(-i)));
+    }
+    saved.SaveFrozenImage(path);
+    CFrozenContainer<int> frozen(path);
+
+    std::vector<const int*> seen(4);
+    std::vector<std::thread> readers;
+    for (size_t t = 0; t < seen.size(); ++t) {
+        readers.push_back(std::thread([&frozen, &seen, t]() { seen[t] = frozen.Query(42); }));
+    }
+    for (auto it = readers.begin(); it != readers.end(); ++it) {
+        it->join();
+    }
+    for (size_t t = 0; t < seen.size(); ++t) {
+        EXPECT_EQ(seen[0], seen[t]);
+    }
+    EXPECT_EQ(-42, *seen[0]);
+    EXPECT_EQ(1u, frozen.Materialized());
+    EXPECT_THROW(CFrozenContainer<int>(path + ".missing"), std::runtime_error);
+    std::remove(path.c_str());
+}
+
+namespace {
+void RemoveLogFiles(const std::string& path)
+{
+    std::remove(CWriteAheadLog::BasePath(path).c_str());
+    for (uint64_t segment = 1; segment < 16; ++segment) {
+        std::remove(CWriteAheadLog::SegmentPath(path, segment).c_str());
+    }
+}
+}
+
+TEST(WriteAheadLog, RecoversThroughCheckpoints) {
+    std::string path = testing::TempDir() + "container.wal";
+    RemoveLogFiles(path);
+    WriteAheadLogOptions options;
+    options.syncToDisk = false;
+    options.entriesPerBlock = 16;
+    {
+        CSomeContainer<int> container;
+        container.EnableWriteAheadLog(path, options);
+        for (int i = 0; i < 100; ++i) {
+            container.Register(i, std::auto_ptr<int>(new int(i)));
+        }
+        container.Unregister(7);
+        container.RegisterAsync(200, []() { return std::auto_ptr<int>(new int(-200)); }).get();
+        EXPECT_EQ(102u, container.CheckpointLog());
+        container.Register(8, std::auto_ptr<int>(new int(-8)));
+        container.Unregister(9);
+    }
+    {
+        CSomeContainer<int> recovered;
+        EXPECT_EQ(2u, recovered.RecoverFromLog(path));
+        EXPECT_EQ(-8, *recovered.Query(8));
+        EXPECT_EQ(-200, *recovered.Query(200));
+        EXPECT_EQ(99, *recovered.Query(99));
+        EXPECT_THROW(recovered.Query(7), std::out_of_range);
+        EXPECT_THROW(recovered.Query(9), std::out_of_range);
+
+        recovered.EnableWriteAheadLog(path, options);
+        recovered.Register(300, std::auto_ptr<int>(new int(300)));
+        EXPECT_EQ(3u, recovered.CheckpointLog());
+        recovered.Clear();
+        recovered.Register(1, std::auto_ptr<int>(new int(-1)));
+        recovered.SyncLog();
+    }
+    CSomeContainer<int> restarted;
+    EXPECT_EQ(2u, restarted.RecoverFromLog(path));
+    EXPECT_EQ(-1, *restarted.Query(1));
+    EXPECT_THROW(restarted.Query(300), std::out_of_range);
+    RemoveLogFiles(path);
+}
+
+TEST(WriteAheadLog, LogsEntriesPresentWhenEnabled) {
+    std::string path = testing::TempDir() + "populated.wal";
+    RemoveLogFiles(path);
+    WriteAheadLogOptions options;
+    options.syncToDisk = false;
+    options.entriesPerBlock = 4;
+    {
+        CSomeContainer<int> container;
+        for (int i = 0; i < 10; ++i) {
+            container.Register(i, std::auto_ptr<int>(new int(i)));
+        }
+        container.EnableWriteAheadLog(path, options);
+        container.Register(10, std::auto_ptr<int>(new int(10)));
+        EXPECT_EQ(4u, container.CheckpointLog());
+    }
+    CSomeContainer<int> recovered;
+    EXPECT_EQ(0u, recovered.RecoverFromLog(path));
+    for (int i = 0; i <= 10; ++i) {
+        EXPECT_EQ(i, *recovered.Query(i));
+    }
+    RemoveLogFiles(path);
+}
+
+TEST(WriteAheadLog, IgnoresTornTail) {
+    std::string path = testing::TempDir() + "torn.wal";
+    RemoveLogFiles(path);
+    WriteAheadLogOptions options;
+    options.syncToDisk = false;
+    {
+        CSomeContainer<std::string> container;
+        container.EnableWriteAheadLog(path, options);
+        container.Register(1, std::auto_ptr<std::string>(new std::string("one")));
+        container.Register(2, std::auto_ptr<std::string>(new std::string("two")));
+    }
+    {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(CWriteAheadLog::SegmentPath(path, 1).c_str(), "ab"), std::fclose);
+        LogRecordHeader header = { 3, static_cast<uint32_t>(LogRecordKind::Remove), 4, 0 };
+        std::fwrite(&header, sizeof(header), 1, file.get());
+        std::fputc(1, file.get());
+    }
+    CSomeContainer<std::string> recovered;
+    EXPECT_EQ(2u, recovered.RecoverFromLog(path));
+    EXPECT_EQ("one", *recovered.Query(1));
+    EXPECT_EQ("two", *recovered.Query(2));
+    RemoveLogFiles(path);
+}
+
+#if defined(__linux__)
+TEST(WriteAheadLog, RecoversAfterFailedCommitIsRetried) {
+    std::string path = testing::TempDir() + "full.wal";
+    RemoveLogFiles(path);
+    WriteAheadLogOptions options;
+    options.syncToDisk = false;
+    {
+        CSomeContainer<std::string> container;
+        container.EnableWriteAheadLog(path, options);
+        container.Register(1, std::auto_ptr<std::string>(new std::string("one")));
+        container.SyncLog();
+
+        // writes past the limit fail with EFBIG instead of raising SIGXFSZ
+        void (*previousHandler)(int) = std::signal(SIGXFSZ, SIG_IGN);
+        rlimit previous;
+        getrlimit(RLIMIT_FSIZE, &previous);
+        rlimit limited = previous;
+        limited.rlim_cur = 4096;
+        setrlimit(RLIMIT_FSIZE, &limited);
+        container.Register(2, std::auto_ptr<std::string>(new std::string(8192, 'x')));
+        EXPECT_THROW(container.SyncLog(), std::runtime_error);
+        setrlimit(RLIMIT_FSIZE, &previous);
+        std::signal(SIGXFSZ, previousHandler);
+
+        // the retry replaces the part of the batch the failed write left behind
+        container.Register(3, std::auto_ptr<std::string>(new std::string("three")));
+        container.SyncLog();
+    }
+    CSomeContainer<std::string> recovered;
+    EXPECT_EQ(3u, recovered.RecoverFromLog(path));
+    EXPECT_EQ(8192u, recovered.Query(2)->size());
+    EXPECT_EQ("three", *recovered.Query(3));
+    RemoveLogFiles(path);
+}
+
+TEST(ForkSnapshot, SavesStateAtForkWhileWritersContinue) {
+    std::string path = testing::TempDir() + "forked.snapshot";
+    CSomeContainer<int> container;
+    for (int i = 0; i < 10000; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    std::future<ForkSnapshotStats> pending = container.SaveSnapshotForked(path, 512);
+    for (int i = 0; i < 10000; i += 2) {
+        container.Unregister(i);
+    }
+    ForkSnapshotStats stats = pending.get();
+    EXPECT_TRUE(stats.succeeded) << stats.error;
+    EXPECT_EQ(10000u, stats.entries);
+    EXPECT_GT(stats.pauseNanoseconds, 0u);
+    EXPECT_NE(0u, stats.pageSize);
+
+    CSomeContainer<int> loaded;
+    EXPECT_EQ(10000u, loaded.LoadSnapshot(path));
+    std::remove(path.c_str());
+    EXPECT_EQ(4, *loaded.Query(4));
+}
+#endif
+
+#if !defined(_WIN32)
+struct SharedRecord {
+    int32_t owner;
+    double load;
+};
+
+TEST(SharedContainer, HandlesShareOneCopy) {
+    std::string name = "/scshared-test-" + std::to_string(getpid());
+    CSharedContainer<SharedRecord>::Remove(name);
+    CSharedContainer<SharedRecord> first(name, 100);
+    CSharedContainer<SharedRecord> second(name, 1); // attaches, the creator's capacity wins
+    EXPECT_EQ(100u, second.Capacity());
+
+    SharedRecord record = { 7, 0.5 };
+    first.Register(1, record);
+    EXPECT_EQ(7, second.Query(1).owner);
+    record.owner = 8;
+    second.Register(1, record);
+    EXPECT_EQ(8, first.Query(1).owner);
+    EXPECT_EQ(1u, first.Size());
+    second.Unregister(1);
+    EXPECT_THROW(first.Query(1), std::out_of_range);
+
+    for (int i = 0; i < 100; ++i) {
+        first.Register(i, record);
+    }
+    EXPECT_THROW(first.Register(100, record), std::runtime_error);
+    first.Unregister(50);
+    first.Register(100, record); // the freed node is reused
+    EXPECT_EQ(100u, second.Size());
+    CSharedContainer<SharedRecord>::Remove(name);
+}
+
+TEST(SharedContainer, SeesWritesOfOtherProcesses) {
+    std::string name = "/scshared-fork-" + std::to_string(getpid());
+    CSharedContainer<SharedRecord>::Remove(name);
+    CSharedContainer<SharedRecord> parent(name, 1000);
+    pid_t child = fork();
+    if (child == 0) {
+        CSharedContainer<SharedRecord> attached(name, 1000);
+        for (int i = 0; i < 1000; ++i) {
+            SharedRecord record = { i, i / 2.0 };
+            attached.Register(i, record);
+        }
+        _exit(0);
+    }
+    // the reader races the other process's writers, every copy it gets must be whole
+    SharedRecord record;
+    int status = 0;
+    while (waitpid(child, &status, WNOHANG) == 0) {
+        for (int i = 0; i < 1000; ++i) {
+            if (parent.TryQuery(i, record)) {
+                EXPECT_EQ(i, record.owner);
+                EXPECT_EQ(i / 2.0, record.load);
+            }
+        }
+    }
+    EXPECT_EQ(1000u, parent.Size());
+    EXPECT_EQ(999, parent.Query(999).owner);
+    CSharedContainer<SharedRecord>::Remove(name);
+}
+
+TEST(SharedContainer, GivesUpOnASegmentThatNeverGetsReady) {
+    std::string name = "/scshared-stale-" + std::to_string(getpid());
+    CSharedContainer<SharedRecord>::Remove(name);
+    // what a creator leaves behind when it dies before finishing the set up
+    int descriptor = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    ASSERT_GE(descriptor, 0);
+    ASSERT_EQ(0, ftruncate(descriptor, 1 << 20));
+    close(descriptor);
+    EXPECT_THROW(CSharedContainer<SharedRecord>(name, 10), std::runtime_error);
+    CSharedContainer<SharedRecord>::Remove(name);
+
+#if defined(__linux__)
+    // a creator that cannot map its segment takes the segment with it
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t mapped = 0;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 7, "VmSize:") == 0) {
+            mapped = std::stoull(line.substr(7)) * 1024;
+        }
+    }
+    struct rlimit limit;
+    getrlimit(RLIMIT_AS, &limit);
+    struct rlimit tight = { mapped + (size_t(1) << 30), limit.rlim_max };
+    setrlimit(RLIMIT_AS, &tight);
+    EXPECT_THROW(CSharedContainer<SharedRecord>(name, size_t(1) << 28), std::runtime_error);
+    setrlimit(RLIMIT_AS, &limit);
+#endif
+    CSharedContainer<SharedRecord> fresh(name, 10); // creates afresh rather than waiting on a dead segment
+    EXPECT_EQ(10u, fresh.Capacity());
+    CSharedContainer<SharedRecord>::Remove(name);
+}
+#endif
+
+TEST(ChangeFeed, DeliversChangesInBatches) {
+    CSomeContainer<int> container;
+    EXPECT_THROW(container.Subscribe(), std::logic_error);
+    container.Register(5, std::auto_ptr<int>(new int(0))); // before the feed, not delivered
+    container.EnableChangeFeed(16);
+    CChangeSubscription subscription = container.Subscribe();
+
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+    container.Register(1, std::auto_ptr<int>(new int(2)));
+    container.Unregister(1);
+    container.Unregister(2); // missing, no change
+    container.Clear();
+
+    std::vector<ChangeEvent> batch;
+    EXPECT_TRUE(subscription.Poll(batch, 2));
+    ASSERT_EQ(2u, batch.size());
+    EXPECT_EQ(ChangeOp::Insert, batch[0].op);
+    EXPECT_EQ(1, batch[0].objectId);
+    EXPECT_EQ(ChangeOp::Replace, batch[1].op);
+    EXPECT_EQ(batch[0].version + 1, batch[1].version);
+    EXPECT_TRUE(subscription.Poll(batch, 10));
+    ASSERT_EQ(2u, batch.size());
+    EXPECT_EQ(ChangeOp::Remove, batch[0].op);
+    EXPECT_EQ(ChangeOp::Clear, batch[1].op);
+    EXPECT_TRUE(subscription.Poll(batch, 10));
+    EXPECT_TRUE(batch.empty());
+}
+
+TEST(ChangeFeed, SlowSubscriberIsToldToResync) {
+    CSomeContainer<int> container;
+    container.EnableChangeFeed(8);
+    CChangeSubscription fast = container.Subscribe();
+    CChangeSubscription slow = container.Subscribe();
+    std::vector<ChangeEvent> batch;
+    std::vector<int> seen;
+    for (int i = 0; i < 20; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+        EXPECT_TRUE(fast.Poll(batch, 8));
+        for (auto it = batch.begin(); it != batch.end(); ++it) {
+            seen.push_back(it->objectId);
+        }
+    }
+    EXPECT_EQ(20u, seen.size());
+    EXPECT_EQ(19, seen.back());
+
+    EXPECT_EQ(20u, slow.Lag());
+    EXPECT_FALSE(slow.Poll(batch, 8));
+    EXPECT_TRUE(batch.empty());
+    EXPECT_EQ(1u, slow.Resyncs());
+    container.Unregister(3);
+    EXPECT_TRUE(slow.Poll(batch, 8));
+    ASSERT_EQ(1u, batch.size());
+    EXPECT_EQ(ChangeOp::Remove, batch[0].op);
+    EXPECT_EQ(3, batch[0].objectId);
+}
+
+TEST(ChangeFeed, ConsumersKeepUpWithConcurrentWriters) {
+    CSomeContainer<int> container;
+    container.SetWriteMode(WriteMode::FlatCombining);
+    container.EnableChangeFeed(1 << 16);
+    CChangeSubscription subscription = container.Subscribe();
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; ++t) {
+        writers.push_back(std::thread([&container, t]() {
+            for (int i = 0; i < 1000; ++i) {
+                container.Register(t * 1000 + i, std::auto_ptr<int>(new int(i)));
+            }
+        }));
+    }
+    std::vector<ChangeEvent> batch;
+    uint64_t lastVersion = 0;
+    size_t inserts = 0;
+    while (inserts < 4000) {
+        ASSERT_TRUE(subscription.Poll(batch, 256));
+        for (auto it = batch.begin(); it != batch.end(); ++it) {
+            EXPECT_EQ(lastVersion + 1, it->version) << "versions have no gaps";
+            lastVersion = it->version;
+            inserts += it->op == ChangeOp::Insert ? 1 : 0;
+        }
+        std::this_thread::yield();
+    }
+    for (auto it = writers.begin(); it != writers.end(); ++it) {
+        it->join();
+    }
+    EXPECT_EQ(4000u, inserts);
+}
+
+TEST(VersionTracking, EnablingOnPopulatedContainerIndexesEveryId) {
+    CSomeContainer<int> container;
+    for (int i = 0; i < 100; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    container.EnableVersionTracking(); // every present id gets the same version
+    container.Register(50, std::auto_ptr<int>(new int(-50)));
+    container.Unregister(70);
+    std::set<int> present;
+    std::set<int> removed;
+    for (auto it = container.ChangedSince(0); !(it == container.ChangedEnd()); ++it) {
+        ((*it).removed ? removed : present).insert((*it).objectId);
+    }
+    EXPECT_EQ(99u, present.size());
+    EXPECT_EQ(std::set<int>({ 70 }), removed);
+    EXPECT_EQ(1u, present.count(50));
+    EXPECT_EQ(1u, present.count(99));
+}
+
+TEST(VersionTracking, MergedSnapshotStampsOnlyLoadedIds) {
+    std::string path = testing::TempDir() + "versioned.snapshot";
+    CSomeContainer<int> saved;
+    saved.Register(2, std::auto_ptr<int>(new int(2)));
+    saved.Register(3, std::auto_ptr<int>(new int(3)));
+    saved.SaveSnapshot(path);
+
+    CSomeContainer<int> container;
+    container.EnableVersionTracking();
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+    container.Register(2, std::auto_ptr<int>(new int(-2)));
+    uint64_t since = container.Version();
+    container.LoadSnapshot(path);
+    std::remove(path.c_str());
+    EXPECT_FALSE(container.NeedsRescan(since));
+    std::set<int> changed;
+    for (auto it = container.ChangedSince(since); !(it == container.ChangedEnd()); ++it) {
+        changed.insert((*it).objectId);
+    }
+    EXPECT_EQ(std::set<int>({ 2, 3 }), changed);
+}
+
+TEST(VersionTracking, WalksOnlyChangesSinceVersion) {
+    CSomeContainer<int> container;
+    EXPECT_THROW(container.ChangedSince(0), std::logic_error);
+    for (int i = 0; i < 1000; ++i) {
+        container.Register(i, std::auto_ptr<int>(new int(i)));
+    }
+    container.EnableVersionTracking();
+    uint64_t since = container.Version();
+    EXPECT_FALSE(container.NeedsRescan(since));
+    EXPECT_TRUE(container.NeedsRescan(since - 1));
+    EXPECT_TRUE(container.ChangedSince(since) == container.ChangedEnd());
+
+    container.Register(500, std::auto_ptr<int>(new int(-1)));
+    container.Unregister(7);
+    container.Register(2000, std::auto_ptr<int>(new int(2000)));
+    container.Register(500, std::auto_ptr<int>(new int(-2)));
+    std::vector<std::pair<int, bool> > visited;
+    auto it = container.ChangedSince(since);
+    uint64_t until = it.Until();
+    for (; !(it == container.ChangedEnd()); ++it) {
+        visited.push_back(std::make_pair((*it).objectId, (*it).removed));
+        if (!(*it).removed) {
+            EXPECT_EQ((*it).objectId == 500 ? -2 : (*it).objectId, *it.Object());
+        }
+    }
+    std::vector<std::pair<int, bool> > expected = { {7, true}, {2000, false}, {500, false} };
+    EXPECT_EQ(expected, visited);
+    EXPECT_EQ(container.Version(), until);
+    EXPECT_TRUE(container.ChangedSince(until) == container.ChangedEnd());
+
+    container.Unregister(8);
+    EXPECT_EQ(1u, container.DropTombstones(until));
+    EXPECT_TRUE(container.NeedsRescan(since));
+    it = container.ChangedSince(until);
+    ASSERT_FALSE(it == container.ChangedEnd());
+    EXPECT_EQ(8, (*it).objectId);
+    EXPECT_TRUE((*it).removed);
+
+    until = container.Version();
+    container.Clear();
+    EXPECT_TRUE(container.NeedsRescan(until));
+    EXPECT_FALSE(container.NeedsRescan(container.Version()));
+}
+
+TEST(VersionedContainer, ViewsSeeTheirTimestamp) {
+    CVersionedContainer<int> container(64);
+    container.Register(1, std::auto_ptr<int>(new int(10)));
+    container.Register(2, std::auto_ptr<int>(new int(20)));
+    CVersionedContainer<int>::CReadView before = container.Read();
+
+    container.Register(1, std::auto_ptr<int>(new int(11)));
+    container.Unregister(2);
+    container.Register(3, std::auto_ptr<int>(new int(30)));
+    CVersionedContainer<int>::CReadView after = container.Read();
+
+    EXPECT_EQ(10, *before.Query(1));
+    EXPECT_EQ(20, *before.Query(2));
+    EXPECT_FALSE(before.Contains(3));
+    EXPECT_EQ(11, *after.Query(1));
+    EXPECT_THROW(after.Query(2), std::out_of_range);
+    int sum = 0;
+    after.ForEach([&sum](int, const int* object) { sum += *object; });
+    EXPECT_EQ(41, sum);
+    EXPECT_EQ(2u, container.ReadAt(2).Timestamp());
+    EXPECT_EQ(20, *container.ReadAt(2).Query(2));
+}
+
+TEST(VersionedContainer, CollectsVersionsNoViewNeeds) {
+    int destroyed = 0;
+    struct Counted {
+        explicit Counted(int& destroyed) : destroyed(destroyed) {}
+        ~Counted() { ++destroyed; }
+        int& destroyed;
+    };
+    CVersionedContainer<Counted> container(64);
+    container.Register(1, std::auto_ptr<Counted>(new Counted(destroyed)));
+    {
+        CVersionedContainer<Counted>::CReadView view = container.Read();
+        for (int i = 0; i < 10; ++i) {
+            container.Register(1, std::auto_ptr<Counted>(new Counted(destroyed)));
+        }
+        // the open view is the horizon, everything after its timestamp stays
+        EXPECT_EQ(0u, container.Collect());
+        EXPECT_EQ(0, destroyed);
+        EXPECT_NO_THROW(view.Query(1));
+        EXPECT_EQ(11u, container.Versions());
+    }
+    EXPECT_EQ(10u, container.Collect());
+    EXPECT_EQ(1u, container.Versions());
+    EXPECT_EQ(10, destroyed);
+    EXPECT_THROW(container.ReadAt(1), std::out_of_range);
+    container.Unregister(1);
+    EXPECT_EQ(1u, container.Collect());
+    EXPECT_EQ(1u, container.Versions()); // the tombstone
+    EXPECT_EQ(11, destroyed);
+}
+
+TEST(VersionedContainer, RefusesViewsBeyondItsReaderSlots) {
+    CVersionedContainer<int> container(64, 2);
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+    {
+        CVersionedContainer<int>::CReadView first = container.Read();
+        CVersionedContainer<int>::CReadView second = container.ReadAt(0);
+        EXPECT_THROW(container.Read(), std::runtime_error);
+        EXPECT_THROW(container.ReadAt(1), std::runtime_error);
+        EXPECT_EQ(1, *first.Query(1));
+    }
+    CVersionedContainer<int>::CReadView again = container.Read(); // closing the views frees their slots
+    EXPECT_EQ(1, *again.Query(1));
+}
+
+TEST(VersionedContainer, ViewsStayConsistentUnderWriters) {
+    // every round writes the round number to ids 0..9 in order, a consistent
+    // view sees a prefix of ids at round r and the rest at round r - 1
+    CVersionedContainer<int> container(64, 8);
+    for (int id = 0; id < 10; ++id) {
+        container.Register(id, std::auto_ptr<int>(new int(0)));
+    }
+    std::atomic<bool> done(false);
+    std::thread writer([&container, &done]() {
+        for (int round = 1; round <= 2000; ++round) {
+            for (int id = 0; id < 10; ++id) {
+                container.Register(id, std::auto_ptr<int>(new int(round)));
+            }
+        }
+        done = true;
+    });
+    std::vector<std::thread> readers;
+    std::atomic<int> inconsistent(0);
+    for (int r = 0; r < 3; ++r) {
+        readers.push_back(std::thread([&container, &done, &inconsistent]() {
+            while (!done) {
+                CVersionedContainer<int>::CReadView view = container.Read();
+                int first = *view.Query(0);
+                int previous = first;
+                for (int id = 1; id < 10; ++id) {
+                    std::this_thread::yield(); // give the writer time to move on
+                    int value = *view.Query(id);
+                    if (value > previous || value < first - 1) {
+                        ++inconsistent;
+                    }
+                    previous = value;
+                }
+            }
+        }));
+    }
+    writer.join();
+    for (auto it = readers.begin(); it != readers.end(); ++it) {
+        it->join();
+    }
+    EXPECT_EQ(0, inconsistent.load());
+    container.Collect();
+    EXPECT_EQ(10u, container.Versions());
+}
+
+namespace {
+// Checks from its destructor that the container is not locked by the destroying thread
+struct LockProbe {
+    LockProbe(CSomeContainer<LockProbe>& container, std::atomic<int>& unlocked) : container(container), unlocked(unlocked) {}
+    ~LockProbe() {
+        std::future<bool> query = std::async(std::launch::async, [this]() { return container.Query(100) != nullptr; });
+        unlocked += query.wait_for(std::chrono::seconds(1)) == std::future_status::ready ? 1 : 0;
+    }
+    CSomeContainer<LockProbe>& container;
+    std::atomic<int>& unlocked;
+};
+}
+
+TEST(Transaction, CommitsStagedOperationsTogether) {
+    CSomeContainer<int> container;
+    container.EnableChangeFeed(16);
+    container.Register(1, std::auto_ptr<int>(new int(1)));
+    container.Register(2, std::auto_ptr<int>(new int(2)));
+    CChangeSubscription subscription = container.Subscribe();
+    {
+        CTransaction<int> dropped;
+        dropped.Register(9, std::auto_ptr<int>(new int(9)));
+    }
+    CTransaction<int> transaction;
+    transaction.Register(1, std::auto_ptr<int>(new int(10)));
+    transaction.Unregister(2);
+    transaction.Register(3, std::auto_ptr<int>(new int(30)));
+    transaction.Register(3, std::auto_ptr<int>(new int(31)));
+    container.Commit(transaction);
+    EXPECT_TRUE(transaction.Empty());
+    EXPECT_EQ(10, *container.Query(1));
+    EXPECT_THROW(container.Query(2), std::out_of_range);
+    EXPECT_EQ(31, *container.Query(3));
+    EXPECT_THROW(container.Query(9), std::out_of_range);
+
+    std::vector<ChangeEvent> batch;
+    EXPECT_TRUE(subscription.Poll(batch, 16));
+    ASSERT_EQ(4u, batch.size());
+    EXPECT_EQ(ChangeOp::Replace, batch[0].op);
+    EXPECT_EQ(ChangeOp::Remove, batch[1].op);
+    EXPECT_EQ(ChangeOp::Insert, batch[2].op);
+    EXPECT_EQ(ChangeOp::Replace, batch[3].op);
+}
+
+TEST(Transaction, DestroysDisplacedObjectsOutsideTheLock) {
+    CSomeContainer<LockProbe> container;
+    std::atomic<int> unlocked(0);
+    container.Register(100, std::auto_ptr<LockProbe>(nullptr));
+    container.Register(1, std::auto_ptr<LockProbe>(new LockProbe(container, unlocked)));
+    container.Register(2, std::auto_ptr<LockProbe>(new LockProbe(container, unlocked)));
+    CTransaction<LockProbe> transaction;
+    transaction.Register(1, std::auto_ptr<LockProbe>(nullptr));
+    transaction.Unregister(2);
+    container.Commit(transaction);
+    EXPECT_EQ(2, unlocked.load());
+}
+
+TEST(Transaction, RecoversWholeOrNotAtAll) {
+    std::string path = testing::TempDir() + "transaction.wal";
+    RemoveLogFiles(path);
+    WriteAheadLogOptions options;
+    options.syncToDisk = false;
+    {
+        CSomeContainer<int> container;
+        container.EnableWriteAheadLog(path, options);
+        container.Register(1, std::auto_ptr<int>(new int(1)));
+        CTransaction<int> transaction;
+        transaction.Register(2, std::auto_ptr<int>(new int(2)));
+        transaction.Unregister(1);
+        transaction.Register(3, std::auto_ptr<int>(new int(3)));
+        container.Commit(transaction);
+    }
+    {
+        CSomeContainer<int> recovered;
+        EXPECT_EQ(2u, recovered.RecoverFromLog(path));
+        EXPECT_THROW(recovered.Query(1), std::out_of_range);
+        EXPECT_EQ(2, *recovered.Query(2));
+        EXPECT_EQ(3, *recovered.Query(3));
+    }
+
+    // a crash that cut the transaction's record short loses all of it
+    std::string segment;
+    {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(CWriteAheadLog::SegmentPath(path, 1).c_str(), "rb"), std::fclose);
+        char buffer[4096];
+        for (size_t read; (read = std::fread(buffer, 1, sizeof(buffer), file.get())) != 0; ) {
+            segment.append(buffer, read);
+        }
+    }
+    {
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(CWriteAheadLog::SegmentPath(path, 1).c_str(), "wb"), std::fclose);
+        std::fwrite(segment.data(), segment.size() - 1, 1, file.get());
+    }
+    CSomeContainer<int> recovered;
+    EXPECT_EQ(1u, recovered.RecoverFromLog(path));
+    EXPECT_EQ(1, *recovered.Query(1));
+    EXPECT_THROW(recovered.Query(2), std::out_of_range);
+    EXPECT_THROW(recovered.Query(3), std::out_of_range);
+    RemoveLogFiles(path);
+}
+
+TEST(Transaction, ShardedCommitsAreAtomicAndDeadlockFree) {
+    CShardedContainer<int> container(4, false);
+    const int ids[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; ++t) {
+        writers.push_back(std::thread([&container, &ids, t]() {
+            for (int round = 0; round < 200; ++round) {
+                CTransaction<int> transaction;
+                int token = t * 1000 + round;
+                // every thread stages in another order, the commit orders the locks itself
+                for (int i = 0; i < 8; ++i) {
+                    int id = t % 2 ? ids[7 - i] : ids[i];
+                    transaction.Register(id, std::auto_ptr<int>(new int(token)));
+                }
+                container.Commit(transaction);
+            }
+        }));
+    }
+    for (auto it = writers.begin(); it != writers.end(); ++it) {
+        it->join();
+    }
+    int token = *container.Query(1);
+    for (int i = 0; i < 8; ++i) {
+        EXPECT_EQ(token, *container.Query(ids[i])) << "id " << ids[i];
+    }
+}
+
+TEST(ConditionalRegister, RegisterIfAbsentHandsObjectBack) {
+    CSomeContainer<int> container;
+    std::auto_ptr<int> first(new int(1));
+    EXPECT_TRUE(container.RegisterIfAbsent(1, first));
+    EXPECT_EQ(nullptr, first.get());
+    std::auto_ptr<int> second(new int(2));
+    EXPECT_FALSE(container.RegisterIfAbsent(1, second));
+    ASSERT_NE(nullptr, second.get());
+    EXPECT_EQ(2, *second);
+    EXPECT_EQ(1, *container.Query(1));
+    std::auto_ptr<int> third(new int(3));
+    EXPECT_THROW(container.ReplaceIfVersion(1, 0, third), std::logic_error);
+    EXPECT_EQ(3, *third);
+}
+
+TEST(ConditionalRegister, ReplaceIfVersionDetectsInterveningWrites) {
+    CSomeContainer<int> container;
+    container.EnableVersionTracking();
+    container.Register(1, std::auto_ptr<int>(new int(10)));
+    uint64_t version = 0;
+    int value = *container.QueryVersioned(1, version);
+
+    container.Register(1, std::auto_ptr<int>(new int(20))); // another updater got there first
+    std::auto_ptr<int> update(new int(value + 1));
+    EXPECT_FALSE(container.ReplaceIfVersion(1, version, update));
+    ASSERT_NE(nullptr, update.get());
+
+    *update = *container.QueryVersioned(1, version) + 1;
+    EXPECT_TRUE(container.ReplaceIfVersion(1, version, update));
+    EXPECT_EQ(nullptr, update.get());
+    EXPECT_EQ(21, *container.Query(1));
+    std::auto_ptr<int> missing(new int(0));
+    EXPECT_FALSE(container.ReplaceIfVersion(2, 0, missing));
+}
+
+TEST(ConditionalRegister, ConcurrentUpdatersWinOncePerVersion) {
+    CSomeContainer<int> container;
+    container.EnableVersionTracking();
+    container.Register(1, std::auto_ptr<int>(new int(0)));
+    uint64_t start = container.Version();
+    std::atomic<int> won(0);
+    std::vector<std::thread> updaters;
+    for (int t = 0; t < 4; ++t) {
+        updaters.push_back(std::thread([&container, &won, t]() {
+            std::auto_ptr<int> update(new int(t));
+            for (int attempt = 0; attempt < 500; ++attempt) {
+                uint64_t version = 0;
+                container.QueryVersioned(1, version);
+                if (container.ReplaceIfVersion(1, version, update)) {
+                    ++won;
+                    update.reset(new int(t));
+                } else {
+                    EXPECT_EQ(t, *update);
+                }
+            }
+        }));
+    }
+    for (auto it = updaters.begin(); it != updaters.end(); ++it) {
+        it->join();
+    }
+    // every win replaced a distinct version
+    EXPECT_EQ(start + won.load(), container.Version());
+    EXPECT_GE(won.load(), 500);
+}
@@ -12,5 +12,8 @@ SOURCES += \
 win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../mylib/release/ -lmylib
 else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../mylib/debug/ -lmylib
 
+# shm_open lives in librt before glibc 2.34
+linux: LIBS += -lrt
+
 INCLUDEPATH += $$PWD/../mylib
 DEPENDPATH += $$PWD/../mylib